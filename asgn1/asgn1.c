@@ -29,9 +29,30 @@
 #include <linux/mm.h>
 #include <linux/proc_fs.h>
 #include <linux/device.h>
+#include <linux/mutex.h>
+#include <linux/percpu-rwsem.h>
+#include <linux/wait.h>
+#include <linux/sched.h>
+#include <linux/poll.h>
+#include <linux/spinlock.h>
+#include <linux/rculist.h>
+#include <linux/debugfs.h>
+#include <linux/miscdevice.h>
+#include <linux/seq_file.h>
+#include <linux/jiffies.h>
+#include <linux/radix-tree.h>
+#include <linux/mman.h>
+#include <linux/pagemap.h>
+#include <linux/highmem.h>
+#include <linux/workqueue.h>
+#include <linux/completion.h>
+#include <linux/crc32c.h>
+#include <linux/file.h>
+#include <linux/percpu.h>
+#include <linux/nodemask.h>
+#include "asgn1.h"
 
 #define MYDEV_NAME "asgn1"
-#define MYIOC_TYPE 'k'
 
 MODULE_LICENSE("GPL");
 MODULE_AUTHOR("Joshua La Pine");
@@ -44,21 +65,108 @@ MODULE_DESCRIPTION("COSC440 asgn1");
 typedef struct page_node_rec {
   struct list_head list;
   struct page *page;
+  unsigned long index;  /* position of this page in the list */
+  u32 reads;            /* heat map: read() calls touching this page */
+  u32 writes;           /* heat map: write() calls touching this page */
+  u32 faults;           /* heat map: page faults through mmap */
+  unsigned long last_access; /* heat map: jiffies of the last access */
+  struct list_head lru; /* cache mode: position in the LRU list while resident */
+  int loading;          /* cache mode: the page is being read in without cache_lock */
+  int readmostly;       /* read() is served from per node copies of the page */
+  struct page **replicas; /* read-mostly copies indexed by NUMA node, allocated
+                             when the page is first marked */
 } page_node;
 
 typedef struct asgn1_dev_t {
   dev_t dev;            /* the device */
   struct cdev *cdev;   
   struct list_head mem_list; /*pointer to the head of the page list*/ 
-  int num_pages;        /* number of memory pages this module currently holds */
-  size_t data_size;     /* total data size in this module */
+  struct radix_tree_root page_tree; /* index of the page list by page number */
+  spinlock_t tree_lock;    /* serialises changes to the page index and its tags */
+  unsigned long num_pages; /* number of memory pages this module currently holds */
+  atomic64_t data_size; /* total data size in this module */
   atomic_t nprocs;      /* number of processes accessing this device */ 
   atomic_t max_nprocs;  /* max number of processes accessing this device */
   struct kmem_cache *cache;      /* cache memory */
   struct class *class;     /* the udev class */
   struct device *device;   /* the udev device node */
+  struct mutex lock;       /* serialises positional access and truncation */
+  unsigned long ring_pages; /* capacity in pages when in ring mode, 0 otherwise */
+  struct mutex alloc_lock; /* serialises growing the page list */
+  struct percpu_rw_semaphore append_sem; /* held shared by appenders, exclusively
+                                            while pages are freed */
+  atomic64_t tail;         /* end of the last reserved write range */
+  wait_queue_head_t commit_wq; /* writers waiting for earlier ranges to commit */
+  spinlock_t commit_lock;  /* serialises raising the commit watermark */
+  struct list_head commit_pending; /* ranges of killed writers, committed by
+                                      whoever raises the watermark to them */
+  wait_queue_head_t data_wq;   /* readers waiting for data past their position */
+  atomic_t wake_pending;   /* set by readers about to sleep, cleared by the
+                              first writer to wake them */
+  struct asgn1_stats *stats; /* the statistics page user space can map */
+  spinlock_t stats_lock;   /* serialises refreshes of the statistics page */
+  atomic_t stats_maps;     /* mappings of the statistics page */
+  struct delayed_work stats_work; /* refreshes the statistics page while mapped */
+  struct address_space *mapping; /* the device inode mapping, for zapping user mappings */
+  struct dentry *debugfs;  /* the debugfs directory */
+  struct workqueue_struct *bulk_wq; /* workers of the parallel copy engine */
+  spinlock_t share_lock;   /* protects sharer counts and the swaps that break sharing */
+  atomic_t shared_pages;   /* extra offsets sharing pages, 0 when nothing is shared */
+  atomic_t readmostly_pages; /* pages marked read-mostly, 0 when nothing is replicated */
+  struct file *backing;    /* the backing file in cache mode, NULL otherwise */
+  struct mutex cache_lock; /* protects residency, the LRU list and the dirty tags */
+  struct list_head lru;    /* resident pages, least recently used first */
+  unsigned long resident;  /* pages currently loaded */
+  wait_queue_head_t load_wq; /* tasks waiting for a page another task is loading */
+  unsigned long ra_next;   /* page a sequential reader would miss next */
+  unsigned long ra_start;  /* next page the read-ahead work loads */
+  unsigned long ra_end;    /* end of the current read-ahead window */
+  unsigned int ra_window;  /* current read-ahead window in pages */
+  struct work_struct readahead_work; /* loads the read-ahead window in the background */
+  struct delayed_work writeback_work; /* background write-back of dirty pages */
 } asgn1_dev;
 
+/**
+ * Per open file state, kept in filp->private_data.
+ */
+typedef struct asgn1_file_t {
+  int follow;           /* reads at the end sleep for more data, like tail -f */
+} asgn1_file;
+
+/**
+ * A range whose writer was killed while waiting for its turn to commit. The
+ * data is already in place, so the writer committing the range before it
+ * carries the watermark on through it.
+ */
+struct asgn1_pending {
+  struct list_head list;
+  loff_t start;
+  loff_t end;
+};
+
+/* Operation types accounted in the statistics page*/
+enum asgn1_stat {
+  STAT_READ,
+  STAT_WRITE,
+  STAT_MMAP,
+  STAT_IOCTL,
+  STAT_ALLOC_FAIL,
+  STAT_CACHE_HIT,
+  STAT_CACHE_MISS,
+  STAT_WRITEBACK,
+  STAT_EVICT
+};
+
+/* Access types recorded in the heat map*/
+enum asgn1_heat {
+  HEAT_READ,
+  HEAT_WRITE,
+  HEAT_FAULT
+};
+
+/* Heat map tracking switch, toggled through debugfs*/
+u32 asgn1_heat_enabled __read_mostly = 0;
+
 asgn1_dev asgn1_device;
 struct proc_dir_entry *asgn1_proc;        /*Proc entry*/
 
@@ -66,29 +174,696 @@ int asgn1_major = 0;                      /* major number of module */
 int asgn1_minor = 0;                      /* minor number of module */
 int asgn1_dev_count = 1;                  /* number of devices */
 
+/* Writes of at least this many bytes bypass the cache, 0 never does*/
+static unsigned long nocache_threshold = 1024 * 1024;
+module_param(nocache_threshold, ulong, 0644);
+MODULE_PARM_DESC(nocache_threshold, "write size in bytes from which copies into the device bypass the cache (0 disables)");
+
+/* Transfers of at least this many bytes are split across workers, 0 never are*/
+static unsigned long parallel_threshold = 0;
+module_param(parallel_threshold, ulong, 0644);
+MODULE_PARM_DESC(parallel_threshold, "read or write size in bytes from which copies are split across workers (0 disables)");
+
+/* Number of workers a parallel copy is split across, 0 uses every online cpu*/
+static unsigned int parallel_workers = 0;
+module_param(parallel_workers, uint, 0644);
+MODULE_PARM_DESC(parallel_workers, "workers a parallel copy is split across (0 for one per online cpu)");
+
+/* Cache mode: the device caches this file instead of being a plain ramdisk*/
+static char *backing_file = NULL;
+module_param(backing_file, charp, 0444);
+MODULE_PARM_DESC(backing_file, "file the device caches in RAM, which turns on cache mode");
+
+static unsigned long cache_pages = 16384;
+module_param(cache_pages, ulong, 0644);
+MODULE_PARM_DESC(cache_pages, "pages kept in RAM in cache mode before clean pages are evicted");
+
+static unsigned int readahead_pages = 32;
+module_param(readahead_pages, uint, 0644);
+MODULE_PARM_DESC(readahead_pages, "largest read-ahead window in pages for sequential misses in cache mode");
+
+static unsigned int writeback_ms = 5000;
+module_param(writeback_ms, uint, 0644);
+MODULE_PARM_DESC(writeback_ms, "delay in milliseconds before dirty pages are written back in cache mode");
+
+/* Refresh period of a mapped statistics page*/
+#define STATS_REFRESH_MS 100
+
+/**
+ * Operation counters behind the statistics page. They are per cpu so the
+ * hot paths never share a lock or a cache line, and are summed into the
+ * page when it is faulted in and then every STATS_REFRESH_MS while it is
+ * mapped.
+ */
+struct asgn1_stat_count {
+  u64 reads;
+  u64 read_bytes;
+  u64 writes;
+  u64 write_bytes;
+  u64 mmaps;
+  u64 mmap_bytes;
+  u64 ioctls;
+  u64 alloc_failures;
+  u64 cache_hits;
+  u64 cache_misses;
+  u64 writebacks;
+  u64 evictions;
+};
+
+static DEFINE_PER_CPU(struct asgn1_stat_count, asgn1_stat_counts);
+
+/* Accounts one operation of the given type on this cpu*/
+static void asgn1_stats_account(enum asgn1_stat type, size_t bytes) {
+  switch(type){
+  case STAT_READ:
+    this_cpu_inc(asgn1_stat_counts.reads);
+    this_cpu_add(asgn1_stat_counts.read_bytes, bytes);
+    break;
+  case STAT_WRITE:
+    this_cpu_inc(asgn1_stat_counts.writes);
+    this_cpu_add(asgn1_stat_counts.write_bytes, bytes);
+    break;
+  case STAT_MMAP:
+    this_cpu_inc(asgn1_stat_counts.mmaps);
+    this_cpu_add(asgn1_stat_counts.mmap_bytes, bytes);
+    break;
+  case STAT_IOCTL:
+    this_cpu_inc(asgn1_stat_counts.ioctls);
+    break;
+  case STAT_ALLOC_FAIL:
+    this_cpu_inc(asgn1_stat_counts.alloc_failures);
+    break;
+  case STAT_CACHE_HIT:
+    this_cpu_inc(asgn1_stat_counts.cache_hits);
+    break;
+  case STAT_CACHE_MISS:
+    this_cpu_inc(asgn1_stat_counts.cache_misses);
+    break;
+  case STAT_WRITEBACK:
+    this_cpu_inc(asgn1_stat_counts.writebacks);
+    break;
+  case STAT_EVICT:
+    this_cpu_inc(asgn1_stat_counts.evictions);
+    break;
+  }
+}
+
+/**
+ * Sums the per cpu counters and the gauges into the statistics page. The
+ * page is updated in place under its sequence number, so a monitor mapping
+ * it reads consistent snapshots without a system call.
+ */
+static void asgn1_stats_refresh(void) {
+  struct asgn1_stats *stats = asgn1_device.stats;
+  struct asgn1_stat_count sum, *count;
+  int cpu;
+
+  memset(&sum, 0, sizeof(sum));
+  for_each_possible_cpu(cpu){
+    count = per_cpu_ptr(&asgn1_stat_counts, cpu);
+    sum.reads += count->reads;
+    sum.read_bytes += count->read_bytes;
+    sum.writes += count->writes;
+    sum.write_bytes += count->write_bytes;
+    sum.mmaps += count->mmaps;
+    sum.mmap_bytes += count->mmap_bytes;
+    sum.ioctls += count->ioctls;
+    sum.alloc_failures += count->alloc_failures;
+    sum.cache_hits += count->cache_hits;
+    sum.cache_misses += count->cache_misses;
+    sum.writebacks += count->writebacks;
+    sum.evictions += count->evictions;
+  }
+
+  spin_lock(&asgn1_device.stats_lock);
+  stats->seq++;
+  smp_wmb();
+
+  stats->num_pages = ACCESS_ONCE(asgn1_device.num_pages);
+  stats->data_size = atomic64_read(&asgn1_device.data_size);
+  stats->nprocs = atomic_read(&asgn1_device.nprocs);
+  stats->reads = sum.reads;
+  stats->read_bytes = sum.read_bytes;
+  stats->writes = sum.writes;
+  stats->write_bytes = sum.write_bytes;
+  stats->mmaps = sum.mmaps;
+  stats->mmap_bytes = sum.mmap_bytes;
+  stats->ioctls = sum.ioctls;
+  stats->alloc_failures = sum.alloc_failures;
+  stats->cache_hits = sum.cache_hits;
+  stats->cache_misses = sum.cache_misses;
+  stats->writebacks = sum.writebacks;
+  stats->evictions = sum.evictions;
+
+  smp_wmb();
+  stats->seq++;
+  spin_unlock(&asgn1_device.stats_lock);
+}
+
+/* Refreshes the statistics page and comes back while anything maps it*/
+static void asgn1_stats_work(struct work_struct *work) {
+  asgn1_stats_refresh();
+  if(atomic_read(&asgn1_device.stats_maps))
+    schedule_delayed_work(&asgn1_device.stats_work, msecs_to_jiffies(STATS_REFRESH_MS));
+}
+
+
+/**
+ * Pages marked read-mostly with ASGN1_SET_READMOSTLY get a copy on every
+ * NUMA node that reads them, made on the first read() from that node, so
+ * reference data read by every socket is served from local memory. A write
+ * takes the page out of replication and drops its copies before it copies
+ * anything in, through the same hook that breaks page sharing; it stays
+ * unreplicated until it is marked again. Mappings always use the master
+ * page. Copies are published and dropped with atomic exchanges, and readers
+ * take them with a speculative reference that is checked afterwards, so no
+ * lock is shared between nodes.
+ */
+struct asgn1_numa_stat {
+  unsigned long local;    /* reads of a page held on the reader's node */
+  unsigned long replica;  /* reads served from a local copy */
+  unsigned long remote;   /* reads of a page held on another node */
+  unsigned long built;    /* copies made on this node */
+};
+
+/* Per cpu so readers on different nodes never share a counter line*/
+static DEFINE_PER_CPU(struct asgn1_numa_stat, asgn1_numa_stats);
+
+/* Takes curr out of replication and drops its copies*/
+static void asgn1_drop_replicas(page_node *curr) {
+  struct page *page;
+  int nid;
+
+  if(!xchg(&curr->readmostly, 0))
+    return;
+  atomic_dec(&asgn1_device.readmostly_pages);
+  for_each_node(nid){
+    page = xchg(&curr->replicas[nid], NULL);
+    if(page)
+      put_page(page);
+  }
+}
+
+/**
+ * Returns the copy of curr on node nid with a reference held, making it if
+ * there is none yet, or NULL if the master page has to be read instead. A
+ * new copy is withdrawn again if a writer cleared readmostly meanwhile:
+ * writers clear it before they write and then drop the copies, so a copy
+ * that stays published was taken before any write.
+ */
+static struct page *asgn1_replica_get(page_node *curr, int nid) {
+  struct page *page = ACCESS_ONCE(curr->replicas[nid]);
+
+  if(page && get_page_unless_zero(page)){
+    if(ACCESS_ONCE(curr->replicas[nid]) == page)
+      return page;
+    put_page(page);
+    return NULL;
+  }
+
+  page = alloc_pages_node(nid, GFP_KERNEL | __GFP_THISNODE | __GFP_NORETRY | __GFP_NOWARN, 0);
+  if(!page)
+    return NULL;
+  copy_highpage(page, ACCESS_ONCE(curr->page));
+  get_page(page);
+  if(cmpxchg(&curr->replicas[nid], NULL, page) != NULL){
+    put_page(page);
+    put_page(page);
+    return NULL;
+  }
+  smp_mb();
+  if(!ACCESS_ONCE(curr->readmostly)){
+    if(cmpxchg(&curr->replicas[nid], page, NULL) == page)
+      put_page(page);
+    put_page(page);
+    return NULL;
+  }
+  this_cpu_inc(asgn1_numa_stats.built);
+  return page;
+}
+
+/**
+ * Returns the page a read() of curr should copy from, counting where it was
+ * found. *replica is set if it is a local copy, whose reference the caller
+ * drops when done.
+ */
+static inline struct page *asgn1_read_page(page_node *curr, int *replica) {
+  struct page *page = ACCESS_ONCE(curr->page);
+  int nid = numa_node_id();
+
+  *replica = 0;
+  if(page_to_nid(page) == nid){
+    this_cpu_inc(asgn1_numa_stats.local);
+    return page;
+  }
+  if(unlikely(ACCESS_ONCE(curr->readmostly))){
+    page = asgn1_replica_get(curr, nid);
+    if(page){
+      *replica = 1;
+      this_cpu_inc(asgn1_numa_stats.replica);
+      return page;
+    }
+    page = ACCESS_ONCE(curr->page);
+  }
+  this_cpu_inc(asgn1_numa_stats.remote);
+  return page;
+}
+
+
 /**
- * This function frees all memory pages held by the module.
+ * Records an access to a page in the heat map. Counters are updated without
+ * a lock, so concurrent appenders may lose the odd increment.
+ */
+static void asgn1_heat_touch(page_node *curr, enum asgn1_heat type) {
+  switch(type){
+  case HEAT_READ:
+    curr->reads++;
+    break;
+  case HEAT_WRITE:
+    curr->writes++;
+    break;
+  case HEAT_FAULT:
+    curr->faults++;
+    break;
+  }
+  curr->last_access = jiffies;
+}
+
+
+/**
+ * This function frees all memory pages held by the module. The pages are
+ * removed from the index and the list is unlinked, then an RCU grace period
+ * passes before anything is freed, so the fault handler never sees a freed
+ * node. User mappings are then zapped; a page still referenced by a mapping
+ * is only released once it is unmapped.
  */
 void free_memory_pages(void) {
   page_node *curr, *temp;
+  struct asgn1_pending *pending, *next;
+  LIST_HEAD(freed);
+
+  spin_lock(&asgn1_device.tree_lock);
+  list_for_each_entry(curr, &asgn1_device.mem_list, list)
+    radix_tree_delete(&asgn1_device.page_tree, curr->index);
+  spin_unlock(&asgn1_device.tree_lock);
+  list_splice_init_rcu(&asgn1_device.mem_list, &freed, synchronize_rcu);
+  if(asgn1_device.mapping)
+    unmap_mapping_range(asgn1_device.mapping, 0, 0, 1);
 
   /* loops through the page list and frees each page*/
-  list_for_each_entry_safe(curr, temp, &asgn1_device.mem_list, list){
+  list_for_each_entry_safe(curr, temp, &freed, list){
     if(curr->page != NULL){
-      __free_page(curr->page);
+      set_page_private(curr->page, 0);
+      put_page(curr->page);
     }
+    asgn1_drop_replicas(curr);
+    kfree(curr->replicas);
     list_del(&curr->list);
     kfree(curr);
-    printk(KERN_INFO "Freed memory");
   }
+  printk(KERN_INFO "Freed memory\n");
 
   /* resets data size and num pages to initial values*/
-  asgn1_device.data_size = 0;
+  spin_lock(&asgn1_device.commit_lock);
+  list_for_each_entry_safe(pending, next, &asgn1_device.commit_pending, list){
+    list_del(&pending->list);
+    kfree(pending);
+  }
+  atomic64_set(&asgn1_device.data_size, 0);
+  spin_unlock(&asgn1_device.commit_lock);
   asgn1_device.num_pages = 0;
+  atomic64_set(&asgn1_device.tail, 0);
+  atomic_set(&asgn1_device.shared_pages, 0);
+  atomic_set(&asgn1_device.readmostly_pages, 0);
+  INIT_LIST_HEAD(&asgn1_device.lru);
+  asgn1_device.resident = 0;
   
 }
 
 
+/**
+ * Returns the first offset still held by the device. Outside of ring mode this
+ * is always 0. In ring mode the oldest pages are overwritten once the capacity
+ * is reached, so the window starts at the oldest page that survived.
+ */
+static loff_t asgn1_window_start(void) {
+  unsigned long end_page = (atomic64_read(&asgn1_device.data_size) + PAGE_SIZE - 1) >> PAGE_SHIFT;
+
+  if(asgn1_device.ring_pages == 0 || end_page <= asgn1_device.ring_pages)
+    return 0;
+
+  return (loff_t)(end_page - asgn1_device.ring_pages) << PAGE_SHIFT;
+}
+
+
+/**
+ * Returns the page node which holds the given page number, looked up in the
+ * page index rather than by walking the list. In ring mode page numbers wrap
+ * around onto the fixed set of pages. Callers hold the device lock, the
+ * append semaphore or the RCU read lock, so nodes are not freed under them.
+ */
+static page_node *asgn1_page_at(unsigned long page_no) {
+  if(asgn1_device.ring_pages)
+    page_no %= asgn1_device.ring_pages;
+
+  return radix_tree_lookup(&asgn1_device.page_tree, page_no);
+}
+
+
+/**
+ * Radix tree tags share words between entries, so every insertion, deletion
+ * and tag change of the page index is made under tree_lock. Lookups and tag
+ * tests only need the RCU read lock. Tag 0 is the cache mode dirty tag.
+ */
+#define ASGN1_TAG_CHANGED 1
+
+/* Inserts curr into the page index, tagging it changed if changed is set*/
+static int asgn1_index_insert(page_node *curr, int changed) {
+  int result = radix_tree_preload(GFP_KERNEL);
+
+  if(result)
+    return result;
+  spin_lock(&asgn1_device.tree_lock);
+  result = radix_tree_insert(&asgn1_device.page_tree, curr->index, curr);
+  if(result == 0 && changed)
+    radix_tree_tag_set(&asgn1_device.page_tree, curr->index, ASGN1_TAG_CHANGED);
+  spin_unlock(&asgn1_device.tree_lock);
+  radix_tree_preload_end();
+  return result;
+}
+
+/* Sets or clears a tag of the page index entry at index*/
+static void asgn1_index_tag(unsigned long index, unsigned int tag, int set) {
+  spin_lock(&asgn1_device.tree_lock);
+  if(set)
+    radix_tree_tag_set(&asgn1_device.page_tree, index, tag);
+  else
+    radix_tree_tag_clear(&asgn1_device.page_tree, index, tag);
+  spin_unlock(&asgn1_device.tree_lock);
+}
+
+/**
+ * Records that the page of curr has changed since ASGN1_GET_DIRTY last
+ * cleared it. write() paths call this after copying into the page and
+ * page_mkwrite before the mapping becomes writable. Rewriting a page that is
+ * already tagged only costs the lockless test.
+ */
+static inline void asgn1_mark_changed(page_node *curr) {
+  if(!radix_tree_tag_get(&asgn1_device.page_tree, curr->index, ASGN1_TAG_CHANGED))
+    asgn1_index_tag(curr->index, ASGN1_TAG_CHANGED, 1);
+}
+
+
+/**
+ * Returns the page node following curr, wrapping back to the first page at the
+ * end of the list. Wrapping only happens in ring mode once it is full.
+ */
+static page_node *asgn1_next_page(page_node *curr) {
+  if(list_is_last(&curr->list, &asgn1_device.mem_list))
+    return list_first_entry(&asgn1_device.mem_list, page_node, list);
+  return list_entry(curr->list.next, page_node, list);
+}
+
+
+/**
+ * Allocates pages until the device can hold end bytes. In ring mode the page
+ * list never grows beyond the ring capacity. Appenders walk the list without
+ * the device lock, so new nodes are published with list_add_tail_rcu and the
+ * page count is only raised once the node is visible. Pages are zeroed so a
+ * range reserved but never written reads back as zeroes.
+ */
+static int asgn1_alloc_pages(loff_t end) {
+  unsigned long needed = (end + PAGE_SIZE - 1) >> PAGE_SHIFT;
+  page_node *curr;
+  int result = 0;
+
+  if(asgn1_device.ring_pages && needed > asgn1_device.ring_pages)
+    needed = asgn1_device.ring_pages;
+
+  /* in cache mode pages are only loaded on access*/
+  if(asgn1_device.backing){
+    mutex_lock(&asgn1_device.alloc_lock);
+    if(asgn1_device.num_pages < needed)
+      asgn1_device.num_pages = needed;
+    mutex_unlock(&asgn1_device.alloc_lock);
+    return 0;
+  }
+
+  mutex_lock(&asgn1_device.alloc_lock);
+  while(asgn1_device.num_pages < needed){
+    curr = kzalloc(sizeof(page_node), GFP_KERNEL);
+    if(!curr){
+      printk(KERN_WARNING "page_node allocation failed\n");
+      result = -ENOMEM;
+      break;
+    }
+    curr->page = alloc_page(GFP_KERNEL | __GFP_ZERO);
+    if(curr->page == NULL){
+      printk(KERN_WARNING "Page allocation failed\n");
+      kfree(curr);
+      result = -ENOMEM;
+      break;
+    }
+    curr->index = asgn1_device.num_pages;
+    /* a page coming into existence counts as changed*/
+    result = asgn1_index_insert(curr, 1);
+    if(result){
+      printk(KERN_WARNING "Page index insertion failed\n");
+      __free_page(curr->page);
+      kfree(curr);
+      break;
+    }
+    list_add_tail_rcu(&(curr->list), &asgn1_device.mem_list);
+    smp_wmb();
+    asgn1_device.num_pages++;
+  }
+  mutex_unlock(&asgn1_device.alloc_lock);
+
+  if(result)
+    asgn1_stats_account(STAT_ALLOC_FAIL, 0);
+  return result;
+}
+
+
+/**
+ * Pages can be shared between offsets by ASGN1_COPY_RANGE. The number of
+ * other offsets sharing a page is kept in its page_private under share_lock,
+ * and every path that writes into a page first gives its offset a private
+ * copy. This gives curr the copy page if its page is still shared and
+ * returns whether page was used. The old page stays alive through the other
+ * offsets, so it is released right away. Does not sleep; the caller zaps
+ * mappings of the offset.
+ */
+static int asgn1_unshare_with(page_node *curr, struct page *page) {
+  struct page *old;
+
+  spin_lock(&asgn1_device.share_lock);
+  old = curr->page;
+  if(!page_private(old)){
+    spin_unlock(&asgn1_device.share_lock);
+    return 0;
+  }
+  copy_highpage(page, old);
+  set_page_private(old, page_private(old) - 1);
+  atomic_dec(&asgn1_device.shared_pages);
+  smp_wmb();
+  ACCESS_ONCE(curr->page) = page;
+  spin_unlock(&asgn1_device.share_lock);
+  put_page(old);
+  return 1;
+}
+
+/**
+ * Gives curr a private copy of its page if that is shared, and drops its
+ * read-mostly copies, before it is written.
+ */
+static int asgn1_unshare(page_node *curr) {
+  struct page *page;
+
+  if(unlikely(ACCESS_ONCE(curr->readmostly)))
+    asgn1_drop_replicas(curr);
+  if(!page_private(ACCESS_ONCE(curr->page)))
+    return 0;
+  page = alloc_page(GFP_KERNEL);
+  if(!page){
+    asgn1_stats_account(STAT_ALLOC_FAIL, 0);
+    return -ENOMEM;
+  }
+  if(!asgn1_unshare_with(curr, page)){
+    __free_page(page);
+    return 0;
+  }
+  if(asgn1_device.mapping)
+    unmap_mapping_range(asgn1_device.mapping, (loff_t)curr->index << PAGE_SHIFT, PAGE_SIZE, 0);
+  return 0;
+}
+
+/* Unshares every page between start and end, which have been allocated*/
+static int asgn1_unshare_range(loff_t start, loff_t end) {
+  unsigned long page_no;
+  int result;
+
+  if(likely(!atomic_read(&asgn1_device.shared_pages) &&
+            !atomic_read(&asgn1_device.readmostly_pages)))
+    return 0;
+  for(page_no = start >> PAGE_SHIFT; (loff_t)page_no << PAGE_SHIFT < end; page_no++){
+    result = asgn1_unshare(asgn1_page_at(page_no));
+    if(result)
+      return result;
+  }
+  return 0;
+}
+
+/**
+ * Puts page, whose reference the caller hands over, in place of the page at
+ * curr. Returns the old page if this was its last offset, for the caller to
+ * release after an RCU grace period, or NULL if other offsets still share it.
+ */
+static struct page *asgn1_replace_page(page_node *curr, struct page *page) {
+  struct page *old;
+  int shared = 0;
+
+  spin_lock(&asgn1_device.share_lock);
+  old = curr->page;
+  smp_wmb();
+  ACCESS_ONCE(curr->page) = page;
+  if(page_private(old)){
+    set_page_private(old, page_private(old) - 1);
+    atomic_dec(&asgn1_device.shared_pages);
+    shared = 1;
+  }
+  spin_unlock(&asgn1_device.share_lock);
+
+  if(shared){
+    put_page(old);
+    return NULL;
+  }
+  return old;
+}
+
+
+/**
+ * Returns the committed data size. Writers raise it in reservation order, so
+ * everything below it has been fully copied in.
+ */
+static loff_t asgn1_committed(void) {
+  loff_t size = atomic64_read(&asgn1_device.data_size);
+
+  smp_rmb();
+  return size;
+}
+
+
+/**
+ * Returns how far the device can be read. An append whose page allocation
+ * failed is still committed, so outside ring mode the size is also capped by
+ * the pages actually held.
+ */
+static loff_t asgn1_readable_size(void) {
+  loff_t size = asgn1_committed();
+
+  if(!asgn1_device.ring_pages)
+    size = min_t(loff_t, size, (loff_t)ACCESS_ONCE(asgn1_device.num_pages) << PAGE_SHIFT);
+  return size;
+}
+
+
+/**
+ * Wait condition for readers following the device. The reader asks to be
+ * woken before it checks, so a writer committing in between is not missed.
+ */
+static int asgn1_data_beyond(loff_t pos) {
+  atomic_set(&asgn1_device.wake_pending, 1);
+  smp_mb();
+  return asgn1_readable_size() > pos;
+}
+
+
+/**
+ * Wakes readers waiting for data. Only the first commit after a reader armed
+ * wake_pending does the wakeup, so a burst of small writes wakes each reader
+ * once instead of once per write.
+ */
+static void asgn1_wake_readers(void) {
+  smp_mb();
+  if(atomic_read(&asgn1_device.wake_pending) && atomic_xchg(&asgn1_device.wake_pending, 0))
+    wake_up_interruptible(&asgn1_device.data_wq);
+}
+
+
+/* Raises the watermark to end and on through pending ranges, under commit_lock*/
+static void asgn1_raise_watermark(loff_t end) {
+  struct asgn1_pending *pending, *next;
+  int found = 1;
+
+  while(found){
+    found = 0;
+    list_for_each_entry_safe(pending, next, &asgn1_device.commit_pending, list){
+      if(pending->start == end){
+        end = pending->end;
+        list_del(&pending->list);
+        kfree(pending);
+        found = 1;
+      }
+    }
+  }
+  smp_wmb(); /* the copied data must be visible before the new size*/
+  atomic64_set(&asgn1_device.data_size, end);
+}
+
+/**
+ * Publishes the reserved range [start, end) to readers once every range
+ * reserved before it has been published. Ranges are reserved back to back, so
+ * data_size acts as the commit watermark and only one writer can match it.
+ * A writer killed while waiting leaves its range on the pending list, so the
+ * watermark still passes it and later writers are not stalled behind it;
+ * only if that list entry cannot be allocated does it wait on regardless.
+ */
+static void asgn1_commit(loff_t start, loff_t end) {
+  struct asgn1_pending *pending = NULL;
+
+  if(wait_event_killable(asgn1_device.commit_wq, atomic64_read(&asgn1_device.data_size) == start)){
+    pending = kmalloc(sizeof(*pending), GFP_KERNEL);
+    spin_lock(&asgn1_device.commit_lock);
+    if(pending && atomic64_read(&asgn1_device.data_size) != start){
+      pending->start = start;
+      pending->end = end;
+      list_add_tail(&pending->list, &asgn1_device.commit_pending);
+      spin_unlock(&asgn1_device.commit_lock);
+      return;
+    }
+    spin_unlock(&asgn1_device.commit_lock);
+    kfree(pending);
+    wait_event(asgn1_device.commit_wq, atomic64_read(&asgn1_device.data_size) == start);
+  }
+
+  spin_lock(&asgn1_device.commit_lock);
+  asgn1_raise_watermark(end);
+  spin_unlock(&asgn1_device.commit_lock);
+  wake_up_all(&asgn1_device.commit_wq);
+  asgn1_wake_readers();
+}
+
+
+/**
+ * Called by positional writes which ended at end. If that is past the
+ * reserved tail, the gap is reserved and committed like an append would be.
+ */
+static void asgn1_extend(loff_t end) {
+  long long old = atomic64_read(&asgn1_device.tail);
+  long long seen;
+
+  while(end > old){
+    seen = atomic64_cmpxchg(&asgn1_device.tail, old, end);
+    if(seen == old){
+      asgn1_commit(old, end);
+      return;
+    }
+    old = seen;
+  }
+}
+
+
 /**
  * This function opens the virtual disk, if it is opened in the write-only
  * mode, all memory pages will be freed.
@@ -99,194 +874,1435 @@ int asgn1_open(struct inode *inode, struct file *filp) {
   if(atomic_read(&asgn1_device.nprocs) >= atomic_read(&asgn1_device.max_nprocs))
     return -EBUSY;
 
+  filp->private_data = kzalloc(sizeof(asgn1_file), GFP_KERNEL);
+  if(!filp->private_data)
+    return -ENOMEM;
+  asgn1_device.mapping = filp->f_mapping;
+
   atomic_inc(&asgn1_device.nprocs);
 
-  /*Frees memory pages when device opened in write only mode*/
-  if((filp->f_flags & O_ACCMODE) == O_WRONLY){
+  /*Frees memory pages when device opened in write only mode, which would
+    only drop the cache in cache mode, so the backing file is left alone*/
+  if((filp->f_flags & O_ACCMODE) == O_WRONLY && !asgn1_device.backing){
     printk(KERN_INFO "Write only");
+    mutex_lock(&asgn1_device.lock);
+    percpu_down_write(&asgn1_device.append_sem);
     free_memory_pages();
+    percpu_up_write(&asgn1_device.append_sem);
+    mutex_unlock(&asgn1_device.lock);
+  }
+
+  return 0; /* success */
+}
+
+
+/**
+ * This function releases the virtual disk and frees the per file state.
+ */
+int asgn1_release (struct inode *inode, struct file *filp) {
+
+  /*Decrements number of processes*/
+  kfree(filp->private_data);
+  atomic_dec(&asgn1_device.nprocs);  
+  return 0;
+}
+
+
+#define ASGN1_TAG_DIRTY 0
+#define WRITEBACK_BATCH 16
+
+/**
+ * Cache mode. The device fronts a backing file: page nodes are created on
+ * first access and their pages loaded from the file on a miss, with
+ * read-ahead once misses turn sequential. Written pages are tagged dirty in
+ * the page index and written back in the background, and clean pages are
+ * evicted in LRU order once more than cache_pages are resident. All of this
+ * is under cache_lock, which is never held while user memory is touched or
+ * the backing file is read or written: a page being loaded is marked so the
+ * lock can be dropped around the read, and other users of that page wait on
+ * load_wq until it is in. Read-ahead runs from a work item, so the task that
+ * missed only waits for its own page.
+ */
+
+/* Reads or writes len bytes at pos of the backing file from or into addr*/
+static ssize_t asgn1_backing_io(void *addr, size_t len, loff_t pos, int write) {
+  mm_segment_t old_fs = get_fs();
+  ssize_t result;
+
+  set_fs(KERNEL_DS);
+  if(write)
+    result = vfs_write(asgn1_device.backing, (const char __user *)addr, len, &pos);
+  else
+    result = vfs_read(asgn1_device.backing, (char __user *)addr, len, &pos);
+  set_fs(old_fs);
+  return result;
+}
+
+/* Tags a resident page dirty and makes sure write-back will run*/
+static void asgn1_cache_mark_dirty(page_node *curr) {
+  asgn1_index_tag(curr->index, ASGN1_TAG_DIRTY, 1);
+  schedule_delayed_work(&asgn1_device.writeback_work, msecs_to_jiffies(writeback_ms));
+}
+
+/**
+ * Frees the least recently used clean page nobody else holds. Dirty pages
+ * wait for write-back, and pages that are mapped or being copied are
+ * skipped. If nothing can go the cache grows past its capacity instead.
+ */
+static void asgn1_cache_evict(void) {
+  page_node *curr;
+
+  list_for_each_entry(curr, &asgn1_device.lru, lru){
+    if(radix_tree_tag_get(&asgn1_device.page_tree, curr->index, ASGN1_TAG_DIRTY) ||
+       page_count(curr->page) != 1)
+      continue;
+    list_del_init(&curr->lru);
+    put_page(curr->page);
+    curr->page = NULL;
+    asgn1_device.resident--;
+    asgn1_stats_account(STAT_EVICT, 0);
+    return;
+  }
+}
+
+/* Returns the node of page page_no, creating it on first access*/
+static page_node *asgn1_cache_node(unsigned long page_no) {
+  page_node *curr = radix_tree_lookup(&asgn1_device.page_tree, page_no);
+
+  if(curr)
+    return curr;
+  curr = kzalloc(sizeof(page_node), GFP_KERNEL);
+  if(!curr)
+    return NULL;
+  curr->index = page_no;
+  INIT_LIST_HEAD(&curr->lru);
+  if(asgn1_index_insert(curr, 0)){
+    kfree(curr);
+    return NULL;
+  }
+  list_add_tail_rcu(&curr->list, &asgn1_device.mem_list);
+  return curr;
+}
+
+/**
+ * Loads the page of curr, reading it from the backing file unless fill is 0.
+ * Called with cache_lock held, which is dropped around the allocation and
+ * the read; the node is marked loading meanwhile, so nobody else loads or
+ * frees it, and the tasks that waited for it are woken once it is in.
+ */
+static int asgn1_cache_load(page_node *curr, int fill) {
+  struct page *page;
+  ssize_t result = 0;
+
+  if(asgn1_device.resident >= ACCESS_ONCE(cache_pages))
+    asgn1_cache_evict();
+
+  curr->loading = 1;
+  mutex_unlock(&asgn1_device.cache_lock);
+  page = alloc_page(GFP_KERNEL | __GFP_ZERO);
+  if(!page){
+    asgn1_stats_account(STAT_ALLOC_FAIL, 0);
+    result = -ENOMEM;
+  } else if(fill){
+    /* a short read past the end of the file leaves the rest zeroed*/
+    result = asgn1_backing_io(page_address(page), PAGE_SIZE, (loff_t)curr->index << PAGE_SHIFT, 0);
+    if(result < 0){
+      __free_page(page);
+      page = NULL;
+    }
+  }
+  mutex_lock(&asgn1_device.cache_lock);
+
+  curr->loading = 0;
+  wake_up_all(&asgn1_device.load_wq);
+  if(!page)
+    return result;
+  curr->page = page;
+  list_add_tail(&curr->lru, &asgn1_device.lru);
+  asgn1_device.resident++;
+  return 0;
+}
+
+/* Waits with cache_lock dropped until another task has finished loading curr*/
+static void asgn1_cache_wait(page_node *curr) {
+  while(curr->loading){
+    mutex_unlock(&asgn1_device.cache_lock);
+    wait_event(asgn1_device.load_wq, !ACCESS_ONCE(curr->loading));
+    mutex_lock(&asgn1_device.cache_lock);
+  }
+}
+
+/**
+ * Loads the pages of the read-ahead window that are not resident yet. A
+ * sequential reader catching up with it loads the page it needs itself, and
+ * the work skips pages that are resident or being loaded by then.
+ */
+static void asgn1_readahead_work(struct work_struct *work) {
+  page_node *curr;
+
+  mutex_lock(&asgn1_device.cache_lock);
+  while(asgn1_device.ra_start < asgn1_device.ra_end){
+    curr = asgn1_cache_node(asgn1_device.ra_start++);
+    if(!curr)
+      break;
+    if(!curr->page && !curr->loading && asgn1_cache_load(curr, 1))
+      break;
+  }
+  mutex_unlock(&asgn1_device.cache_lock);
+}
+
+/**
+ * Returns page page_no with a reference held, loading it on a miss. An
+ * access of type HEAT_WRITE tags the page dirty; whole says it will
+ * overwrite the entire page, so a miss need not read it from the file.
+ * A miss at the page a sequential reader would miss next, or inside the
+ * window read-ahead has not got to yet, doubles the read-ahead window up to
+ * readahead_pages and hands the pages after page_no to the read-ahead work;
+ * any other miss resets it.
+ */
+static struct page *asgn1_cache_get(unsigned long page_no, enum asgn1_heat type, int whole) {
+  struct page *page;
+  page_node *curr;
+  int miss = 0;
+  int result;
+
+  mutex_lock(&asgn1_device.cache_lock);
+  curr = asgn1_cache_node(page_no);
+  if(!curr){
+    mutex_unlock(&asgn1_device.cache_lock);
+    return ERR_PTR(-ENOMEM);
+  }
+  asgn1_cache_wait(curr);
+
+  if(curr->page){
+    list_move_tail(&curr->lru, &asgn1_device.lru);
+    asgn1_stats_account(STAT_CACHE_HIT, 0);
+  } else {
+    asgn1_stats_account(STAT_CACHE_MISS, 0);
+    result = asgn1_cache_load(curr, !(type == HEAT_WRITE && whole));
+    if(result){
+      mutex_unlock(&asgn1_device.cache_lock);
+      return ERR_PTR(result);
+    }
+    miss = 1;
+  }
+
+  /* the reference also keeps read-ahead from evicting the page just loaded*/
+  page = curr->page;
+  get_page(page);
+  if(type == HEAT_WRITE)
+    asgn1_cache_mark_dirty(curr);
+  if(unlikely(asgn1_heat_enabled)) asgn1_heat_touch(curr, type);
+
+  if(miss && type != HEAT_WRITE){
+    if(page_no >= asgn1_device.ra_next && page_no <= asgn1_device.ra_end)
+      asgn1_device.ra_window = clamp_t(unsigned int, asgn1_device.ra_window * 2, 1,
+                                       ACCESS_ONCE(readahead_pages));
+    else
+      asgn1_device.ra_window = 0;
+    asgn1_device.ra_next = page_no + 1;
+    asgn1_device.ra_start = page_no + 1;
+    asgn1_device.ra_end = min_t(unsigned long, page_no + 1 + asgn1_device.ra_window,
+                                ACCESS_ONCE(asgn1_device.num_pages));
+    if(asgn1_device.ra_start < asgn1_device.ra_end)
+      schedule_work(&asgn1_device.readahead_work);
+  }
+  mutex_unlock(&asgn1_device.cache_lock);
+  return page;
+}
+
+/* Tags page page_no dirty again once a copy into it has finished*/
+static void asgn1_cache_redirty(unsigned long page_no) {
+  page_node *curr;
+
+  mutex_lock(&asgn1_device.cache_lock);
+  curr = radix_tree_lookup(&asgn1_device.page_tree, page_no);
+  if(curr && curr->page){
+    asgn1_cache_mark_dirty(curr);
+    asgn1_mark_changed(curr);
+  }
+  mutex_unlock(&asgn1_device.cache_lock);
+}
+
+/**
+ * Copies between a user buffer and the device in cache mode, one page at a
+ * time. Each page is tagged dirty before a write and again after it, so
+ * write-back running in between cannot leave it marked clean. If a write
+ * that skipped loading a page faults part way, the rest of that page is
+ * read back from the file. Returns the bytes copied, or an error if none
+ * were. Called with the device lock held.
+ */
+static ssize_t asgn1_cache_copy(char __user *buf, size_t count, loff_t *f_pos, int write) {
+  size_t done = 0, off, chunk, left;
+  struct page *page;
+  int whole;
+
+  while(done < count){
+    off = *f_pos & ~PAGE_MASK;
+    chunk = min_t(size_t, count - done, PAGE_SIZE - off);
+    whole = write && chunk == PAGE_SIZE;
+    page = asgn1_cache_get(*f_pos >> PAGE_SHIFT, write ? HEAT_WRITE : HEAT_READ, whole);
+    if(IS_ERR(page))
+      return done ? done : PTR_ERR(page);
+
+    if(write){
+      left = copy_from_user(page_address(page) + off, buf + done, chunk);
+      if(left && whole)
+        asgn1_backing_io(page_address(page) + chunk - left, left, *f_pos + chunk - left, 0);
+      asgn1_cache_redirty(*f_pos >> PAGE_SHIFT);
+    } else {
+      left = copy_to_user(buf + done, page_address(page) + off, chunk);
+    }
+    put_page(page);
+    done += chunk - left;
+    *f_pos += chunk - left;
+    if(left)
+      return done ? done : -EFAULT;
+  }
+  return done;
+}
+
+/**
+ * Writes back one batch of dirty pages from index *next on, moving *next past
+ * them, and returns how many were found, or an error. The dirty tags are
+ * cleared and the pages' mappings zapped before the data is written, so a
+ * write racing with write-back tags the page again through asgn1_vm_mkwrite
+ * or asgn1_cache_redirty. Only data below the device size is written, so the
+ * file never grows past the device; a page reaching past the end may still
+ * be being written, so it stays dirty. Failed pages stay dirty too.
+ */
+static int asgn1_cache_writeback(unsigned long *next) {
+  page_node *nodes[WRITEBACK_BATCH];
+  struct page *pages[WRITEBACK_BATCH];
+  loff_t size = asgn1_committed();
+  loff_t pos;
+  size_t len;
+  int n, i, result = 0;
+
+  mutex_lock(&asgn1_device.cache_lock);
+  n = radix_tree_gang_lookup_tag(&asgn1_device.page_tree, (void **)nodes, *next, WRITEBACK_BATCH,
+                                 ASGN1_TAG_DIRTY);
+  for(i = 0; i < n; i++){
+    if(((loff_t)nodes[i]->index << PAGE_SHIFT) + PAGE_SIZE <= size)
+      asgn1_index_tag(nodes[i]->index, ASGN1_TAG_DIRTY, 0);
+    pages[i] = nodes[i]->page;
+    get_page(pages[i]);
+  }
+  mutex_unlock(&asgn1_device.cache_lock);
+  if(n)
+    *next = nodes[n - 1]->index + 1;
+
+  for(i = 0; i < n; i++){
+    pos = (loff_t)nodes[i]->index << PAGE_SHIFT;
+    if(asgn1_device.mapping)
+      unmap_mapping_range(asgn1_device.mapping, pos, PAGE_SIZE, 0);
+    if(result == 0 && pos < size){
+      len = min_t(loff_t, PAGE_SIZE, size - pos);
+      if(asgn1_backing_io(page_address(pages[i]), len, pos, 1) == len)
+        asgn1_stats_account(STAT_WRITEBACK, len);
+      else
+        result = -EIO;
+    }
+    if(result){
+      mutex_lock(&asgn1_device.cache_lock);
+      asgn1_index_tag(nodes[i]->index, ASGN1_TAG_DIRTY, 1);
+      mutex_unlock(&asgn1_device.cache_lock);
+    }
+    put_page(pages[i]);
+  }
+  return result ? result : n;
+}
+
+/* Writes back every dirty page*/
+static int asgn1_cache_flush(void) {
+  unsigned long next = 0;
+  int result;
+
+  do {
+    result = asgn1_cache_writeback(&next);
+  } while(result == WRITEBACK_BATCH);
+  return result < 0 ? result : 0;
+}
+
+/* Background write-back, retried later if the backing file fails*/
+static void asgn1_writeback_work(struct work_struct *work) {
+  int result = asgn1_cache_flush();
+
+  if(result){
+    printk(KERN_WARNING "%s: write-back failed: %d\n", MYDEV_NAME, result);
+    schedule_delayed_work(&asgn1_device.writeback_work, msecs_to_jiffies(writeback_ms));
+  }
+}
+
+/* Flushes dirty pages to the backing file and syncs it; nothing to do for a ramdisk*/
+static int asgn1_fsync(struct file *filp, loff_t start, loff_t end, int datasync) {
+  int result;
+
+  if(!asgn1_device.backing)
+    return 0;
+  result = asgn1_cache_flush();
+  if(result)
+    return result;
+  return vfs_fsync(asgn1_device.backing, datasync);
+}
+
+
+#define BULK_BATCH 64
+#define BULK_MAX_WORKERS 64
+#define BULK_MIN_EXTENT (1024 * 1024)
+
+/**
+ * A parallel copy between the device and one user buffer. The caller sleeps
+ * on done until the last of its extents has been copied.
+ */
+typedef struct asgn1_bulk_rec {
+  struct task_struct *task; /* the caller, whose buffer is pinned by the workers */
+  struct mm_struct *mm;
+  int write;                /* copying from the user buffer into the device */
+  atomic_t pending;         /* extents not finished yet */
+  struct completion done;
+} asgn1_bulk;
+
+/* One extent of a parallel copy, handed to a single worker*/
+typedef struct asgn1_extent_rec {
+  struct work_struct work;
+  asgn1_bulk *bulk;
+  loff_t pos;               /* device offset of the extent */
+  unsigned long addr;       /* user address of the extent */
+  size_t len;
+  size_t done;              /* bytes copied, short if the user buffer faulted */
+} asgn1_extent;
+
+/* Returns whether a transfer of count bytes goes through the parallel copy engine*/
+static inline int asgn1_parallel(size_t count) {
+  unsigned long threshold = ACCESS_ONCE(parallel_threshold);
+
+  return threshold && count >= threshold;
+}
+
+/**
+ * Copies one extent. The caller's buffer is pinned BULK_BATCH pages at a time
+ * through its mm, and each piece is copied between the kmapped user page and
+ * the device page, so the worker never touches user addresses directly.
+ */
+static void asgn1_bulk_work(struct work_struct *work) {
+  asgn1_extent *ext = container_of(work, asgn1_extent, work);
+  asgn1_bulk *bulk = ext->bulk;
+  struct page *pages[BULK_BATCH];
+  struct page *src;
+  unsigned long addr, first;
+  loff_t pos = ext->pos;
+  size_t batch_len, copied, chunk, user_off, dev_off;
+  long npages, got, i;
+  page_node *curr;
+  int replica;
+  char *user;
+
+  curr = asgn1_page_at(pos >> PAGE_SHIFT);
+  while(ext->done < ext->len){
+    addr = ext->addr + ext->done;
+    first = addr & PAGE_MASK;
+    batch_len = min_t(size_t, ext->len - ext->done, BULK_BATCH * PAGE_SIZE - (addr - first));
+    npages = (addr - first + batch_len + PAGE_SIZE - 1) >> PAGE_SHIFT;
+
+    down_read(&bulk->mm->mmap_sem);
+    got = get_user_pages(bulk->task, bulk->mm, first, npages, !bulk->write, 0, pages, NULL);
+    up_read(&bulk->mm->mmap_sem);
+    if(got <= 0) break;
+    if(got < npages)
+      batch_len = ((size_t)got << PAGE_SHIFT) - (addr - first);
+
+    for(copied = 0; copied < batch_len; copied += chunk){
+      user_off = (addr + copied) & ~PAGE_MASK;
+      dev_off = pos & ~PAGE_MASK;
+      chunk = min_t(size_t, batch_len - copied, PAGE_SIZE - max(user_off, dev_off));
+      if(unlikely(asgn1_heat_enabled) && (dev_off == 0 || copied == 0))
+        asgn1_heat_touch(curr, bulk->write ? HEAT_WRITE : HEAT_READ);
+      user = kmap(pages[(addr + copied - first) >> PAGE_SHIFT]);
+      if(bulk->write){
+        memcpy(page_address(curr->page) + dev_off, user + user_off, chunk);
+        asgn1_mark_changed(curr);
+      } else {
+        src = asgn1_read_page(curr, &replica);
+        memcpy(user + user_off, page_address(src) + dev_off, chunk);
+        if(replica) put_page(src);
+      }
+      kunmap(pages[(addr + copied - first) >> PAGE_SHIFT]);
+      pos += chunk;
+      if(!(pos & ~PAGE_MASK))
+        curr = asgn1_next_page(curr);
+    }
+
+    for(i = 0; i < got; i++){
+      if(!bulk->write)
+        set_page_dirty_lock(pages[i]);
+      put_page(pages[i]);
+    }
+    ext->done += batch_len;
+    if(got < npages) break;
+  }
+
+  if(atomic_dec_and_test(&bulk->pending))
+    complete(&bulk->done);
+}
+
+/**
+ * Splits a large read or write into extents starting on device page
+ * boundaries and copies them concurrently on the bulk workqueue, returning
+ * once all of them are done. Returns the bytes copied without a gap; the
+ * caller copies whatever is left itself, so 0 just means falling back to the
+ * serial copy. Called with the device lock held and the pages allocated.
+ */
+static size_t asgn1_bulk_copy(unsigned long addr, size_t count, loff_t pos, int write) {
+  asgn1_bulk bulk;
+  asgn1_extent *ext;
+  unsigned int nworkers = ACCESS_ONCE(parallel_workers);
+  size_t extent_len, lead = pos & ~PAGE_MASK;
+  size_t start, end, done = 0;
+  unsigned int i, n;
+
+  if(nworkers == 0)
+    nworkers = num_online_cpus();
+  nworkers = clamp_t(unsigned int, nworkers, 1, BULK_MAX_WORKERS);
+  extent_len = PAGE_ALIGN(max_t(size_t, BULK_MIN_EXTENT, count / nworkers + 1));
+  n = DIV_ROUND_UP(count + lead, extent_len);
+
+  ext = kcalloc(n, sizeof(*ext), GFP_KERNEL);
+  if(!ext)
+    return 0;
+
+  bulk.task = current;
+  bulk.mm = current->mm;
+  bulk.write = write;
+  atomic_set(&bulk.pending, n);
+  init_completion(&bulk.done);
+
+  /* every extent but the first starts on a device page boundary*/
+  for(i = 0; i < n; i++){
+    start = i ? i * extent_len - lead : 0;
+    end = min_t(size_t, count, (i + 1) * extent_len - lead);
+    ext[i].bulk = &bulk;
+    ext[i].pos = pos + start;
+    ext[i].addr = addr + start;
+    ext[i].len = end - start;
+    INIT_WORK(&ext[i].work, asgn1_bulk_work);
+    queue_work(asgn1_device.bulk_wq, &ext[i].work);
+  }
+  wait_for_completion(&bulk.done);
+
+  for(i = 0; i < n; i++){
+    done += ext[i].done;
+    if(ext[i].done < ext[i].len) break;
+  }
+  kfree(ext);
+  return done;
+}
+
+
+/**
+ * This function reads contents of the virtual disk and writes to the user.
+ * In ring mode a reader that fell behind the valid window skips forward to
+ * the oldest data still held. A reader in follow mode sleeps at the end of
+ * the data until a writer commits more, or gets -EAGAIN with O_NONBLOCK.
+ */
+ssize_t asgn1_read(struct file *filp, char __user *buf, size_t count,
+                   loff_t *f_pos) {
+  size_t size_read = 0;     /* size read from virtual disk in this function */
+  size_t begin_offset;      /* the offset from the beginning of a page to
+                               start reading */
+  size_t size_to_copy;      /* size of data to copy from the current page */
+  size_t size_not_copied;   /* size copy_to_user failed to copy */
+  size_t actual_size;       /* total data to be read in this call */
+  loff_t window_start;      /* first offset still held by the device */
+  loff_t data_size;         /* committed data size at the start of the read */
+  page_node *curr;          /* the page currently being read */
+  struct page *page;        /* the page or local copy being copied from */
+  int replica;              /* whether page is a read-mostly copy */
+  ssize_t copied;           /* size copied in cache mode */
+  asgn1_file *file = filp->private_data;
+
+  if(mutex_lock_interruptible(&asgn1_device.lock))
+    return -ERESTARTSYS;
+
+  data_size = asgn1_readable_size();
+  while(file->follow && *f_pos >= data_size){
+    mutex_unlock(&asgn1_device.lock);
+    if(filp->f_flags & O_NONBLOCK)
+      return -EAGAIN;
+    if(wait_event_interruptible(asgn1_device.data_wq, asgn1_data_beyond(*f_pos)))
+      return -ERESTARTSYS;
+    if(mutex_lock_interruptible(&asgn1_device.lock))
+      return -ERESTARTSYS;
+    data_size = asgn1_readable_size();
+  }
+
+  window_start = asgn1_window_start();
+  if(*f_pos < window_start) *f_pos = window_start;
+
+  /*Returns if file position is at or beyond the data size*/
+  if(*f_pos >= data_size){
+    mutex_unlock(&asgn1_device.lock);
+    asgn1_stats_account(STAT_READ, 0);
+    return 0;
+  }
+
+  actual_size = min_t(loff_t, count, data_size - *f_pos); /*Calculates the acutal size of data to be read*/
+
+  if(asgn1_device.backing){
+    copied = asgn1_cache_copy(buf, actual_size, f_pos, 0);
+    mutex_unlock(&asgn1_device.lock);
+    if(copied < 0)
+      return copied;
+    asgn1_stats_account(STAT_READ, copied);
+    return copied;
+  }
+
+  if(asgn1_parallel(actual_size)){
+    size_read = asgn1_bulk_copy((unsigned long)buf, actual_size, *f_pos, 0);
+    *f_pos += size_read;
+  }
+
+  /* reads the appropriate amount from each page starting at the page holding f_pos*/
+  curr = asgn1_page_at(*f_pos >> PAGE_SHIFT);
+  while(size_read < actual_size){
+    begin_offset = *f_pos & ~PAGE_MASK;
+    size_to_copy = min_t(size_t, actual_size - size_read, PAGE_SIZE - begin_offset);
+    if(unlikely(asgn1_heat_enabled)) asgn1_heat_touch(curr, HEAT_READ);
+    page = asgn1_read_page(curr, &replica);
+    size_not_copied = copy_to_user(buf + size_read, page_address(page) + begin_offset,
+                                   size_to_copy);
+    if(replica) put_page(page);
+    size_read += size_to_copy - size_not_copied;
+    *f_pos += size_to_copy - size_not_copied;
+    if(size_not_copied) break;
+    curr = asgn1_next_page(curr);
+  }
+
+  mutex_unlock(&asgn1_device.lock);
+  asgn1_stats_account(STAT_READ, size_read);
+  if(size_read == 0 && actual_size > 0) return -EFAULT;
+  return size_read;
+}
+
+
+
+/* Seeks through the file. Changes the file position pointer by a given offset*/
+static loff_t asgn1_lseek (struct file *file, loff_t offset, int cmd)
+{
+  loff_t testpos = 0;
+  loff_t lowest = 0;
+  loff_t buffer_size;
+
+  mutex_lock(&asgn1_device.lock);
+  buffer_size = (loff_t)asgn1_device.num_pages << PAGE_SHIFT;
+
+  /* in ring mode only the valid window can be seeked into*/
+  if(asgn1_device.ring_pages){
+    buffer_size = asgn1_committed();
+    lowest = asgn1_window_start();
+  }
+
+  switch(cmd){
+  case SEEK_SET:
+    testpos = offset;
+    break;
+
+  case SEEK_CUR:
+    testpos = file->f_pos + offset;
+    break;
+
+  case SEEK_END:
+    testpos = buffer_size + offset;
+    break;
+  }
+
+  if(testpos < lowest) testpos = lowest; /* sets testpos to lowest so the f_pos doesn't end up negative*/
+  if(testpos > buffer_size) testpos = buffer_size; /* sets testpos to buffer_size so f_pos is within the file*/
+
+  file->f_pos = testpos;
+  mutex_unlock(&asgn1_device.lock);
+  
+  printk (KERN_INFO "Seeking to pos=%lld\n", (long long)testpos);
+  return testpos;
+}
+
+
+/**
+ * Copies from user space into a page of the device. Streaming writes use the
+ * non-temporal copy so bulk loads do not push everybody else's working set
+ * out of the last level cache; architectures without one fall back to a
+ * plain copy.
+ */
+static inline unsigned long asgn1_copy_from_user(void *to, const void __user *from, unsigned long n,
+                                                 int nocache) {
+  if(nocache){
+    if(!access_ok(VERIFY_READ, from, n))
+      return n;
+    return __copy_from_user_nocache(to, from, n);
+  }
+  return copy_from_user(to, from, n);
+}
+
+/* Returns whether a write of count bytes should bypass the cache*/
+static inline int asgn1_streaming(size_t count) {
+  unsigned long threshold = ACCESS_ONCE(nocache_threshold);
+
+  return threshold && count >= threshold;
+}
+
+
+/**
+ * Appends count bytes from the user buffer for a file opened with O_APPEND.
+ * The range is reserved with a single atomic add on the tail and copied in
+ * without the device lock, so appenders only contend when one of them has to
+ * grow the page list. The range becomes visible to readers once every range
+ * reserved before it has been committed. Ring mode refuses appends with
+ * -EINVAL: they would overwrite the oldest page while a reader holding the
+ * device lock may be copying it out, and switching ring mode waits for
+ * appenders under the append semaphore, so the check is stable.
+ */
+static ssize_t asgn1_append(const char __user *buf, size_t count, loff_t *f_pos) {
+  loff_t start;             /* first offset of the reserved range */
+  loff_t end;               /* end of the range committed */
+  loff_t pos;               /* offset being zeroed after a failed copy */
+  size_t size_written = 0;  /* size written to virtual disk in this function */
+  size_t begin_offset;      /* the offset from the beginning of a page to start writing */
+  size_t size_to_copy;      /* size of data to copy into the current page */
+  size_t size_not_copied;   /* size copy_from_user failed to copy */
+  page_node *curr;          /* the page currently being written */
+  int nocache = asgn1_streaming(count);
+  int result = 0;
+
+  percpu_down_read(&asgn1_device.append_sem);
+  if(asgn1_device.ring_pages){
+    percpu_up_read(&asgn1_device.append_sem);
+    return -EINVAL;
+  }
+  start = atomic64_add_return(count, &asgn1_device.tail) - count;
+
+  /* only appenders crossing into unallocated pages take the allocation lock*/
+  if(start + count > (loff_t)ACCESS_ONCE(asgn1_device.num_pages) << PAGE_SHIFT)
+    result = asgn1_alloc_pages(start + count);
+  if(result == 0)
+    result = asgn1_unshare_range(start, start + count);
+
+  if(result == 0){
+    smp_rmb();
+    curr = asgn1_page_at(start >> PAGE_SHIFT);
+    while(size_written < count){
+      begin_offset = (start + size_written) & ~PAGE_MASK;
+      size_to_copy = min_t(size_t, count - size_written, PAGE_SIZE - begin_offset);
+      if(unlikely(asgn1_heat_enabled)) asgn1_heat_touch(curr, HEAT_WRITE);
+      size_not_copied = asgn1_copy_from_user(page_address(curr->page) + begin_offset,
+                                             buf + size_written, size_to_copy, nocache);
+      asgn1_mark_changed(curr);
+      size_written += size_to_copy - size_not_copied;
+      if(size_not_copied) break;
+      curr = asgn1_next_page(curr);
+    }
+  }
+
+  /* a failed range still has to be committed so later appenders are not
+     stalled: it shrinks to what was written if nobody reserved after it,
+     otherwise it is left as a hole of zeroes*/
+  end = start + count;
+  if(size_written < count){
+    if(atomic64_cmpxchg(&asgn1_device.tail, end, start + size_written) == end)
+      end = start + size_written;
+    else if(result == 0){
+      /* a short copy may leave the rest of its page as it was*/
+      for(pos = start + size_written; pos < end; pos += size_to_copy){
+        begin_offset = pos & ~PAGE_MASK;
+        size_to_copy = min_t(size_t, end - pos, PAGE_SIZE - begin_offset);
+        memset(page_address(curr->page) + begin_offset, 0, size_to_copy);
+        asgn1_mark_changed(curr);
+        curr = asgn1_next_page(curr);
+      }
+    }
+  }
+  asgn1_commit(start, end);
+  percpu_up_read(&asgn1_device.append_sem);
+  asgn1_stats_account(STAT_WRITE, size_written);
+
+  *f_pos = end;
+  if(result) return result;
+  if(size_written == 0) return -EFAULT;
+  return size_written;
+}
+
+
+/**
+ * Reports the device readable once data has been committed past the file
+ * position, so followers can wait in poll/select/epoll instead of spinning
+ * on read. Writes never block.
+ */
+static unsigned int asgn1_poll(struct file *filp, poll_table *wait) {
+  unsigned int mask = POLLOUT | POLLWRNORM;
+
+  poll_wait(filp, &asgn1_device.data_wq, wait);
+  if(asgn1_data_beyond(filp->f_pos))
+    mask |= POLLIN | POLLRDNORM;
+  return mask;
+}
+
+
+/**
+ * This function writes from the user buffer to the virtual disk of this
+ * module. In ring mode writes past the capacity overwrite the oldest pages,
+ * and a write has to start inside the window or right at its end.
+ * Files opened with O_APPEND go through asgn1_append instead, which ring
+ * mode does not support.
+ */
+ssize_t asgn1_write(struct file *filp, const char __user *buf, size_t count,
+                    loff_t *f_pos) {
+  size_t size_written = 0;  /* size written to virtual disk in this function */
+  size_t begin_offset;      /* the offset from the beginning of a page to start writing */
+  size_t size_to_copy;      /* size of data to copy into the current page */
+  size_t size_not_copied;   /* size copy_from_user failed to copy */
+  unsigned long end_page;   /* page number one past the last page written */
+  loff_t skip;              /* bytes that would be overwritten by this same write */
+  size_t bulk_written;      /* size written by the parallel copy engine */
+  ssize_t copied;           /* size copied in cache mode */
+  page_node *curr;          /* the page currently being written */
+  int nocache = asgn1_streaming(count);
+  int result;
+
+  if(count == 0) return 0;
+
+  if((filp->f_flags & O_APPEND) && !asgn1_device.backing)
+    return asgn1_append(buf, count, f_pos);
+
+  if(mutex_lock_interruptible(&asgn1_device.lock))
+    return -ERESTARTSYS;
+
+  /* in cache mode appends are positional writes at the end*/
+  if(filp->f_flags & O_APPEND)
+    *f_pos = asgn1_committed();
+
+  if(asgn1_device.ring_pages){
+    /* the region before the window has already been overwritten, and a gap
+       past the end would still hold bytes of the previous lap*/
+    if(*f_pos < asgn1_window_start() || *f_pos > asgn1_committed()){
+      mutex_unlock(&asgn1_device.lock);
+      return -EINVAL;
+    }
+
+    /* a write larger than the ring only leaves its last ring_pages pages behind*/
+    end_page = (*f_pos + count + PAGE_SIZE - 1) >> PAGE_SHIFT;
+    if(end_page > asgn1_device.ring_pages &&
+       (loff_t)(end_page - asgn1_device.ring_pages) << PAGE_SHIFT > *f_pos){
+      skip = ((loff_t)(end_page - asgn1_device.ring_pages) << PAGE_SHIFT) - *f_pos;
+      size_written += skip;
+      *f_pos += skip;
+    }
+  }
+
+  /* Allocates as many pages as necessary to store count bytes*/
+  result = asgn1_alloc_pages(*f_pos + count - size_written);
+  if(result){
+    mutex_unlock(&asgn1_device.lock);
+    return result;
+  }
+
+  if(asgn1_device.backing){
+    copied = asgn1_cache_copy((char __user *)buf + size_written, count - size_written, f_pos, 1);
+    if(copied < 0 && size_written == 0){
+      mutex_unlock(&asgn1_device.lock);
+      return copied;
+    }
+    if(copied > 0){
+      size_written += copied;
+      asgn1_extend(*f_pos);
+      /* write-back leaves pages past the old size dirty, so it has to run again*/
+      asgn1_cache_redirty((*f_pos - 1) >> PAGE_SHIFT);
+    }
+    goto unlock;
+  }
+
+  /* pages shared with other offsets get private copies before being written*/
+  result = asgn1_unshare_range(*f_pos, *f_pos + count - size_written);
+  if(result){
+    if(size_written == 0){
+      mutex_unlock(&asgn1_device.lock);
+      return result;
+    }
+    count = size_written;
+  }
+
+  if(asgn1_parallel(count - size_written)){
+    bulk_written = asgn1_bulk_copy((unsigned long)(buf + size_written), count - size_written, *f_pos, 1);
+    size_written += bulk_written;
+    *f_pos += bulk_written;
+  }
+
+  /* writes the appropriate amount to each page starting at the page holding f_pos*/
+  curr = asgn1_page_at(*f_pos >> PAGE_SHIFT);
+  while(size_written < count){
+    begin_offset = *f_pos & ~PAGE_MASK;
+    size_to_copy = min_t(size_t, count - size_written, PAGE_SIZE - begin_offset);
+    if(unlikely(asgn1_heat_enabled)) asgn1_heat_touch(curr, HEAT_WRITE);
+    size_not_copied = asgn1_copy_from_user(page_address(curr->page) + begin_offset,
+                                           buf + size_written, size_to_copy, nocache);
+    asgn1_mark_changed(curr);
+    size_written += size_to_copy - size_not_copied;
+    *f_pos += size_to_copy - size_not_copied; /* updates f_pos to correctly calculate begin_offset and update file position pointer*/
+    if(size_not_copied) break;
+    curr = asgn1_next_page(curr);
+  }
+
+  asgn1_extend(*f_pos);
+ unlock:
+  mutex_unlock(&asgn1_device.lock);
+  asgn1_stats_account(STAT_WRITE, size_written);
+
+  if(size_written == 0) return -EFAULT;
+  return size_written;
+}
+
+#define BATCH_CHUNK 8
+
+/**
+ * Runs a batch of reads and writes at unrelated offsets in one call. Each
+ * entry goes through asgn1_read or asgn1_write with its own position, so it
+ * behaves exactly like an lseek followed by a read or write, and its result
+ * is written back into the entry. Descriptors are copied in BATCH_CHUNK at a
+ * time. Returns the number of entries run.
+ */
+static long asgn1_batch_io(struct file *filp, unsigned long arg) {
+  struct asgn1_batch batch;
+  struct asgn1_io ios[BATCH_CHUNK];
+  struct asgn1_io __user *uios;
+  unsigned int done = 0, n, i;
+  loff_t pos;
+  ssize_t result;
+
+  if(copy_from_user(&batch, (void __user *)arg, sizeof(batch)))
+    return -EFAULT;
+  if(batch.count > ASGN1_BATCH_MAX)
+    return -EINVAL;
+  uios = (struct asgn1_io __user *)(unsigned long)batch.ios;
+
+  while(done < batch.count){
+    n = min_t(unsigned int, batch.count - done, BATCH_CHUNK);
+    if(copy_from_user(ios, uios + done, n * sizeof(ios[0])))
+      break;
+
+    for(i = 0; i < n; i++){
+      pos = ios[i].offset;
+      if(pos < 0)
+        result = -EINVAL;
+      else if(ios[i].op == ASGN1_IO_READ)
+        result = asgn1_read(filp, (char __user *)(unsigned long)ios[i].buf, ios[i].len, &pos);
+      else if(ios[i].op == ASGN1_IO_WRITE)
+        result = asgn1_write(filp, (const char __user *)(unsigned long)ios[i].buf, ios[i].len, &pos);
+      else
+        result = -EINVAL;
+      if(put_user((__s64)result, &uios[done + i].result))
+        return done + i ? done + i : -EFAULT;
+      if(fatal_signal_pending(current))
+        return done + i + 1;
+    }
+    done += n;
+  }
+
+  if(done == 0 && batch.count)
+    return -EFAULT;
+  return done;
+}
+
+
+/**
+ * Checks that a range lies within the data a read could return and pins the
+ * range down for an in-kernel scan. Called with the device lock held.
+ */
+static int asgn1_scan_range(u64 offset, u64 len) {
+  loff_t size = asgn1_readable_size();
+
+  if(offset > size || len > size - offset || offset < asgn1_window_start())
+    return -EINVAL;
+  return 0;
+}
+
+/**
+ * Computes the CRC32C of a range of the device without copying it out. The
+ * kernel's crc32c picks the fastest implementation available, such as the
+ * SSE4.2 instruction on x86. The result is the standard CRC32C of the bytes.
+ */
+static long asgn1_hash(unsigned long arg) {
+  struct asgn1_hash hash;
+  size_t off, chunk;
+  loff_t pos, end;
+  page_node *curr;
+  u32 crc = ~0;
+  long result;
+
+  if(asgn1_device.backing)
+    return -EOPNOTSUPP;
+  if(copy_from_user(&hash, (void __user *)arg, sizeof(hash)))
+    return -EFAULT;
+
+  if(mutex_lock_interruptible(&asgn1_device.lock))
+    return -ERESTARTSYS;
+  result = asgn1_scan_range(hash.offset, hash.len);
+  if(result){
+    mutex_unlock(&asgn1_device.lock);
+    return result;
+  }
+
+  pos = hash.offset;
+  end = hash.offset + hash.len;
+  curr = asgn1_page_at(pos >> PAGE_SHIFT);
+  while(pos < end){
+    off = pos & ~PAGE_MASK;
+    chunk = min_t(loff_t, end - pos, PAGE_SIZE - off);
+    crc = crc32c(crc, page_address(curr->page) + off, chunk);
+    pos += chunk;
+    curr = asgn1_next_page(curr);
+    cond_resched();
+  }
+  mutex_unlock(&asgn1_device.lock);
+
+  hash.crc = ~crc;
+  if(copy_to_user((void __user *)arg, &hash, sizeof(hash)))
+    return -EFAULT;
+  return 0;
+}
+
+/* Returns whether the pattern occurs at offset off of curr, running on into the following pages*/
+static int asgn1_match_at(page_node *curr, size_t off, const u8 *pattern, size_t len) {
+  size_t chunk;
+
+  while(len){
+    chunk = min_t(size_t, len, PAGE_SIZE - off);
+    if(memcmp(page_address(curr->page) + off, pattern, chunk))
+      return 0;
+    pattern += chunk;
+    len -= chunk;
+    off = 0;
+    curr = asgn1_next_page(curr);
+  }
+  return 1;
+}
+
+/**
+ * Finds the offsets at which a byte pattern occurs in a range of the device,
+ * overlapping matches included. Candidates are found with memchr on the
+ * first byte of the pattern, page by page, and checked with memcmp, which
+ * follows a match across page boundaries. The scan stops once max_matches
+ * offsets have been stored and reports where to resume in next.
+ */
+static long asgn1_search(unsigned long arg) {
+  struct asgn1_search search;
+  u64 __user *matches;
+  u8 pattern[ASGN1_PATTERN_MAX];
+  loff_t pos, last;
+  size_t off, avail;
+  page_node *curr;
+  char *page, *hit;
+  long result;
+
+  if(asgn1_device.backing)
+    return -EOPNOTSUPP;
+  if(copy_from_user(&search, (void __user *)arg, sizeof(search)))
+    return -EFAULT;
+  if(search.pattern_len == 0 || search.pattern_len > ASGN1_PATTERN_MAX)
+    return -EINVAL;
+  if(copy_from_user(pattern, (void __user *)(unsigned long)search.pattern, search.pattern_len))
+    return -EFAULT;
+  matches = (u64 __user *)(unsigned long)search.matches;
+  search.nmatches = 0;
+
+  if(mutex_lock_interruptible(&asgn1_device.lock))
+    return -ERESTARTSYS;
+  result = asgn1_scan_range(search.offset, search.len);
+  if(result){
+    mutex_unlock(&asgn1_device.lock);
+    return result;
+  }
+
+  /* last is the final offset a whole match still fits at*/
+  pos = search.offset;
+  last = search.offset + search.len - search.pattern_len;
+  curr = asgn1_page_at(pos >> PAGE_SHIFT);
+  while(pos <= last && search.nmatches < search.max_matches){
+    off = pos & ~PAGE_MASK;
+    avail = min_t(loff_t, last - pos + 1, PAGE_SIZE - off);
+    page = page_address(curr->page);
+    hit = memchr(page + off, pattern[0], avail);
+    if(hit){
+      pos += hit - (page + off);
+      if(asgn1_match_at(curr, hit - page, pattern, search.pattern_len)){
+        if(put_user(pos, &matches[search.nmatches])){
+          result = -EFAULT;
+          break;
+        }
+        search.nmatches++;
+      }
+      pos++;
+    } else {
+      pos += avail;
+    }
+    if(!(pos & ~PAGE_MASK)){
+      curr = asgn1_next_page(curr);
+      cond_resched();
+    }
   }
+  mutex_unlock(&asgn1_device.lock);
 
-  return 0; /* success */
+  search.next = min_t(loff_t, pos, search.offset + search.len);
+  if(result == 0 && copy_to_user((void __user *)arg, &search, sizeof(search)))
+    result = -EFAULT;
+  return result;
 }
 
 
-/**
- * This function releases the virtual disk, but nothing needs to be done
- * in this case. 
- */
-int asgn1_release (struct inode *inode, struct file *filp) {
+#define SHARE_BATCH 64
 
-  /*Decrements number of processes*/
-  atomic_dec(&asgn1_device.nprocs);  
+/* Copies len bytes from src to dst inside the device, through the kernel mapping*/
+static int asgn1_copy_bytes(loff_t dst, loff_t src, loff_t len) {
+  size_t dst_off, src_off, chunk;
+  page_node *to, *from;
+  int result;
+
+  while(len > 0){
+    dst_off = dst & ~PAGE_MASK;
+    src_off = src & ~PAGE_MASK;
+    chunk = min_t(loff_t, len, PAGE_SIZE - max(dst_off, src_off));
+    to = asgn1_page_at(dst >> PAGE_SHIFT);
+    from = asgn1_page_at(src >> PAGE_SHIFT);
+    result = asgn1_unshare(to);
+    if(result)
+      return result;
+    memcpy(page_address(to->page) + dst_off, page_address(from->page) + src_off, chunk);
+    asgn1_mark_changed(to);
+    dst += chunk;
+    src += chunk;
+    len -= chunk;
+  }
   return 0;
 }
 
-
 /**
- * This function reads contents of the virtual disk and writes to the user 
+ * Copies a range of the device to another offset without going through user
+ * space. When both offsets sit at the same place within a page, the whole
+ * pages in between are shared copy on write instead of copied, so cloning a
+ * large region only touches page pointers; the unaligned edges, or all of it
+ * when the page offsets differ, are copied in the kernel. Source pages are
+ * marked shared before their mappings are zapped, so any later write to
+ * either side gets a private copy first. Overlapping ranges and ring mode
+ * are refused. The destination may extend the device.
  */
-ssize_t asgn1_read(struct file *filp, char __user *buf, size_t count,
-                   loff_t *f_pos) {
-  size_t size_read = 0;     /* size read from virtual disk in this function */
-  size_t begin_offset;      /* the offset from the beginning of a page to
-                               start reading */
-  int begin_page_no = *f_pos / PAGE_SIZE; /* the first page which contains
-                                             the requested data */
-  int curr_page_no = 0;     /* the current page number */
-  size_t curr_size_read;    /* size read from the virtual disk in this round */
-  size_t size_to_be_read;   /* size to be read in the current round in 
-                               while loop */
-  size_t size_to_copy;      /* keeps track of size of data to copy for each page*/
-  size_t actual_size;       /* variable to track total data that hasn't yet been read*/
-  page_node *curr;          /* pointer to a page node for use with list for each entry loop*/
-
-
-
-  if(*f_pos > asgn1_device.data_size) return 0; /*Returns if file position is beyond the data size*/
-
-  actual_size = min(count, asgn1_device.data_size - (size_t) *f_pos); /*Calculates the acutal size of data to be read*/
+static long asgn1_copy_range(unsigned long arg) {
+  struct asgn1_copy copy;
+  struct page *batch[SHARE_BATCH];
+  struct page *old, *temp;
+  LIST_HEAD(retired);
+  loff_t src, dst, len, head;
+  unsigned long src_page, dst_page, npages, done, n, i;
+  page_node *curr;
+  long result;
+
+  if(asgn1_device.backing)
+    return -EOPNOTSUPP;
+  if(copy_from_user(&copy, (void __user *)arg, sizeof(copy)))
+    return -EFAULT;
+  if((s64)copy.src < 0 || (s64)copy.dst < 0 || copy.len > LLONG_MAX - max(copy.src, copy.dst))
+    return -EINVAL;
+  src = copy.src;
+  dst = copy.dst;
+  len = copy.len;
+  if(len == 0)
+    return 0;
+  if(src < dst + len && dst < src + len)
+    return -EINVAL;
 
-  /* loops through page list and reads the appropriate amount from each page*/
-  list_for_each_entry(curr, &asgn1_device.mem_list, list){
-  
-    if(curr_page_no >= begin_page_no){
-      begin_offset = *f_pos % PAGE_SIZE;
-      size_to_copy = min((int)actual_size,(int)(PAGE_SIZE - begin_offset));
-      while(size_to_copy > 0){
-        size_to_be_read = copy_to_user(buf + size_read, page_address(curr->page) + begin_offset,
-                                       size_to_copy);
-        curr_size_read = size_to_copy - size_to_be_read;
-        size_to_copy= size_to_be_read;
-        actual_size -= curr_size_read;
-        size_read += curr_size_read;
-        *f_pos += curr_size_read;
-        begin_offset = *f_pos % PAGE_SIZE;
-      }
+  /* appenders are held off for the whole copy, like truncation*/
+  mutex_lock(&asgn1_device.lock);
+  percpu_down_write(&asgn1_device.append_sem);
+  if(asgn1_device.ring_pages || src + len > asgn1_committed()){
+    result = -EINVAL;
+    goto out;
+  }
+  result = asgn1_alloc_pages(dst + len);
+  if(result)
+    goto out;
+
+  /* only ranges at the same offset within their pages can share pages*/
+  if((src ^ dst) & (PAGE_SIZE - 1)){
+    head = len;
+    npages = 0;
+  } else {
+    head = min_t(loff_t, len, (PAGE_SIZE - (dst & (PAGE_SIZE - 1))) & (PAGE_SIZE - 1));
+    npages = (len - head) >> PAGE_SHIFT;
+  }
+  result = asgn1_copy_bytes(dst, src, head);
+
+  src_page = (src + head) >> PAGE_SHIFT;
+  dst_page = (dst + head) >> PAGE_SHIFT;
+  for(done = 0; result == 0 && done < npages; done += n){
+    n = min_t(unsigned long, npages - done, SHARE_BATCH);
+    spin_lock(&asgn1_device.share_lock);
+    for(i = 0; i < n; i++){
+      batch[i] = asgn1_page_at(src_page + done + i)->page;
+      get_page(batch[i]);
+      set_page_private(batch[i], page_private(batch[i]) + 1);
+    }
+    atomic_add(n, &asgn1_device.shared_pages);
+    spin_unlock(&asgn1_device.share_lock);
+
+    /* writable mappings of the source must fault again before the pages are shared*/
+    if(asgn1_device.mapping)
+      unmap_mapping_range(asgn1_device.mapping, (loff_t)(src_page + done) << PAGE_SHIFT,
+                          (loff_t)n << PAGE_SHIFT, 0);
+    for(i = 0; i < n; i++){
+      curr = asgn1_page_at(dst_page + done + i);
+      asgn1_drop_replicas(curr);
+      old = asgn1_replace_page(curr, batch[i]);
+      if(old)
+        list_add(&old->lru, &retired);
+      asgn1_mark_changed(curr);
     }
+  }
 
-    curr_page_no++;
+  if(result == 0)
+    result = asgn1_copy_bytes(dst + head + ((loff_t)npages << PAGE_SHIFT),
+                              src + head + ((loff_t)npages << PAGE_SHIFT),
+                              len - head - ((loff_t)npages << PAGE_SHIFT));
+  if(result == 0)
+    asgn1_extend(dst + len);
+
+  if(asgn1_device.mapping)
+    unmap_mapping_range(asgn1_device.mapping, dst, len, 0);
+  if(!list_empty(&retired)){
+    synchronize_rcu();
+    list_for_each_entry_safe(old, temp, &retired, lru){
+      list_del(&old->lru);
+      put_page(old);
+    }
   }
 
-  return size_read;
+ out:
+  percpu_up_write(&asgn1_device.append_sem);
+  mutex_unlock(&asgn1_device.lock);
+  return result;
 }
 
 
+#define DIRTY_BATCH 16
 
-/* Seeks through the file. Changes the file position pointer by a given offset*/
-static loff_t asgn1_lseek (struct file *file, loff_t offset, int cmd)
-{
-  loff_t testpos = 0;
-
-  size_t buffer_size = asgn1_device.num_pages * PAGE_SIZE;
-
-  switch(cmd){
-  case SEEK_SET:
-    testpos = offset;
-    break;
-
-  case SEEK_CUR:
-    testpos = file->f_pos + offset;
-    break;
+/**
+ * Clears the changed tag of curr, whose page the caller holds a reference
+ * to, and write protects the page again. The page lock keeps page_mkwrite
+ * from tagging it between the zap and the clear, so every later store
+ * through a mapping faults and tags it again. A page swapped in meanwhile
+ * does not wait on this lock, so the tag is put back if that happened.
+ */
+static void asgn1_clear_changed(page_node *curr, struct page *page) {
+  lock_page(page);
+  if(asgn1_device.mapping)
+    unmap_mapping_range(asgn1_device.mapping, (loff_t)curr->index << PAGE_SHIFT, PAGE_SIZE, 0);
+  asgn1_index_tag(curr->index, ASGN1_TAG_CHANGED, 0);
+  smp_mb();
+  if(ACCESS_ONCE(curr->page) != page)
+    asgn1_index_tag(curr->index, ASGN1_TAG_CHANGED, 1);
+  unlock_page(page);
+  put_page(page);
+}
 
-  case SEEK_END:
-    testpos = buffer_size + offset;
-    break;
+/**
+ * Reports the changed pages of a range as a bitmap, and clears them if
+ * asked. Only tagged pages are visited, a batch at a time, so the cost
+ * follows the number of changed pages rather than the size of the range;
+ * the bitmap itself is zeroed up front. Each batch is reported before it is
+ * cleared, so a fault writing the bitmap cannot lose changes. Holds the
+ * device lock, which keeps writers out and the page nodes alive.
+ */
+static long asgn1_get_dirty(unsigned long arg) {
+  struct asgn1_dirty dirty;
+  struct asgn1_dirty __user *user = (struct asgn1_dirty __user *)arg;
+  page_node *nodes[DIRTY_BATCH];
+  struct page *pages[DIRTY_BATCH];
+  u64 __user *bitmap;
+  unsigned long first, end, next, word_no, bit;
+  u64 word;
+  u32 count = 0;
+  int clear, found, n, i;
+  long result = 0;
+
+  if(copy_from_user(&dirty, user, sizeof(dirty)))
+    return -EFAULT;
+  if((dirty.offset & (PAGE_SIZE - 1)) || dirty.len > LLONG_MAX || dirty.offset > LLONG_MAX - dirty.len)
+    return -EINVAL;
+  first = dirty.offset >> PAGE_SHIFT;
+  end = (dirty.offset + dirty.len + PAGE_SIZE - 1) >> PAGE_SHIFT;
+  bitmap = (u64 __user *)(unsigned long)dirty.bitmap;
+  clear = dirty.flags & ASGN1_DIRTY_CLEAR;
+  if(clear_user(bitmap, DIV_ROUND_UP(end - first, 64) * sizeof(u64)))
+    return -EFAULT;
+
+  mutex_lock(&asgn1_device.lock);
+  if(asgn1_device.ring_pages){
+    result = -EINVAL;
+    goto out;
   }
 
-  if(testpos < 0) testpos = 0; /* sets testpos to 0 so the f_pos doesn't end up negative*/
-  if(testpos > buffer_size) testpos = buffer_size; /* sets testpos to buffer_size so f_pos is within the file*/
+  for(next = first; next < end; next = nodes[n - 1]->index + 1){
+    /* cache mode loads and evicts pages under cache_lock*/
+    if(asgn1_device.backing)
+      mutex_lock(&asgn1_device.cache_lock);
+    rcu_read_lock();
+    found = radix_tree_gang_lookup_tag(&asgn1_device.page_tree, (void **)nodes, next,
+                                       DIRTY_BATCH, ASGN1_TAG_CHANGED);
+    rcu_read_unlock();
+    for(n = 0; n < found && nodes[n]->index < end; n++){
+      if(!clear)
+        continue;
+      spin_lock(&asgn1_device.share_lock);
+      pages[n] = nodes[n]->page;
+      if(pages[n])
+        get_page(pages[n]);
+      spin_unlock(&asgn1_device.share_lock);
+    }
+    if(asgn1_device.backing)
+      mutex_unlock(&asgn1_device.cache_lock);
+    if(n == 0)
+      break;
+
+    /* adjacent pages are gathered into one bitmap word before it is stored*/
+    word_no = (nodes[0]->index - first) / 64;
+    word = 0;
+    for(i = 0; i < n && result == 0; i++){
+      bit = nodes[i]->index - first;
+      if(bit / 64 != word_no){
+        result = put_user(word, bitmap + word_no);
+        word_no = bit / 64;
+        word = 0;
+      }
+      word |= 1ULL << (bit % 64);
+      count++;
+    }
+    if(result == 0)
+      result = put_user(word, bitmap + word_no);
+
+    for(i = 0; clear && i < n; i++){
+      if(pages[i] && result)
+        put_page(pages[i]);
+      else if(pages[i])
+        asgn1_clear_changed(nodes[i], pages[i]);
+      else if(result == 0){
+        /* an evicted cache page has no mappings unless it is loaded again*/
+        mutex_lock(&asgn1_device.cache_lock);
+        if(!nodes[i]->page)
+          asgn1_index_tag(nodes[i]->index, ASGN1_TAG_CHANGED, 0);
+        mutex_unlock(&asgn1_device.cache_lock);
+      }
+    }
+    if(result || found < DIRTY_BATCH)
+      break;
+  }
 
-  file->f_pos = testpos;
-  
-  printk (KERN_INFO "Seeking to pos=%ld\n", (long)testpos);
-  return testpos;
+ out:
+  mutex_unlock(&asgn1_device.lock);
+  if(result)
+    return result;
+  return put_user(count, &user->count);
 }
 
 
 /**
- * This function writes from the user buffer to the virtual disk of this
- * module
+ * Marks or unmarks a range of pages read-mostly. Each page is marked with
+ * its page lock held and its mappings zapped, the same way ASGN1_GET_DIRTY
+ * write protects pages, so a store through a mapping always reaches
+ * page_mkwrite and unmarks the page first. Appenders are held off, and a
+ * page swapped meanwhile by breaking its sharing is left unmarked.
  */
-ssize_t asgn1_write(struct file *filp, const char __user *buf, size_t count,
-                    loff_t *f_pos) {
-  size_t orig_f_pos = *f_pos;  /* the original file position */
-  size_t size_written = 0;  /* size written to virtual disk in this function */
-  size_t begin_offset;   /* the offset from the beginning of a page to start writing */
-  int begin_page_no = *f_pos / PAGE_SIZE;  /* the first page this finction
-                                              should start writing to */
-
-  int curr_page_no = 0;     /* the current page number */
-  size_t curr_size_written; /* size written to virtual disk in this round */
-  size_t size_to_be_written;  /* size to be read in the current round in 
-                                 while loop */
-  size_t size_to_copy;      /* keeps track of how much data is left to copy for a given page*/
-  page_node *curr;        /* pointer to a page node for use with list for each entry loop*/
- 
+static long asgn1_set_readmostly(unsigned long arg) {
+  struct asgn1_readmostly readmostly;
+  unsigned long page_no, end;
+  struct page *page;
+  page_node *curr;
+  long result = 0;
+
+  if(asgn1_device.backing)
+    return -EOPNOTSUPP;
+  if(copy_from_user(&readmostly, (void __user *)arg, sizeof(readmostly)))
+    return -EFAULT;
+  if(readmostly.offset > LLONG_MAX)
+    return -EINVAL;
 
-  /* Allocates as many pages as necessary to store count bytes*/
-  while(asgn1_device.num_pages * PAGE_SIZE < orig_f_pos + count){
-    curr = kmalloc(sizeof(page_node), GFP_KERNEL);
-    if(curr){
-      curr->page = alloc_page(GFP_KERNEL);
-    } else {
-      printk(KERN_WARNING "page_node allocation failed\n");
-      return -ENOMEM;
-    }
-    if(curr->page == NULL){
-      printk(KERN_WARNING "Page allocation failed\n");
-      return -ENOMEM;
-    }
-    printk(KERN_INFO "allocated page %d\n", asgn1_device.num_pages);
-    list_add_tail(&(curr->list), &asgn1_device.mem_list);
-    printk(KERN_INFO "added page to list%d\n", asgn1_device.num_pages);
-    asgn1_device.num_pages++;
+  mutex_lock(&asgn1_device.lock);
+  percpu_down_write(&asgn1_device.append_sem);
+  if(asgn1_device.ring_pages){
+    result = -EINVAL;
+    goto out;
   }
-
-  /* Loops through each page in the list and writes the appropriate amount to each one*/
-  list_for_each_entry(curr, &asgn1_device.mem_list, list){
-    printk(KERN_INFO "current page no = %d\n", curr_page_no);
-    if(curr_page_no >= begin_page_no){
-      begin_offset = *f_pos % PAGE_SIZE;
-      size_to_copy = min((int)count,(int)( PAGE_SIZE - begin_offset));
-      while(size_to_copy > 0){
-
-        size_to_be_written = copy_from_user(page_address(curr->page) +begin_offset, buf + size_written,
-                                            size_to_copy); /* stores the number of bytes that remain to be written*/
-        curr_size_written = size_to_copy - size_to_be_written;
-        size_to_copy = size_to_be_written;
-        size_written += curr_size_written;
-        count -= curr_size_written;
-        *f_pos += curr_size_written; /* updates f_pos to correctly calculate begin_offset and update file position pointer*/
-        begin_offset = *f_pos % PAGE_SIZE;
-      }
+  end = asgn1_device.num_pages;
+  if(readmostly.offset + readmostly.len >= readmostly.offset &&
+     readmostly.offset + readmostly.len < (u64)end << PAGE_SHIFT)
+    end = (readmostly.offset + readmostly.len + PAGE_SIZE - 1) >> PAGE_SHIFT;
+
+  for(page_no = readmostly.offset >> PAGE_SHIFT; page_no < end; page_no++){
+    curr = asgn1_page_at(page_no);
+    if(!readmostly.on){
+      asgn1_drop_replicas(curr);
+      continue;
     }
-    curr_page_no++;
-    
+    if(curr->readmostly)
+      continue;
+    if(!curr->replicas){
+      curr->replicas = kcalloc(nr_node_ids, sizeof(struct page *), GFP_KERNEL);
+      if(!curr->replicas){
+        asgn1_stats_account(STAT_ALLOC_FAIL, 0);
+        result = -ENOMEM;
+        break;
+      }
     }
 
-  asgn1_device.data_size = max(asgn1_device.data_size,
-                               orig_f_pos + size_written);
-  return size_written;
+    page = ACCESS_ONCE(curr->page);
+    lock_page(page);
+    if(asgn1_device.mapping)
+      unmap_mapping_range(asgn1_device.mapping, (loff_t)page_no << PAGE_SHIFT, PAGE_SIZE, 0);
+    curr->readmostly = 1;
+    atomic_inc(&asgn1_device.readmostly_pages);
+    smp_mb();
+    if(ACCESS_ONCE(curr->page) != page)
+      asgn1_drop_replicas(curr);
+    unlock_page(page);
+  }
+
+ out:
+  percpu_up_write(&asgn1_device.append_sem);
+  mutex_unlock(&asgn1_device.lock);
+  return result;
 }
 
-#define SET_NPROC_OP 1
-#define TEM_SET_NPROC _IOW(MYIOC_TYPE, SET_NPROC_OP, int) 
 
 /**
- * The ioctl function, which is used to set the maximum allowed number of concurrent processes.
+ * The ioctl function, which is used to set the maximum allowed number of
+ * concurrent processes, to switch ring mode on or off by setting its capacity
+ * in pages (0 turns it off), to report the valid window of the device and to
+ * switch follow mode on or off for this file, to run
+ * batches of reads and writes, to copy ranges inside the device, to hash
+ * or search ranges without reading them out, to report changed pages and
+ * to mark pages read-mostly.
+ * Changing the ring capacity discards the current contents of the device.
  */
 long asgn1_ioctl (struct file *filp, unsigned cmd, unsigned long arg) {
   int nr = _IOC_NR(cmd);
   int new_nprocs;
+  u64 new_ring_pages;
+  int follow;
+  struct asgn1_window window;
+  asgn1_file *file = filp->private_data;
   int result;
 
   
   /* checks that the command is for this device*/
   if(_IOC_TYPE(cmd) != MYIOC_TYPE) return -EINVAL;
+  asgn1_stats_account(STAT_IOCTL, 0);
 
-  /* checks that the given command is the only one that exists*/
-  if(nr == SET_NPROC_OP){
+  switch(nr){
+  case SET_NPROC_OP:
     if(!access_ok(VERIFY_READ, arg, sizeof(cmd))){ /* verifies that access is allowed*/
       return -EFAULT;
     } else {
@@ -306,6 +2322,57 @@ long asgn1_ioctl (struct file *filp, unsigned cmd, unsigned long arg) {
       printk(KERN_INFO "max_nprocs now = %d\n", new_nprocs);
       return 0;
     }
+
+  case SET_RING_OP:
+    if(get_user(new_ring_pages, (u64 __user *)arg))
+      return -EFAULT;
+    /* the capacity in bytes has to be a valid file offset*/
+    if(new_ring_pages > (MAX_LFS_FILESIZE >> PAGE_SHIFT) || asgn1_device.backing)
+      return -EINVAL;
+
+    mutex_lock(&asgn1_device.lock);
+    percpu_down_write(&asgn1_device.append_sem);
+    if(new_ring_pages != asgn1_device.ring_pages){
+      free_memory_pages();
+      asgn1_device.ring_pages = new_ring_pages;
+    }
+    percpu_up_write(&asgn1_device.append_sem);
+    mutex_unlock(&asgn1_device.lock);
+    printk(KERN_INFO "ring_pages now = %llu\n", (unsigned long long)new_ring_pages);
+    return 0;
+
+  case GET_WINDOW_OP:
+    mutex_lock(&asgn1_device.lock);
+    window.first = asgn1_window_start();
+    window.last = asgn1_committed();
+    mutex_unlock(&asgn1_device.lock);
+    if(copy_to_user((void __user *)arg, &window, sizeof(window)))
+      return -EFAULT;
+    return 0;
+
+  case SET_FOLLOW_OP:
+    if(get_user(follow, (int __user *)arg))
+      return -EFAULT;
+    file->follow = (follow != 0);
+    return 0;
+
+  case BATCH_IO_OP:
+    return asgn1_batch_io(filp, arg);
+
+  case COPY_RANGE_OP:
+    return asgn1_copy_range(arg);
+
+  case HASH_OP:
+    return asgn1_hash(arg);
+
+  case SEARCH_OP:
+    return asgn1_search(arg);
+
+  case GET_DIRTY_OP:
+    return asgn1_get_dirty(arg);
+
+  case SET_READMOSTLY_OP:
+    return asgn1_set_readmostly(arg);
   }
   
   return -ENOTTY;
@@ -321,49 +2388,434 @@ int asgn1_read_procmem(char *buf, char **start, off_t offset, int count,
                        int *eof, void *data) {
 
   *eof = 1;
-  return snprintf(buf, count, "Num Pages = %d\nData Size = %d\n Num Procs = %d\n Max Procs = %d\n",
-                  asgn1_device.num_pages, asgn1_device.data_size, atomic_read(&asgn1_device.nprocs), atomic_read(&asgn1_device.max_nprocs));
+  return snprintf(buf, count, "Num Pages = %lu\nData Size = %lld\n Num Procs = %d\n Max Procs = %d\n Ring Pages = %lu\n",
+                  asgn1_device.num_pages, (long long)asgn1_committed(), atomic_read(&asgn1_device.nprocs), atomic_read(&asgn1_device.max_nprocs),
+                  asgn1_device.ring_pages);
+
+}
+
+/* Starts the periodic refresh with the first mapping of the statistics page*/
+static void asgn1_stats_vm_open(struct vm_area_struct *vma)
+{
+  if(atomic_inc_return(&asgn1_device.stats_maps) == 1)
+    schedule_delayed_work(&asgn1_device.stats_work, msecs_to_jiffies(STATS_REFRESH_MS));
+}
+
+/* The refresh work stops by itself once the last mapping is gone*/
+static void asgn1_stats_vm_close(struct vm_area_struct *vma)
+{
+  atomic_dec(&asgn1_device.stats_maps);
+}
+
+/* Faults the statistics page in with the counters summed up to now*/
+static int asgn1_stats_vm_fault(struct vm_area_struct *vma, struct vm_fault *vmf)
+{
+  asgn1_stats_refresh();
+  vmf->page = virt_to_page(asgn1_device.stats);
+  get_page(vmf->page);
+  return 0;
+}
+
+static struct vm_operations_struct asgn1_stats_vm_ops = {
+  .open = asgn1_stats_vm_open,
+  .close = asgn1_stats_vm_close,
+  .fault = asgn1_stats_vm_fault
+};
+
+/**
+ * Maps the read only statistics page. A monitor keeps it mapped and reads
+ * snapshots with plain loads instead of parsing /proc/asgn1.
+ */
+static int asgn1_mmap_stats(struct vm_area_struct *vma)
+{
+  if(vma->vm_end - vma->vm_start != PAGE_SIZE)
+    return -EINVAL;
+  if(vma->vm_flags & VM_WRITE)
+    return -EPERM;
+
+  vma->vm_flags &= ~VM_MAYWRITE;
+  vma->vm_ops = &asgn1_stats_vm_ops;
+  asgn1_stats_vm_open(vma);
+  return 0;
+}
+
+/* The statistics node maps nothing but the statistics page, at offset 0*/
+static int asgn1_stats_node_mmap(struct file *filp, struct vm_area_struct *vma)
+{
+  if(vma->vm_pgoff != 0)
+    return -EINVAL;
+  return asgn1_mmap_stats(vma);
+}
+
+static const struct file_operations asgn1_stats_fops = {
+  .owner = THIS_MODULE,
+  .mmap = asgn1_stats_node_mmap
+};
+
+/* a node of its own, so no offset of the ramdisk is shadowed by the statistics page*/
+static struct miscdevice asgn1_stats_misc = {
+  .minor = MISC_DYNAMIC_MINOR,
+  .name = MYDEV_NAME "_stats",
+  .fops = &asgn1_stats_fops,
+  .mode = 0444
+};
+
+
+/**
+ * Page fault handler for mappings of the ramdisk. The page is looked up under
+ * RCU and handed to the kernel with a reference held, so it stays valid for
+ * the mapping even if the device is truncated meanwhile.
+ */
+static int asgn1_vm_fault(struct vm_area_struct *vma, struct vm_fault *vmf)
+{
+  page_node *curr;
+
+  if(vmf->pgoff >= ACCESS_ONCE(asgn1_device.num_pages))
+    return VM_FAULT_SIGBUS;
+
+  /* in cache mode the page may have to be loaded, which sleeps*/
+  if(asgn1_device.backing){
+    vmf->page = asgn1_cache_get(vmf->pgoff, HEAT_FAULT, 0);
+    if(IS_ERR(vmf->page))
+      return PTR_ERR(vmf->page) == -ENOMEM ? VM_FAULT_OOM : VM_FAULT_SIGBUS;
+    return 0;
+  }
+
+  rcu_read_lock();
+  curr = asgn1_page_at(vmf->pgoff);
+  if(curr){
+    vmf->page = ACCESS_ONCE(curr->page);
+    get_page(vmf->page);
+    if(unlikely(asgn1_heat_enabled)) asgn1_heat_touch(curr, HEAT_FAULT);
+  }
+  rcu_read_unlock();
+
+  return curr ? 0 : VM_FAULT_SIGBUS;
+}
+
+/**
+ * Called before a mapped page is made writable. A page shared with other
+ * offsets gets a private copy first, and the stale mapping is zapped so the
+ * write faults the copy in. Otherwise the page is written in place; in cache
+ * mode it is tagged dirty for write-back first. Device
+ * pages have no address_space, so the page is returned locked rather than
+ * leaving the caller to lock and check it.
+ */
+static int asgn1_vm_mkwrite(struct vm_area_struct *vma, struct vm_fault *vmf)
+{
+  struct page *page;
+  page_node *curr;
+  int refault = 0;
+
+  if(asgn1_device.backing){
+    mutex_lock(&asgn1_device.cache_lock);
+    curr = radix_tree_lookup(&asgn1_device.page_tree, vmf->pgoff);
+    if(curr && curr->page == vmf->page)
+      asgn1_cache_mark_dirty(curr);
+    else
+      refault = 1;
+    mutex_unlock(&asgn1_device.cache_lock);
+    if(refault){
+      unmap_mapping_range(vma->vm_file->f_mapping, (loff_t)vmf->pgoff << PAGE_SHIFT, PAGE_SIZE, 0);
+      return VM_FAULT_NOPAGE;
+    }
+  } else if(unlikely(atomic_read(&asgn1_device.shared_pages))){
+    page = alloc_page(GFP_KERNEL);
+    if(!page)
+      return VM_FAULT_OOM;
+
+    rcu_read_lock();
+    curr = asgn1_page_at(vmf->pgoff);
+    if(!curr || ACCESS_ONCE(curr->page) != vmf->page){
+      refault = 1;
+    } else if(asgn1_unshare_with(curr, page)){
+      page = NULL;
+      refault = 1;
+    }
+    rcu_read_unlock();
+
+    if(page)
+      __free_page(page);
+    if(refault){
+      unmap_mapping_range(vma->vm_file->f_mapping, (loff_t)vmf->pgoff << PAGE_SHIFT, PAGE_SIZE, 0);
+      return VM_FAULT_NOPAGE;
+    }
+  }
+
+  /* tagged under the page lock, which ASGN1_GET_DIRTY holds while it write protects the page*/
+  lock_page(vmf->page);
+  rcu_read_lock();
+  curr = asgn1_page_at(vmf->pgoff);
+  if(curr){
+    asgn1_mark_changed(curr);
+    /* ASGN1_SET_READMOSTLY also marks pages under their page lock*/
+    if(unlikely(ACCESS_ONCE(curr->readmostly)))
+      asgn1_drop_replicas(curr);
+  }
+  rcu_read_unlock();
+  return VM_FAULT_LOCKED;
+}
+
+static struct vm_operations_struct asgn1_vm_ops = {
+  .fault = asgn1_vm_fault,
+  .page_mkwrite = asgn1_vm_mkwrite
+};
+
+#define PREFAULT_BATCH 64
+
+/**
+ * Inserts npages pages starting at page offset into the vma up front, so
+ * mapped access does not take a fault per page. References are taken in
+ * batches under RCU, since vm_insert_page may sleep.
+ */
+static int asgn1_prefault(struct vm_area_struct *vma, unsigned long offset,
+                          unsigned long npages)
+{
+  struct page *batch[PREFAULT_BATCH];
+  unsigned long done = 0;
+  unsigned long count, i;
+  page_node *curr;
+  int result = 0;
+
+  while(done < npages && result == 0){
+    count = 0;
+    rcu_read_lock();
+    curr = asgn1_page_at(offset + done);
+    while(curr && count < PREFAULT_BATCH && done + count < npages){
+      batch[count] = ACCESS_ONCE(curr->page);
+      get_page(batch[count++]);
+      curr = asgn1_next_page(curr);
+    }
+    rcu_read_unlock();
 
+    for(i = 0; i < count; i++){
+      if(result == 0)
+        result = vm_insert_page(vma, vma->vm_start + (done + i) * PAGE_SIZE, batch[i]);
+      put_page(batch[i]);
+    }
+    if(count == 0) break;
+    done += count;
+  }
+  return result;
 }
 
+
 /**
  * Maps the virtual ramdisk to a virtual memory area in user space.
  * This allows for quicker access by user space programs as it avoids
- * the need for context switching.
+ * the need for context switching. Pages are inserted up front unless the heat map
+ * is on, in which case they are left to fault in so mapped access is counted,
+ * or the device is in cache mode, where faults load them on demand.
  */
 static int asgn1_mmap (struct file *filp, struct vm_area_struct *vma)
 {
-  unsigned long pfn; /* page frame number*/
-  unsigned long offset = vma->vm_pgoff << PAGE_SHIFT; /* num of starting page*/
+  unsigned long offset = vma->vm_pgoff; /* num of starting page*/
   unsigned long len = vma->vm_end - vma->vm_start; /* length of virtual memory area*/
-  unsigned long ramdisk_size = asgn1_device.num_pages * PAGE_SIZE; /* total ramdisk size*/
-  page_node *curr; /* pointer to a page_node for use with list for each entry loop*/
-  unsigned long index = 0;
+  unsigned long npages = len >> PAGE_SHIFT; /* number of pages to map*/
+  unsigned long num_pages = ACCESS_ONCE(asgn1_device.num_pages); /* pages held by the ramdisk*/
+  int result;
 
-  /* returns if the length of the virutal memory area is more than the size of the ramdisk*/
-  if(len > ramdisk_size){
-    printk(KERN_WARNING "Virutal memory area too large");
+  /* returns if the virutal memory area reaches past the end of the ramdisk*/
+  if(offset > num_pages || npages > num_pages - offset){
+    printk(KERN_WARNING "Not enough pages in ramdisk\n");
     return -EINVAL;
   }
 
-  /* checks that the offset isn't too large*/
-  if(offset > asgn1_device.num_pages){
-    printk(KERN_WARNING "Not enough pages in ramdisk\n");
-    return -EINVAL;
+  vma->vm_ops = &asgn1_vm_ops;
+  /* shared writable mappings start read only so the first write to a page goes through asgn1_vm_mkwrite*/
+  if((vma->vm_flags & (VM_SHARED | VM_WRITE)) == (VM_SHARED | VM_WRITE))
+    vma->vm_page_prot = vm_get_page_prot(vma->vm_flags & ~VM_SHARED);
+  if(!asgn1_heat_enabled && !asgn1_device.backing){
+    result = asgn1_prefault(vma, offset, npages);
+    if(result) return result;
+  }
+
+  asgn1_stats_account(STAT_MMAP, len);
+  return 0;
+}
+
+
+/**
+ * Shows one heat map line per page: reads, writes, mmap faults and the time
+ * since the last access in milliseconds. The position is the page index plus
+ * one, after the header at 0, so each chunk of the file starts with a lookup
+ * in the page index instead of a walk of the list. Only the RCU read lock is
+ * held while a chunk is filled, so readers of a large map never hold up I/O,
+ * and the counters may change between lines.
+ */
+static void *asgn1_heatmap_find(loff_t *pos)
+{
+  page_node *curr;
+
+  if(radix_tree_gang_lookup(&asgn1_device.page_tree, (void **)&curr, *pos - 1, 1) != 1)
+    return NULL;
+  *pos = (loff_t)curr->index + 1;
+  return curr;
+}
+
+static void *asgn1_heatmap_start(struct seq_file *m, loff_t *pos)
+{
+  rcu_read_lock();
+  if(*pos == 0)
+    return SEQ_START_TOKEN;
+  return asgn1_heatmap_find(pos);
+}
+
+static void *asgn1_heatmap_next(struct seq_file *m, void *v, loff_t *pos)
+{
+  ++*pos;
+  return asgn1_heatmap_find(pos);
+}
+
+static void asgn1_heatmap_stop(struct seq_file *m, void *v)
+{
+  rcu_read_unlock();
+}
+
+static int asgn1_heatmap_show(struct seq_file *m, void *v)
+{
+  page_node *curr = v;
+
+  if(v == SEQ_START_TOKEN){
+    seq_printf(m, "page reads writes faults idle_ms\n");
+    return 0;
   }
+  seq_printf(m, "%lu %u %u %u %u\n", curr->index, curr->reads,
+             curr->writes, curr->faults,
+             curr->last_access ? jiffies_to_msecs(jiffies - curr->last_access) : 0);
+  return 0;
+}
+
+static struct seq_operations asgn1_heatmap_seq_ops = {
+  .start = asgn1_heatmap_start,
+  .next = asgn1_heatmap_next,
+  .stop = asgn1_heatmap_stop,
+  .show = asgn1_heatmap_show
+};
+
+static int asgn1_heatmap_open(struct inode *inode, struct file *file)
+{
+  return seq_open(file, &asgn1_heatmap_seq_ops);
+}
+
+/**
+ * Writing anything to the heat map resets it. User mappings are zapped as
+ * well, so mapped pages fault, and are counted, again on their next access.
+ */
+static ssize_t asgn1_heatmap_write(struct file *file, const char __user *buf,
+                                   size_t count, loff_t *ppos)
+{
+  page_node *curr;
 
-  /* loops through the page list and remaps the appropriate pages to the correct virtual memory area*/
+  mutex_lock(&asgn1_device.lock);
   list_for_each_entry(curr, &asgn1_device.mem_list, list){
-    /* ensures that the mapping starts at the appropriate page and doesn't exceed the vma*/
-    if(index >= offset && vma->vm_start+(index*PAGE_SIZE) < vma->vm_end){
-    pfn = page_to_pfn(curr->page);
-    remap_pfn_range(vma, vma->vm_start+(index*PAGE_SIZE), pfn, PAGE_SIZE, vma->vm_page_prot);
-    }
-    index++;
+    curr->reads = 0;
+    curr->writes = 0;
+    curr->faults = 0;
+    curr->last_access = 0;
+  }
+  mutex_unlock(&asgn1_device.lock);
+
+  if(asgn1_device.mapping)
+    unmap_mapping_range(asgn1_device.mapping, 0, 0, 0);
+  return count;
+}
+
+static const struct file_operations asgn1_heatmap_fops = {
+  .owner = THIS_MODULE,
+  .open = asgn1_heatmap_open,
+  .read = seq_read,
+  .write = asgn1_heatmap_write,
+  .llseek = seq_lseek,
+  .release = seq_release
+};
+
+
+/**
+ * Shows how many pages fall in each power of two bucket of total accesses,
+ * which is enough to tell hot regions from cold ones at a glance.
+ */
+static int asgn1_histogram_show(struct seq_file *m, void *v)
+{
+  unsigned long buckets[33] = { 0 };
+  page_node *curr;
+  u32 accesses;
+  int i;
+
+  mutex_lock(&asgn1_device.lock);
+  list_for_each_entry(curr, &asgn1_device.mem_list, list){
+    accesses = curr->reads + curr->writes + curr->faults;
+    buckets[accesses ? fls(accesses) : 0]++;
+  }
+  mutex_unlock(&asgn1_device.lock);
+
+  seq_printf(m, "accesses pages\n");
+  seq_printf(m, "0 %lu\n", buckets[0]);
+  for(i = 1; i < 33; i++){
+    if(buckets[i])
+      seq_printf(m, "%lu-%lu %lu\n", 1UL << (i - 1), (1UL << i) - 1, buckets[i]);
+  }
+  return 0;
+}
+
+static int asgn1_histogram_open(struct inode *inode, struct file *file)
+{
+  return single_open(file, asgn1_histogram_show, NULL);
+}
+
+static const struct file_operations asgn1_histogram_fops = {
+  .owner = THIS_MODULE,
+  .open = asgn1_histogram_open,
+  .read = seq_read,
+  .llseek = seq_lseek,
+  .release = single_release
+};
+
+
+/**
+ * Shows where read() found its pages, per NUMA node of the reading cpu:
+ * on the node itself, in a local read-mostly copy or on another node, and
+ * how many copies the node made.
+ */
+static int asgn1_numa_show(struct seq_file *m, void *v)
+{
+  struct asgn1_numa_stat *stat, *nodes;
+  int cpu, nid;
+
+  nodes = kcalloc(nr_node_ids, sizeof(*nodes), GFP_KERNEL);
+  if(!nodes)
+    return -ENOMEM;
+  for_each_possible_cpu(cpu){
+    stat = per_cpu_ptr(&asgn1_numa_stats, cpu);
+    nid = cpu_to_node(cpu);
+    nodes[nid].local += stat->local;
+    nodes[nid].replica += stat->replica;
+    nodes[nid].remote += stat->remote;
+    nodes[nid].built += stat->built;
   }
+
+  seq_printf(m, "node local replica remote built\n");
+  for_each_node(nid)
+    seq_printf(m, "%d %lu %lu %lu %lu\n", nid, nodes[nid].local, nodes[nid].replica,
+               nodes[nid].remote, nodes[nid].built);
+  seq_printf(m, "readmostly_pages %d\n", atomic_read(&asgn1_device.readmostly_pages));
+  kfree(nodes);
   return 0;
 }
 
+static int asgn1_numa_open(struct inode *inode, struct file *file)
+{
+  return single_open(file, asgn1_numa_show, NULL);
+}
+
+static const struct file_operations asgn1_numa_fops = {
+  .owner = THIS_MODULE,
+  .open = asgn1_numa_open,
+  .read = seq_read,
+  .llseek = seq_lseek,
+  .release = single_release
+};
+
 
 struct file_operations asgn1_fops = {
   .owner = THIS_MODULE,
@@ -372,7 +2824,9 @@ struct file_operations asgn1_fops = {
   .unlocked_ioctl = asgn1_ioctl,
   .open = asgn1_open,
   .mmap = asgn1_mmap,
+  .poll = asgn1_poll,
   .release = asgn1_release,
+  .fsync = asgn1_fsync,
   .llseek = asgn1_lseek
 };
 
@@ -388,7 +2842,45 @@ int __init asgn1_init_module(void){
   atomic_set(&asgn1_device.nprocs, 0);
   atomic_set(&asgn1_device.max_nprocs, 1);
   asgn1_device.num_pages = 0;
-  asgn1_device.data_size = 0;
+  atomic64_set(&asgn1_device.data_size, 0);
+  asgn1_device.ring_pages = 0;
+  /* insertions run under tree_lock from preloaded nodes*/
+  INIT_RADIX_TREE(&asgn1_device.page_tree, GFP_ATOMIC);
+  spin_lock_init(&asgn1_device.tree_lock);
+  mutex_init(&asgn1_device.lock);
+  mutex_init(&asgn1_device.alloc_lock);
+  atomic64_set(&asgn1_device.tail, 0);
+  init_waitqueue_head(&asgn1_device.commit_wq);
+  spin_lock_init(&asgn1_device.commit_lock);
+  INIT_LIST_HEAD(&asgn1_device.commit_pending);
+  init_waitqueue_head(&asgn1_device.data_wq);
+  atomic_set(&asgn1_device.wake_pending, 0);
+  spin_lock_init(&asgn1_device.stats_lock);
+  atomic_set(&asgn1_device.stats_maps, 0);
+  INIT_DELAYED_WORK(&asgn1_device.stats_work, asgn1_stats_work);
+  spin_lock_init(&asgn1_device.share_lock);
+  atomic_set(&asgn1_device.shared_pages, 0);
+  atomic_set(&asgn1_device.readmostly_pages, 0);
+  mutex_init(&asgn1_device.cache_lock);
+  init_waitqueue_head(&asgn1_device.load_wq);
+  INIT_WORK(&asgn1_device.readahead_work, asgn1_readahead_work);
+  INIT_LIST_HEAD(&asgn1_device.lru);
+  INIT_DELAYED_WORK(&asgn1_device.writeback_work, asgn1_writeback_work);
+  asgn1_device.stats = (struct asgn1_stats *)get_zeroed_page(GFP_KERNEL);
+  if(!asgn1_device.stats)
+    return -ENOMEM;
+  asgn1_device.stats->version = ASGN1_STATS_VERSION;
+  result = percpu_init_rwsem(&asgn1_device.append_sem);
+  if(result != 0){
+    free_page((unsigned long)asgn1_device.stats);
+    return result;
+  }
+  asgn1_device.bulk_wq = alloc_workqueue("asgn1_bulk", WQ_UNBOUND, BULK_MAX_WORKERS);
+  if(!asgn1_device.bulk_wq){
+    percpu_free_rwsem(&asgn1_device.append_sem);
+    free_page((unsigned long)asgn1_device.stats);
+    return -ENOMEM;
+  }
 
   /* dynamically allocates a major and minor number to the device*/
   asgn1_device.dev = MKDEV(asgn1_major, asgn1_minor);
@@ -421,7 +2913,31 @@ int __init asgn1_init_module(void){
   }
 
   asgn1_proc->read_proc = asgn1_read_procmem;
+
+  /* the heat map lives in debugfs, it is not fatal if that is unavailable*/
+  asgn1_device.debugfs = debugfs_create_dir(MYDEV_NAME, NULL);
+  if(!IS_ERR_OR_NULL(asgn1_device.debugfs)){
+    debugfs_create_bool("heatmap_enabled", 0644, asgn1_device.debugfs, &asgn1_heat_enabled);
+    debugfs_create_file("heatmap", 0644, asgn1_device.debugfs, NULL, &asgn1_heatmap_fops);
+    debugfs_create_file("histogram", 0444, asgn1_device.debugfs, NULL, &asgn1_histogram_fops);
+    debugfs_create_file("numa", 0444, asgn1_device.debugfs, NULL, &asgn1_numa_fops);
+  }
   
+  /* in cache mode the device starts out as large as its backing file*/
+  if(backing_file){
+    asgn1_device.backing = filp_open(backing_file, O_RDWR | O_LARGEFILE, 0);
+    if(IS_ERR(asgn1_device.backing)){
+      printk(KERN_WARNING "%s: can't open backing file %s\n", MYDEV_NAME, backing_file);
+      result = PTR_ERR(asgn1_device.backing);
+      asgn1_device.backing = NULL;
+      goto fail_device;
+    }
+    atomic64_set(&asgn1_device.data_size, i_size_read(asgn1_device.backing->f_path.dentry->d_inode));
+    atomic64_set(&asgn1_device.tail, atomic64_read(&asgn1_device.data_size));
+    asgn1_device.num_pages = (atomic64_read(&asgn1_device.data_size) + PAGE_SIZE - 1) >> PAGE_SHIFT;
+    printk(KERN_INFO "%s: caching %s, %lu pages\n", MYDEV_NAME, backing_file, asgn1_device.num_pages);
+  }
+
   asgn1_device.class = class_create(THIS_MODULE, MYDEV_NAME);
   if (IS_ERR(asgn1_device.class)) {
   }
@@ -433,6 +2949,13 @@ int __init asgn1_init_module(void){
     result = -ENOMEM;
     goto fail_device;
   }
+
+  result = misc_register(&asgn1_stats_misc);
+  if(result != 0){
+    printk(KERN_WARNING "%s: can't register the statistics node\n", MYDEV_NAME);
+    device_destroy(asgn1_device.class, asgn1_device.dev);
+    goto fail_device;
+  }
   
   printk(KERN_WARNING "set up udev entry\n");
   printk(KERN_WARNING "Hello world from %s\n", MYDEV_NAME);
@@ -442,6 +2965,9 @@ int __init asgn1_init_module(void){
   /* I ran out of time to make each of the following steps conditional on their creation*/
  fail_device:
   printk(KERN_INFO "asgn_1_init: I died prematurely\n");
+  if(asgn1_device.backing)
+    fput(asgn1_device.backing);
+  debugfs_remove_recursive(asgn1_device.debugfs);
   class_destroy(asgn1_device.class);
  
   if(asgn1_proc)
@@ -449,6 +2975,9 @@ int __init asgn1_init_module(void){
  
   cdev_del(asgn1_device.cdev);
   unregister_chrdev_region(asgn1_device.dev, asgn1_dev_count);
+  destroy_workqueue(asgn1_device.bulk_wq);
+  percpu_free_rwsem(&asgn1_device.append_sem);
+  free_page((unsigned long)asgn1_device.stats);
   return result;
 }
 
@@ -457,11 +2986,22 @@ int __init asgn1_init_module(void){
  * Finalise the module. Deallocates everything in the correct order.
  */
 void __exit asgn1_exit_module(void){
+  misc_deregister(&asgn1_stats_misc);
+  debugfs_remove_recursive(asgn1_device.debugfs);
   device_destroy(asgn1_device.class, asgn1_device.dev);
   class_destroy(asgn1_device.class);
   printk(KERN_WARNING "cleaned up udev entry\n");
-  
+
+  /* dirty pages go back to the backing file before the cache is dropped*/
+  if(asgn1_device.backing){
+    cancel_work_sync(&asgn1_device.readahead_work);
+    cancel_delayed_work_sync(&asgn1_device.writeback_work);
+    if(asgn1_cache_flush())
+      printk(KERN_WARNING "%s: final write-back failed\n", MYDEV_NAME);
+  }
   free_memory_pages();
+  if(asgn1_device.backing)
+    fput(asgn1_device.backing);
   printk(KERN_INFO"successfully freed pages\n");
   if(asgn1_proc)
   remove_proc_entry(MYDEV_NAME, NULL);
@@ -469,6 +3009,10 @@ void __exit asgn1_exit_module(void){
   printk(KERN_INFO"successfully deleted device\n");
   unregister_chrdev_region(asgn1_device.dev, asgn1_dev_count);
   printk(KERN_INFO"successfully unregistered major/minor numbers\n");
+  destroy_workqueue(asgn1_device.bulk_wq);
+  percpu_free_rwsem(&asgn1_device.append_sem);
+  cancel_delayed_work_sync(&asgn1_device.stats_work);
+  free_page((unsigned long)asgn1_device.stats);
   printk(KERN_WARNING "Good bye from %s\n", MYDEV_NAME);
 }
 
@@ -0,0 +1,193 @@
+/**
+ * File: asgn1.h
+ * Author: Joshua La Pine
+ *
+ * The user space interface of the asgn1 virtual ramdisk: ioctl commands and
+ * the structures they exchange. Shared by the module and its test programs.
+ */
+
+#ifndef ASGN1_H
+#define ASGN1_H
+
+#include <linux/types.h>
+#include <linux/ioctl.h>
+
+#define MYIOC_TYPE 'k'
+
+/**
+ * The valid window of a ring-mode device, as reported by ASGN1_GET_WINDOW.
+ * first is the oldest offset still held and last is one past the newest byte.
+ */
+struct asgn1_window {
+  __u64 first;
+  __u64 last;
+};
+
+/**
+ * One entry of an ASGN1_BATCH_IO batch: a read or a write of len bytes at
+ * offset, to or from the user buffer at buf. result is filled in with the
+ * bytes transferred or a negative errno, as read() or write() would return.
+ * Writes on an O_APPEND descriptor ignore offset.
+ */
+#define ASGN1_IO_READ 0
+#define ASGN1_IO_WRITE 1
+
+struct asgn1_io {
+  __u64 offset;
+  __u64 buf;
+  __u32 len;
+  __u32 op;             /* ASGN1_IO_READ or ASGN1_IO_WRITE */
+  __s64 result;
+};
+
+/**
+ * A batch of at most ASGN1_BATCH_MAX entries, run in order in one call.
+ * ios is the address of an array of count struct asgn1_io. The ioctl returns
+ * the number of entries run, which is short only if a descriptor could not
+ * be read or its result written back.
+ */
+#define ASGN1_BATCH_MAX 4096
+
+struct asgn1_batch {
+  __u64 ios;
+  __u32 count;
+  __u32 pad;
+};
+
+/**
+ * An ASGN1_COPY_RANGE request: copy len bytes at src to dst inside the
+ * device. The ranges must not overlap. When src and dst have the same offset
+ * within a page the whole pages are shared copy on write, so large clones
+ * cost no copying.
+ */
+struct asgn1_copy {
+  __u64 src;
+  __u64 dst;
+  __u64 len;
+};
+
+/**
+ * An ASGN1_HASH request: crc is set to the CRC32C (Castagnoli) of the len
+ * bytes at offset, computed inside the kernel.
+ */
+struct asgn1_hash {
+  __u64 offset;
+  __u64 len;
+  __u32 crc;            /* filled in */
+  __u32 pad;
+};
+
+/**
+ * An ASGN1_SEARCH request: finds the offsets in [offset, offset + len) at
+ * which the pattern_len bytes at pattern occur, overlapping ones included.
+ * Up to max_matches offsets are stored in the __u64 array at matches and
+ * nmatches is set to their number. next is where the scan stopped, so a
+ * full result can be continued by searching again from next.
+ */
+#define ASGN1_PATTERN_MAX 256
+
+struct asgn1_search {
+  __u64 offset;
+  __u64 len;
+  __u64 pattern;
+  __u64 matches;
+  __u32 pattern_len;
+  __u32 max_matches;
+  __u32 nmatches;       /* filled in */
+  __u32 pad;
+  __u64 next;           /* filled in */
+};
+
+/**
+ * An ASGN1_GET_DIRTY request: reports which pages of [offset, offset + len)
+ * changed since the last clearing call, through write(), mmap stores,
+ * ASGN1_COPY_RANGE or by being added to the device. offset must be page
+ * aligned. bitmap is the address of an array of __u64 words holding one bit
+ * per page, the page at offset being bit 0 of the first word, rounded up to
+ * whole words. count is set to the number of bits set. With
+ * ASGN1_DIRTY_CLEAR the reported pages are also marked clean again,
+ * atomically with respect to writers, so reading them back afterwards gives
+ * an incremental copy that misses nothing. Truncation forgets all pages, so
+ * a device that shrank has to be copied in full. Ring mode is not supported.
+ */
+#define ASGN1_DIRTY_CLEAR 1
+
+struct asgn1_dirty {
+  __u64 offset;
+  __u64 len;
+  __u64 bitmap;
+  __u32 flags;          /* ASGN1_DIRTY_CLEAR */
+  __u32 count;          /* filled in */
+};
+
+/**
+ * An ASGN1_SET_READMOSTLY request: marks the pages overlapping
+ * [offset, offset + len) read-mostly if on is set, or unmarks them. read() of
+ * a read-mostly page is served from a copy on the reader's NUMA node, made
+ * on first use. Writing a page unmarks it and drops its copies. A len
+ * reaching past the end covers the whole device. Per node counters are in
+ * the numa file of the asgn1 debugfs directory.
+ */
+struct asgn1_readmostly {
+  __u64 offset;
+  __u64 len;
+  __u32 on;
+  __u32 pad;
+};
+
+#define SET_NPROC_OP 1
+#define ASGN1_SET_NPROC _IOW(MYIOC_TYPE, SET_NPROC_OP, int)
+#define SET_RING_OP 2
+#define ASGN1_SET_RING _IOW(MYIOC_TYPE, SET_RING_OP, __u64)
+#define GET_WINDOW_OP 3
+#define ASGN1_GET_WINDOW _IOR(MYIOC_TYPE, GET_WINDOW_OP, struct asgn1_window)
+#define SET_FOLLOW_OP 4
+#define ASGN1_SET_FOLLOW _IOW(MYIOC_TYPE, SET_FOLLOW_OP, int)
+/* 5 was SET_ZEROCOPY, withdrawn*/
+#define BATCH_IO_OP 6
+#define ASGN1_BATCH_IO _IOW(MYIOC_TYPE, BATCH_IO_OP, struct asgn1_batch)
+#define COPY_RANGE_OP 7
+#define ASGN1_COPY_RANGE _IOW(MYIOC_TYPE, COPY_RANGE_OP, struct asgn1_copy)
+#define HASH_OP 8
+#define ASGN1_HASH _IOWR(MYIOC_TYPE, HASH_OP, struct asgn1_hash)
+#define SEARCH_OP 9
+#define ASGN1_SEARCH _IOWR(MYIOC_TYPE, SEARCH_OP, struct asgn1_search)
+#define GET_DIRTY_OP 10
+#define ASGN1_GET_DIRTY _IOWR(MYIOC_TYPE, GET_DIRTY_OP, struct asgn1_dirty)
+#define SET_READMOSTLY_OP 11
+#define ASGN1_SET_READMOSTLY _IOW(MYIOC_TYPE, SET_READMOSTLY_OP, struct asgn1_readmostly)
+
+/**
+ * The read only statistics page, mapped by calling mmap on the separate node
+ * ASGN1_STATS_NODE with offset 0, so it never shadows a page of the device.
+ * The counters are kept per cpu and summed into the page when it is faulted
+ * in and then every 100 ms while it stays mapped, so a snapshot may be that
+ * much behind. It is updated in place like a seqcount: seq is odd while an
+ * update is in progress, so a reader copies the counters and retries if seq
+ * was odd or changed in the meantime. New counters are only ever added at
+ * the end.
+ */
+#define ASGN1_STATS_VERSION 1
+#define ASGN1_STATS_NODE "/dev/asgn1_stats"
+
+struct asgn1_stats {
+  __u32 version;        /* ASGN1_STATS_VERSION */
+  __u32 seq;            /* odd while the counters are being updated */
+  __u64 num_pages;      /* pages currently held */
+  __u64 data_size;      /* committed data size */
+  __u64 nprocs;         /* processes with the device open */
+  __u64 reads;          /* read calls and bytes read */
+  __u64 read_bytes;
+  __u64 writes;         /* write calls, including appends, and bytes written */
+  __u64 write_bytes;
+  __u64 mmaps;          /* successful mmap calls and bytes mapped */
+  __u64 mmap_bytes;
+  __u64 ioctls;         /* ioctl calls */
+  __u64 alloc_failures; /* failed page or page node allocations */
+  __u64 cache_hits;     /* cache mode: page accesses found resident */
+  __u64 cache_misses;   /* cache mode: page accesses that had to load the page */
+  __u64 writebacks;     /* cache mode: pages written back to the backing file */
+  __u64 evictions;      /* cache mode: clean pages dropped to make room */
+};
+
+#endif
@@ -0,0 +1,1540 @@
+/**
+ * File: asgn1_bench.c
+ * Author: Joshua La Pine
+ *
+ * Benchmarks for the asgn1 virtual ramdisk.
+ *
+ * usage: asgn1_bench append [device] [total records] [record size]
+ *        asgn1_bench stats
+ *        asgn1_bench large [device] [size in MB]
+ *        asgn1_bench stream [device] [working set in KB]
+ *        asgn1_bench parallel [device] [size in MB] [max workers]
+ *        asgn1_bench batch [device] [lookups] [lookup size]
+ *        asgn1_bench scan [device] [size in MB]
+ *        asgn1_bench dirty [device] [size in MB]
+ *        asgn1_bench numa [device] [size in MB] [passes]
+ *        asgn1_bench ring [device] [ring pages]
+ *        asgn1_bench follow [device]
+ *        asgn1_bench heatmap [device]
+ *        asgn1_bench cow [device] [pages]
+ *        asgn1_bench cache [device] [backing file]
+ *
+ *   append  - appends fixed size records from 1 to 64 threads sharing one
+ *             O_APPEND descriptor and reports the throughput of each run.
+ *             Every record is filled with a byte unique to its writer, so
+ *             the read back check catches torn or interleaved records.
+ *   stats   - maps the statistics page through /dev/asgn1_stats and
+ *             prints a consistent snapshot once a second, without any
+ *             system calls per sample.
+ *   large   - fills the device past 4 GB (5 GB by default) with words
+ *             holding their own offset, then times reading it back and
+ *             checks it through read() and through mmap windows on both
+ *             sides of the 4 GB boundary and at the end. Sizes past 2^31
+ *             pages can be given where memory allows.
+ *   stream  - runs a cache sensitive pointer chase over a working set sized
+ *             like the last level cache, alone and next to 64 MB streaming
+ *             writes with nocache_threshold off and on, and reports the
+ *             chase latency and the write throughput of each run. Changing
+ *             the module parameter needs root.
+ *   parallel - times single read() and write() calls of the whole size
+ *             (1 GB by default) through the parallel copy engine with 1 up
+ *             to max workers (every online cpu by default), doubling each
+ *             run. Needs root to set the module parameters.
+ *   batch   - does small reads at random offsets of a 64 MB device, first
+ *             as lseek() and read() pairs and then through ASGN1_BATCH_IO
+ *             batches, checks the results agree and reports lookups/s.
+ *   scan    - fills the device with random bytes and a planted pattern, then
+ *             computes its CRC32C and finds the pattern both by reading it
+ *             out and with ASGN1_HASH and ASGN1_SEARCH, checking the two
+ *             agree and reporting the scan rate of each.
+ *   dirty   - keeps a backup of the device (256 MB by default) in memory and
+ *             times a full copy, then changes 0.1%, 1% and 10% of its pages
+ *             through a shared mapping and through write(), and times each
+ *             incremental copy driven by ASGN1_GET_DIRTY, checking the
+ *             backup matches the device afterwards.
+ *   numa    - fills the device (64 MB by default) from one node, then runs
+ *             a reader pinned to each NUMA node reading all of it passes
+ *             times (10 by default), first as plain pages and then marked
+ *             read-mostly, and reports each node's read rate and the per
+ *             node counters from debugfs (readable by root).
+ *   ring    - turns ring mode on with ring pages (16 by default), writes
+ *             three and a half times its capacity and checks the window
+ *             ASGN1_GET_WINDOW reports, that it holds the newest data, that
+ *             reads and seeks before it land at its start, and that writes
+ *             before it and O_APPEND writes fail with EINVAL. Ring mode is
+ *             turned off again afterwards.
+ *   follow  - checks a follower (ASGN1_SET_FOLLOW) at the end of the data:
+ *             poll() does not report it readable and a non-blocking read
+ *             fails with EAGAIN, then poll() and a blocking read each wake
+ *             when another descriptor appends a record, and return it.
+ *   heatmap - turns the debugfs heat map on, writes four pages, reads one of
+ *             them three times and touches another through a mapping, then
+ *             checks the read, write and fault counts the heat map reports
+ *             for each page. Needs root for debugfs.
+ *   cow     - clones pages (64 by default) with ASGN1_COPY_RANGE so they are
+ *             shared copy on write, checks the clone, then writes pages of
+ *             the source and of the clone through write() and through a
+ *             shared mapping, and checks each write shows up only on the
+ *             side it was made to.
+ *   cache   - checks cache mode on the backing file given (/tmp/asgn1.img
+ *             by default). The first run fills the file with 256 pages of
+ *             words holding their own offset and asks for the module to be
+ *             loaded on it. The next run turns cache_pages down to 64 and
+ *             reads the pages in random order, so most reads miss, then
+ *             sequentially with short pauses, so read-ahead gets ahead of
+ *             the reader, checking every page read and taking the misses
+ *             and hits of each pass from the statistics page. Finally it
+ *             checks a write reaches the file on fsync. Needs root to set
+ *             the module parameter.
+ */
+
+#define _GNU_SOURCE
+#define _FILE_OFFSET_BITS 64
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/ioctl.h>
+#include <sys/time.h>
+#include <sys/mman.h>
+#include <poll.h>
+#include <sched.h>
+#include "asgn1.h"
+
+#define MAX_THREADS 64
+#define LARGE_CHUNK (64UL << 20)
+#define STREAM_SECONDS 5
+#define PARAM_DIR "/sys/module/asgn1/parameters/"
+#define SCAN_PATTERN "asgn1-needle"
+#define SCAN_PLANTS 1000
+#define NUMA_CHUNK (256 << 10)
+#define NUMA_NODE_DIR "/sys/devices/system/node/"
+#define NUMA_STATS "/sys/kernel/debug/asgn1/numa"
+#define FOLLOW_DELAY_US 100000
+#define HEAT_DIR "/sys/kernel/debug/asgn1/"
+#define HEAT_PAGES 4
+#define CACHE_PAGES 64
+#define CACHE_TEST_PAGES (4 * CACHE_PAGES)
+#define CACHE_PAUSE_US 2000
+#define FOLLOW_RECORD "followed record"
+
+static char *filename = "/dev/asgn1";
+
+struct append_arg {
+  int fd;
+  int id;
+  long records;
+  size_t record_size;
+};
+
+static double now(void) {
+  struct timeval tv;
+
+  gettimeofday(&tv, NULL);
+  return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+/* Opening the device write only frees all of its pages*/
+static void truncate_device(void) {
+  int fd = open(filename, O_WRONLY);
+
+  if (fd < 0) {
+    fprintf(stderr, "open of %s failed:  %s\n", filename, strerror(errno));
+    exit(1);
+  }
+  close(fd);
+}
+
+/* Writes all of buf, retrying short writes*/
+static ssize_t my_write(int fd, const void *buf, size_t len) {
+  size_t done = 0;
+  ssize_t result;
+
+  while (done < len) {
+    result = write(fd, (const char *)buf + done, len - done);
+    if (result < 0) {
+      if (errno == EINTR)
+        continue;
+      return result;
+    }
+    done += result;
+  }
+  return done;
+}
+
+static void *append_worker(void *data) {
+  struct append_arg *arg = data;
+  char *record = malloc(arg->record_size);
+  long i;
+
+  memset(record, 'A' + arg->id % 26, arg->record_size);
+  for (i = 0; i < arg->records; i++) {
+    if (write(arg->fd, record, arg->record_size) != (ssize_t)arg->record_size) {
+      perror("write()");
+      exit(1);
+    }
+  }
+  free(record);
+  return NULL;
+}
+
+/* Reads the device back and checks that no record was torn*/
+static void check_records(long records, size_t record_size) {
+  char *record = malloc(record_size);
+  int fd = open(filename, O_RDONLY);
+  long i;
+  size_t j;
+
+  for (i = 0; i < records; i++) {
+    if (read(fd, record, record_size) != (ssize_t)record_size) {
+      fprintf(stderr, "short device, record %ld missing\n", i);
+      exit(1);
+    }
+    for (j = 1; j < record_size; j++) {
+      if (record[j] != record[0]) {
+        fprintf(stderr, "record %ld is torn at byte %zu\n", i, j);
+        exit(1);
+      }
+    }
+  }
+  close(fd);
+  free(record);
+}
+
+static void bench_append(long records, size_t record_size) {
+  pthread_t threads[MAX_THREADS];
+  struct append_arg args[MAX_THREADS];
+  int nproc = MAX_THREADS + 1;
+  int nthreads, i, fd;
+  double start, elapsed;
+
+  printf("threads  records/s       MB/s\n");
+  for (nthreads = 1; nthreads <= MAX_THREADS; nthreads *= 2) {
+    truncate_device();
+    if ((fd = open(filename, O_RDWR | O_APPEND)) < 0) {
+      fprintf(stderr, "open of %s failed:  %s\n", filename, strerror(errno));
+      exit(1);
+    }
+    ioctl(fd, ASGN1_SET_NPROC, &nproc);
+
+    start = now();
+    for (i = 0; i < nthreads; i++) {
+      args[i].fd = fd;
+      args[i].id = i;
+      args[i].records = records / nthreads;
+      args[i].record_size = record_size;
+      pthread_create(&threads[i], NULL, append_worker, &args[i]);
+    }
+    for (i = 0; i < nthreads; i++)
+      pthread_join(threads[i], NULL);
+    elapsed = now() - start;
+    close(fd);
+
+    printf("%7d %10.0f %10.1f\n", nthreads,
+           (records / nthreads) * nthreads / elapsed,
+           (records / nthreads) * nthreads * record_size / elapsed / 1e6);
+    check_records((records / nthreads) * nthreads, record_size);
+  }
+}
+
+/* Fills buf with the words that belong at offset*/
+static void fill_offsets(unsigned long long *buf, off_t offset, size_t len) {
+  size_t i;
+
+  for (i = 0; i < len / sizeof(*buf); i++)
+    buf[i] = offset / sizeof(*buf) + i;
+}
+
+/* Returns the index of the first word in buf that does not hold its offset, or -1*/
+static long check_offsets(const unsigned long long *buf, off_t offset, size_t len) {
+  size_t i;
+
+  for (i = 0; i < len / sizeof(*buf); i++)
+    if (buf[i] != offset / sizeof(*buf) + i)
+      return i;
+  return -1;
+}
+
+/* Maps len bytes of the device at offset and checks them*/
+static void check_mmap_window(int fd, off_t offset, size_t len) {
+  unsigned long long *map;
+  long bad;
+
+  map = mmap(NULL, len, PROT_READ, MAP_SHARED, fd, offset);
+  if (map == MAP_FAILED) {
+    fprintf(stderr, "mmap at %lld failed:  %s\n", (long long)offset, strerror(errno));
+    exit(1);
+  }
+  if ((bad = check_offsets(map, offset, len)) >= 0) {
+    fprintf(stderr, "mmap miscompare at %lld\n", (long long)offset + bad * 8);
+    exit(1);
+  }
+  munmap(map, len);
+  printf("mmap window at %lld ok\n", (long long)offset);
+}
+
+static void bench_large(off_t size) {
+  unsigned long long *buf = malloc(LARGE_CHUNK);
+  size_t len;
+  off_t pos;
+  double start, elapsed;
+  long bad;
+  int fd;
+
+  size -= size % LARGE_CHUNK;
+  truncate_device();
+  if ((fd = open(filename, O_RDWR)) < 0) {
+    fprintf(stderr, "open of %s failed:  %s\n", filename, strerror(errno));
+    exit(1);
+  }
+
+  start = now();
+  for (pos = 0; pos < size; pos += LARGE_CHUNK) {
+    fill_offsets(buf, pos, LARGE_CHUNK);
+    if (my_write(fd, buf, LARGE_CHUNK) != LARGE_CHUNK) {
+      fprintf(stderr, "write at %lld failed:  %s\n", (long long)pos, strerror(errno));
+      exit(1);
+    }
+  }
+  elapsed = now() - start;
+  printf("filled %lld bytes at %.1f MB/s\n", (long long)size, size / elapsed / 1e6);
+
+  if (lseek(fd, 0, SEEK_END) != size) {
+    fprintf(stderr, "device size is %lld, expected %lld\n",
+            (long long)lseek(fd, 0, SEEK_END), (long long)size);
+    exit(1);
+  }
+
+  lseek(fd, 0, SEEK_SET);
+  start = now();
+  for (pos = 0; pos < size; pos += len) {
+    len = read(fd, buf, LARGE_CHUNK);
+    if (len != LARGE_CHUNK) {
+      fprintf(stderr, "read at %lld failed:  %s\n", (long long)pos, strerror(errno));
+      exit(1);
+    }
+    if ((bad = check_offsets(buf, pos, len)) >= 0) {
+      fprintf(stderr, "read miscompare at %lld\n", (long long)pos + bad * 8);
+      exit(1);
+    }
+  }
+  elapsed = now() - start;
+  printf("read back and checked at %.1f MB/s\n", size / elapsed / 1e6);
+
+  if (size > (4LL << 30))
+    check_mmap_window(fd, (4LL << 30) - LARGE_CHUNK / 2, LARGE_CHUNK);
+  check_mmap_window(fd, size - LARGE_CHUNK, LARGE_CHUNK);
+
+  close(fd);
+  free(buf);
+}
+
+struct chase_arg {
+  size_t *ring;
+  volatile int *stop;
+  double ns_per_access;
+  size_t last;
+};
+
+/* Builds a single random cycle through n slots so the chase defeats the prefetcher*/
+static size_t *make_chase_ring(size_t n) {
+  size_t *ring = malloc(n * sizeof(*ring));
+  size_t *order = malloc(n * sizeof(*order));
+  size_t i, j, tmp;
+
+  for (i = 0; i < n; i++)
+    order[i] = i;
+  for (i = n - 1; i > 0; i--) {
+    j = random() % (i + 1);
+    tmp = order[i];
+    order[i] = order[j];
+    order[j] = tmp;
+  }
+  for (i = 0; i < n; i++)
+    ring[order[i]] = order[(i + 1) % n];
+  free(order);
+  return ring;
+}
+
+static void *chase_worker(void *data) {
+  struct chase_arg *arg = data;
+  size_t pos = 0;
+  long accesses = 0;
+  double start = now();
+  int i;
+
+  while (!*arg->stop) {
+    for (i = 0; i < 4096; i++)
+      pos = arg->ring[pos];
+    accesses += 4096;
+  }
+  arg->ns_per_access = (now() - start) * 1e9 / accesses;
+  arg->last = pos; /* keeps the chase from being optimised away*/
+  return NULL;
+}
+
+/* Sets a module parameter of asgn1 through sysfs*/
+static void set_param(const char *name, unsigned long value) {
+  char path[128];
+  FILE *param;
+
+  snprintf(path, sizeof(path), PARAM_DIR "%s", name);
+  if ((param = fopen(path, "w")) == NULL) {
+    fprintf(stderr, "open of %s failed:  %s\n", path, strerror(errno));
+    exit(1);
+  }
+  fprintf(param, "%lu\n", value);
+  fclose(param);
+}
+
+/* Runs the chase for STREAM_SECONDS, optionally next to a streaming writer*/
+static void stream_run(const char *name, size_t *ring, int writer) {
+  volatile int stop = 0;
+  struct chase_arg arg = { ring, &stop, 0, 0 };
+  char *buf = malloc(LARGE_CHUNK);
+  pthread_t thread;
+  double start, elapsed;
+  long long written = 0;
+  int fd = -1;
+
+  memset(buf, 'S', LARGE_CHUNK);
+  if (writer) {
+    truncate_device();
+    if ((fd = open(filename, O_WRONLY)) < 0) {
+      fprintf(stderr, "open of %s failed:  %s\n", filename, strerror(errno));
+      exit(1);
+    }
+  }
+
+  pthread_create(&thread, NULL, chase_worker, &arg);
+  start = now();
+  while ((elapsed = now() - start) < STREAM_SECONDS) {
+    if (!writer) {
+      usleep(100000);
+      continue;
+    }
+    /* rewrites the same region so the device does not grow without bound*/
+    if (lseek(fd, 0, SEEK_SET) < 0 || my_write(fd, buf, LARGE_CHUNK) != LARGE_CHUNK) {
+      perror("write()");
+      exit(1);
+    }
+    written += LARGE_CHUNK;
+  }
+  stop = 1;
+  pthread_join(thread, NULL);
+
+  if (writer) {
+    close(fd);
+    printf("%-16s %8.1f ns/access %10.1f MB/s\n", name, arg.ns_per_access, written / elapsed / 1e6);
+  } else {
+    printf("%-16s %8.1f ns/access\n", name, arg.ns_per_access);
+  }
+  free(buf);
+}
+
+static void bench_stream(size_t working_set) {
+  size_t *ring = make_chase_ring(working_set / sizeof(size_t));
+
+  stream_run("chase alone", ring, 0);
+  set_param("nocache_threshold", 0);
+  stream_run("cached writes", ring, 1);
+  set_param("nocache_threshold", 1024 * 1024);
+  stream_run("nocache writes", ring, 1);
+  free(ring);
+}
+
+static void bench_parallel(size_t size, int max_workers) {
+  char *buf = malloc(size);
+  double start, read_time, write_time;
+  int workers, fd;
+
+  if (buf == NULL) {
+    perror("malloc()");
+    exit(1);
+  }
+  memset(buf, 'P', size);
+  truncate_device();
+  if ((fd = open(filename, O_RDWR)) < 0) {
+    fprintf(stderr, "open of %s failed:  %s\n", filename, strerror(errno));
+    exit(1);
+  }
+  /* the first write allocates the pages, so it is left out of the timings*/
+  if (my_write(fd, buf, size) != (ssize_t)size) {
+    perror("write()");
+    exit(1);
+  }
+
+  set_param("parallel_threshold", 1024 * 1024);
+  printf("workers  read MB/s  write MB/s\n");
+  for (workers = 1; workers <= max_workers; workers *= 2) {
+    set_param("parallel_workers", workers);
+
+    lseek(fd, 0, SEEK_SET);
+    start = now();
+    if (read(fd, buf, size) != (ssize_t)size) {
+      perror("read()");
+      exit(1);
+    }
+    read_time = now() - start;
+
+    lseek(fd, 0, SEEK_SET);
+    start = now();
+    if (write(fd, buf, size) != (ssize_t)size) {
+      perror("write()");
+      exit(1);
+    }
+    write_time = now() - start;
+
+    printf("%7d %10.1f %11.1f\n", workers, size / read_time / 1e6, size / write_time / 1e6);
+  }
+  set_param("parallel_threshold", 0);
+  set_param("parallel_workers", 0);
+  close(fd);
+  free(buf);
+}
+
+static void bench_batch(long lookups, size_t lookup_size) {
+  struct asgn1_io ios[ASGN1_BATCH_MAX];
+  struct asgn1_batch batch;
+  unsigned long long *buf = malloc(LARGE_CHUNK);
+  char *serial = malloc(lookups * lookup_size);
+  char *batched = malloc(lookups * lookup_size);
+  off_t *offsets = malloc(lookups * sizeof(*offsets));
+  double start, elapsed;
+  long i, j, n;
+  int fd;
+
+  truncate_device();
+  if ((fd = open(filename, O_RDWR)) < 0) {
+    fprintf(stderr, "open of %s failed:  %s\n", filename, strerror(errno));
+    exit(1);
+  }
+  fill_offsets(buf, 0, LARGE_CHUNK);
+  if (my_write(fd, buf, LARGE_CHUNK) != LARGE_CHUNK) {
+    perror("write()");
+    exit(1);
+  }
+  for (i = 0; i < lookups; i++)
+    offsets[i] = random() % (LARGE_CHUNK - lookup_size);
+
+  start = now();
+  for (i = 0; i < lookups; i++) {
+    if (lseek(fd, offsets[i], SEEK_SET) != offsets[i] ||
+        read(fd, serial + i * lookup_size, lookup_size) != (ssize_t)lookup_size) {
+      perror("read()");
+      exit(1);
+    }
+  }
+  elapsed = now() - start;
+  printf("lseek+read %12.0f lookups/s\n", lookups / elapsed);
+
+  start = now();
+  for (i = 0; i < lookups; i += n) {
+    n = lookups - i < ASGN1_BATCH_MAX ? lookups - i : ASGN1_BATCH_MAX;
+    for (j = 0; j < n; j++) {
+      ios[j].offset = offsets[i + j];
+      ios[j].buf = (unsigned long)(batched + (i + j) * lookup_size);
+      ios[j].len = lookup_size;
+      ios[j].op = ASGN1_IO_READ;
+    }
+    batch.ios = (unsigned long)ios;
+    batch.count = n;
+    if (ioctl(fd, ASGN1_BATCH_IO, &batch) != n) {
+      perror("ioctl(ASGN1_BATCH_IO)");
+      exit(1);
+    }
+    for (j = 0; j < n; j++) {
+      if (ios[j].result != (__s64)lookup_size) {
+        fprintf(stderr, "batch entry %ld returned %lld\n", i + j, (long long)ios[j].result);
+        exit(1);
+      }
+    }
+  }
+  elapsed = now() - start;
+  printf("batched    %12.0f lookups/s\n", lookups / elapsed);
+
+  if (memcmp(serial, batched, lookups * lookup_size) != 0) {
+    fprintf(stderr, "batched reads differ from lseek+read\n");
+    exit(1);
+  }
+  close(fd);
+  free(offsets);
+  free(batched);
+  free(serial);
+  free(buf);
+}
+
+/* Bitwise CRC32C, only used to check the kernel's result*/
+static unsigned int crc32c_update(unsigned int crc, const unsigned char *buf, size_t len) {
+  static unsigned int table[256];
+  unsigned int c;
+  int i, j;
+
+  if (table[1] == 0) {
+    for (i = 0; i < 256; i++) {
+      for (c = i, j = 0; j < 8; j++)
+        c = (c >> 1) ^ (c & 1 ? 0x82f63b78 : 0);
+      table[i] = c;
+    }
+  }
+  while (len--)
+    crc = table[(crc ^ *buf++) & 0xff] ^ (crc >> 8);
+  return crc;
+}
+
+static void bench_scan(size_t size) {
+  unsigned char *buf = malloc(size);
+  unsigned long long *found = malloc(2 * SCAN_PLANTS * sizeof(*found));
+  size_t plen = strlen(SCAN_PATTERN);
+  struct asgn1_hash hash;
+  struct asgn1_search search;
+  unsigned int crc;
+  unsigned char *hit, *from;
+  double start, elapsed;
+  long nfound = 0, nsearched = 0;
+  size_t i;
+  int fd;
+
+  if (buf == NULL || found == NULL) {
+    perror("malloc()");
+    exit(1);
+  }
+  for (i = 0; i < size; i++)
+    buf[i] = random();
+  for (i = 0; i < SCAN_PLANTS; i++)
+    memcpy(buf + random() % (size - plen), SCAN_PATTERN, plen);
+
+  truncate_device();
+  if ((fd = open(filename, O_RDWR)) < 0) {
+    fprintf(stderr, "open of %s failed:  %s\n", filename, strerror(errno));
+    exit(1);
+  }
+  if (my_write(fd, buf, size) != (ssize_t)size) {
+    perror("write()");
+    exit(1);
+  }
+
+  /* the baseline reads everything out and scans it in user space*/
+  start = now();
+  lseek(fd, 0, SEEK_SET);
+  if (read(fd, buf, size) != (ssize_t)size) {
+    perror("read()");
+    exit(1);
+  }
+  crc = ~crc32c_update(~0U, buf, size);
+  for (from = buf; (hit = memmem(from, buf + size - from, SCAN_PATTERN, plen)) != NULL; from = hit + 1)
+    nfound++;
+  elapsed = now() - start;
+  printf("read out   %10.1f MB/s  crc %08x  %ld matches\n", size / elapsed / 1e6, crc, nfound);
+
+  start = now();
+  hash.offset = 0;
+  hash.len = size;
+  if (ioctl(fd, ASGN1_HASH, &hash) < 0) {
+    perror("ioctl(ASGN1_HASH)");
+    exit(1);
+  }
+  search.offset = 0;
+  search.len = size;
+  search.pattern = (unsigned long)SCAN_PATTERN;
+  search.pattern_len = plen;
+  search.matches = (unsigned long)found;
+  search.max_matches = 2 * SCAN_PLANTS;
+  do {
+    if (ioctl(fd, ASGN1_SEARCH, &search) < 0) {
+      perror("ioctl(ASGN1_SEARCH)");
+      exit(1);
+    }
+    nsearched += search.nmatches;
+    search.len -= search.next - search.offset;
+    search.offset = search.next;
+  } while (search.nmatches == search.max_matches);
+  elapsed = now() - start;
+  printf("in kernel  %10.1f MB/s  crc %08x  %ld matches\n", size / elapsed / 1e6, hash.crc, nsearched);
+
+  if (hash.crc != crc || nsearched != nfound) {
+    fprintf(stderr, "in kernel results differ from the read out ones\n");
+    exit(1);
+  }
+  close(fd);
+  free(found);
+  free(buf);
+}
+
+/* Returns the changed pages of the device and marks them clean*/
+static unsigned int get_dirty(int fd, unsigned long long *bitmap, size_t size) {
+  struct asgn1_dirty dirty;
+
+  dirty.offset = 0;
+  dirty.len = size;
+  dirty.bitmap = (unsigned long)bitmap;
+  dirty.flags = ASGN1_DIRTY_CLEAR;
+  if (ioctl(fd, ASGN1_GET_DIRTY, &dirty) < 0) {
+    perror("ioctl(ASGN1_GET_DIRTY)");
+    exit(1);
+  }
+  return dirty.count;
+}
+
+static void bench_dirty(size_t size) {
+  size_t page_size = sysconf(_SC_PAGESIZE);
+  size_t npages = size / page_size;
+  unsigned char *backup = malloc(size);
+  unsigned long long *bitmap = malloc((npages + 63) / 64 * sizeof(*bitmap));
+  static const int per_mille[] = { 1, 10, 100 };
+  unsigned char *map;
+  unsigned int count;
+  double start, elapsed;
+  size_t i, j, page, changes;
+  int fd, run;
+
+  if (backup == NULL || bitmap == NULL) {
+    perror("malloc()");
+    exit(1);
+  }
+  for (i = 0; i < size; i++)
+    backup[i] = random();
+
+  truncate_device();
+  if ((fd = open(filename, O_RDWR)) < 0) {
+    fprintf(stderr, "open of %s failed:  %s\n", filename, strerror(errno));
+    exit(1);
+  }
+  if (my_write(fd, backup, size) != (ssize_t)size) {
+    perror("write()");
+    exit(1);
+  }
+  map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  if (map == MAP_FAILED) {
+    perror("mmap()");
+    exit(1);
+  }
+  get_dirty(fd, bitmap, size);
+
+  start = now();
+  if (pread(fd, backup, size, 0) != (ssize_t)size) {
+    perror("pread()");
+    exit(1);
+  }
+  elapsed = now() - start;
+  printf("full copy         %8zu pages  %10.3f ms\n", npages, elapsed * 1e3);
+
+  for (run = 0; run < 3; run++) {
+    /* every other change is a store through the mapping, the rest are writes*/
+    changes = npages * per_mille[run] / 1000;
+    for (i = 0; i < changes; i++) {
+      page = random() % npages;
+      if (i & 1)
+        map[page * page_size + random() % page_size] ^= 0xff;
+      else if (pwrite(fd, &i, sizeof(i), page * page_size + random() % (page_size - sizeof(i))) != sizeof(i)) {
+        perror("pwrite()");
+        exit(1);
+      }
+    }
+
+    start = now();
+    count = get_dirty(fd, bitmap, size);
+    for (i = 0; i < (npages + 63) / 64; i++) {
+      for (j = 0; j < 64 && bitmap[i] >> j; j++) {
+        if (!(bitmap[i] >> j & 1))
+          continue;
+        page = i * 64 + j;
+        if (pread(fd, backup + page * page_size, page_size, page * page_size) != (ssize_t)page_size) {
+          perror("pread()");
+          exit(1);
+        }
+      }
+    }
+    elapsed = now() - start;
+    printf("%5.1f%% changed    %8u pages  %10.3f ms\n", per_mille[run] / 10.0, count, elapsed * 1e3);
+
+    if (memcmp(backup, map, size) != 0) {
+      fprintf(stderr, "incremental copy missed changes\n");
+      exit(1);
+    }
+  }
+  munmap(map, size);
+  close(fd);
+  free(bitmap);
+  free(backup);
+}
+
+struct numa_arg {
+  cpu_set_t cpus;
+  size_t size;
+  int passes;
+  double rate;
+};
+
+/* Reads a node's cpulist, such as 0-3,8-11, into cpus. Returns 0 if there is no such node*/
+static int node_cpus(int node, cpu_set_t *cpus) {
+  char path[64], list[4096], *p;
+  int first, last, cpu;
+  FILE *f;
+
+  snprintf(path, sizeof(path), NUMA_NODE_DIR "node%d/cpulist", node);
+  if ((f = fopen(path, "r")) == NULL)
+    return 0;
+  if (fgets(list, sizeof(list), f) == NULL)
+    list[0] = '\0';
+  fclose(f);
+
+  CPU_ZERO(cpus);
+  for (p = list; sscanf(p, "%d", &first) == 1; p++) {
+    last = first;
+    p += strspn(p, "0123456789");
+    if (*p == '-') {
+      last = atoi(++p);
+      p += strspn(p, "0123456789");
+    }
+    for (cpu = first; cpu <= last; cpu++)
+      CPU_SET(cpu, cpus);
+    if (*p != ',')
+      break;
+  }
+  return 1;
+}
+
+static void *numa_worker(void *data) {
+  struct numa_arg *arg = data;
+  char *buf = malloc(NUMA_CHUNK);
+  double start;
+  off_t pos;
+  int fd, pass;
+
+  pthread_setaffinity_np(pthread_self(), sizeof(arg->cpus), &arg->cpus);
+  if (buf == NULL || (fd = open(filename, O_RDONLY)) < 0) {
+    fprintf(stderr, "numa reader setup failed:  %s\n", strerror(errno));
+    exit(1);
+  }
+  start = now();
+  for (pass = 0; pass < arg->passes; pass++) {
+    for (pos = 0; pos < (off_t)arg->size; pos += NUMA_CHUNK) {
+      if (pread(fd, buf, NUMA_CHUNK, pos) != NUMA_CHUNK) {
+        perror("pread()");
+        exit(1);
+      }
+    }
+  }
+  arg->rate = (double)arg->size * arg->passes / (now() - start) / 1e6;
+  close(fd);
+  free(buf);
+  return NULL;
+}
+
+static void numa_run(const char *name, struct numa_arg *args, int nodes) {
+  pthread_t threads[MAX_THREADS];
+  int i;
+
+  for (i = 0; i < nodes; i++)
+    pthread_create(&threads[i], NULL, numa_worker, &args[i]);
+  for (i = 0; i < nodes; i++)
+    pthread_join(threads[i], NULL);
+  printf("%-11s", name);
+  for (i = 0; i < nodes; i++)
+    printf(" %10.1f", args[i].rate);
+  printf("\n");
+}
+
+static void bench_numa(size_t size, int passes) {
+  struct numa_arg args[MAX_THREADS];
+  struct asgn1_readmostly readmostly;
+  char *buf = malloc(NUMA_CHUNK);
+  char line[256];
+  size_t done;
+  FILE *f;
+  int nodes, i, fd;
+
+  size = (size + NUMA_CHUNK - 1) / NUMA_CHUNK * NUMA_CHUNK;
+  for (nodes = 0; nodes < MAX_THREADS && node_cpus(nodes, &args[nodes].cpus); nodes++) {
+    args[nodes].size = size;
+    args[nodes].passes = passes;
+  }
+  if (nodes == 0 || buf == NULL) {
+    fprintf(stderr, "no NUMA nodes found under " NUMA_NODE_DIR "\n");
+    exit(1);
+  }
+
+  /* filling from node 0 puts every page there*/
+  sched_setaffinity(0, sizeof(args[0].cpus), &args[0].cpus);
+  truncate_device();
+  if ((fd = open(filename, O_RDWR)) < 0) {
+    fprintf(stderr, "open of %s failed:  %s\n", filename, strerror(errno));
+    exit(1);
+  }
+  memset(buf, 'N', NUMA_CHUNK);
+  for (done = 0; done < size; done += NUMA_CHUNK) {
+    if (my_write(fd, buf, NUMA_CHUNK) != NUMA_CHUNK) {
+      perror("write()");
+      exit(1);
+    }
+  }
+
+  printf("MB/s on   ");
+  for (i = 0; i < nodes; i++)
+    printf("     node %d", i);
+  printf("\n");
+  numa_run("plain", args, nodes);
+
+  readmostly.offset = 0;
+  readmostly.len = size;
+  readmostly.on = 1;
+  if (ioctl(fd, ASGN1_SET_READMOSTLY, &readmostly) < 0) {
+    perror("ioctl(ASGN1_SET_READMOSTLY)");
+    exit(1);
+  }
+  numa_run("read-mostly", args, nodes);
+
+  if ((f = fopen(NUMA_STATS, "r")) != NULL) {
+    while (fgets(line, sizeof(line), f) != NULL)
+      fputs(line, stdout);
+    fclose(f);
+  }
+  readmostly.on = 0;
+  ioctl(fd, ASGN1_SET_READMOSTLY, &readmostly);
+  close(fd);
+  free(buf);
+}
+
+/* Copies the statistics page, retrying while an update is in progress*/
+/* Checks that a write fails with EINVAL, as ring mode demands*/
+static void expect_einval(ssize_t result, const char *what) {
+  if (result >= 0 || errno != EINVAL) {
+    fprintf(stderr, "%s returned %zd (%s), expected EINVAL\n", what, result,
+            result < 0 ? strerror(errno) : "no error");
+    exit(1);
+  }
+}
+
+static void bench_ring(unsigned long ring_pages) {
+  size_t page_size = getpagesize();
+  size_t capacity = ring_pages * page_size;
+  size_t total = 3 * capacity + capacity / 2 + page_size / 2;
+  unsigned long long *buf;
+  struct asgn1_window window;
+  __u64 pages = ring_pages;
+  off_t first, pos;
+  long bad;
+  int fd;
+
+  if (ring_pages < 1) {
+    fprintf(stderr, "the ring needs at least one page\n");
+    exit(1);
+  }
+  buf = malloc(capacity + page_size);
+  truncate_device();
+  if ((fd = open(filename, O_RDWR)) < 0) {
+    fprintf(stderr, "open of %s failed:  %s\n", filename, strerror(errno));
+    exit(1);
+  }
+  if (ioctl(fd, ASGN1_SET_RING, &pages) < 0) {
+    perror("ioctl(ASGN1_SET_RING)");
+    exit(1);
+  }
+
+  /* page sized writes wrap over the oldest pages several times*/
+  for (pos = 0; pos < (off_t)total; pos += page_size) {
+    fill_offsets(buf, pos, page_size);
+    if (my_write(fd, buf, pos + page_size > total ? total - pos : page_size) < 0) {
+      fprintf(stderr, "write at %lld failed:  %s\n", (long long)pos, strerror(errno));
+      exit(1);
+    }
+  }
+
+  /* the window is the last ring_pages pages, ending at the last byte written*/
+  first = ((total + page_size - 1) / page_size - ring_pages) * page_size;
+  if (ioctl(fd, ASGN1_GET_WINDOW, &window) < 0) {
+    perror("ioctl(ASGN1_GET_WINDOW)");
+    exit(1);
+  }
+  if (window.first != (__u64)first || window.last != total) {
+    fprintf(stderr, "window is %llu-%llu, expected %lld-%zu\n", (unsigned long long)window.first,
+            (unsigned long long)window.last, (long long)first, total);
+    exit(1);
+  }
+
+  /* a seek before the window lands at its start, and reading from there gives the newest data*/
+  if (lseek(fd, 0, SEEK_SET) != first) {
+    fprintf(stderr, "seek to 0 did not land at the window start %lld\n", (long long)first);
+    exit(1);
+  }
+  if (read(fd, buf, capacity + page_size) != (ssize_t)(total - first)) {
+    fprintf(stderr, "read of the window was short\n");
+    exit(1);
+  }
+  if ((bad = check_offsets(buf, first, (total - first) & ~7UL)) >= 0) {
+    fprintf(stderr, "window miscompare at %lld\n", (long long)first + bad * 8);
+    exit(1);
+  }
+  if (pread(fd, buf, page_size, 0) != (ssize_t)page_size || check_offsets(buf, first, page_size) >= 0) {
+    fprintf(stderr, "read before the window did not start at the window\n");
+    exit(1);
+  }
+  printf("window %lld-%zu holds the newest data\n", (long long)first, total);
+
+  expect_einval(pwrite(fd, buf, 8, 0), "write before the window");
+  expect_einval(pwrite(fd, buf, 8, first - 8), "write just before the window");
+  if (pwrite(fd, buf, 8, first) != 8) {
+    fprintf(stderr, "write at the window start failed:  %s\n", strerror(errno));
+    exit(1);
+  }
+  close(fd);
+  if ((fd = open(filename, O_RDWR | O_APPEND)) < 0) {
+    fprintf(stderr, "open of %s failed:  %s\n", filename, strerror(errno));
+    exit(1);
+  }
+  expect_einval(write(fd, buf, 8), "O_APPEND write in ring mode");
+  printf("writes before the window and appends fail with EINVAL\n");
+
+  pages = 0;
+  if (ioctl(fd, ASGN1_SET_RING, &pages) < 0) {
+    perror("ioctl(ASGN1_SET_RING)");
+    exit(1);
+  }
+  close(fd);
+  free(buf);
+}
+
+struct follow_arg {
+  int fd;
+  double done;          /* when the read or append finished */
+  ssize_t result;
+  char buf[64];
+};
+
+/* Appends a record after FOLLOW_DELAY_US, for a follower to wake on*/
+static void *follow_appender(void *data) {
+  struct follow_arg *arg = data;
+
+  usleep(FOLLOW_DELAY_US);
+  arg->done = now();
+  arg->result = write(arg->fd, FOLLOW_RECORD, sizeof(FOLLOW_RECORD));
+  return NULL;
+}
+
+/* Blocks in read() at the end of the data until a record is appended*/
+static void *follow_reader(void *data) {
+  struct follow_arg *arg = data;
+
+  arg->result = read(arg->fd, arg->buf, sizeof(arg->buf));
+  arg->done = now();
+  return NULL;
+}
+
+/* Checks the follower read back exactly one record*/
+static void check_followed(struct follow_arg *arg, const char *how) {
+  if (arg->result != sizeof(FOLLOW_RECORD) || memcmp(arg->buf, FOLLOW_RECORD, sizeof(FOLLOW_RECORD))) {
+    fprintf(stderr, "%s read returned %zd, not the appended record\n", how, arg->result);
+    exit(1);
+  }
+}
+
+static void bench_follow(void) {
+  struct follow_arg appender, reader;
+  struct pollfd pfd;
+  pthread_t thread;
+  int nproc = 4, on = 1;
+  double start;
+  int afd, rfd;
+
+  truncate_device();
+  if ((rfd = open(filename, O_RDONLY)) < 0) {
+    fprintf(stderr, "open of %s failed:  %s\n", filename, strerror(errno));
+    exit(1);
+  }
+  ioctl(rfd, ASGN1_SET_NPROC, &nproc);
+  if (ioctl(rfd, ASGN1_SET_FOLLOW, &on) < 0) {
+    perror("ioctl(ASGN1_SET_FOLLOW)");
+    exit(1);
+  }
+  if ((afd = open(filename, O_RDWR | O_APPEND)) < 0) {
+    fprintf(stderr, "open of %s failed:  %s\n", filename, strerror(errno));
+    exit(1);
+  }
+  appender.fd = afd;
+  /* a follower that never wakes kills the run*/
+  alarm(10);
+
+  /* nothing to read yet*/
+  pfd.fd = rfd;
+  pfd.events = POLLIN;
+  if (poll(&pfd, 1, 0) != 0) {
+    fprintf(stderr, "empty device polled readable\n");
+    exit(1);
+  }
+  fcntl(rfd, F_SETFL, O_NONBLOCK);
+  if (read(rfd, reader.buf, sizeof(reader.buf)) >= 0 || errno != EAGAIN) {
+    fprintf(stderr, "non-blocking read at the end did not fail with EAGAIN\n");
+    exit(1);
+  }
+  fcntl(rfd, F_SETFL, 0);
+
+  /* poll wakes on the append*/
+  pthread_create(&thread, NULL, follow_appender, &appender);
+  if (poll(&pfd, 1, 5000) != 1 || !(pfd.revents & POLLIN)) {
+    fprintf(stderr, "poll did not wake on the append\n");
+    exit(1);
+  }
+  start = now();
+  pthread_join(thread, NULL);
+  if (appender.result != sizeof(FOLLOW_RECORD)) {
+    perror("append");
+    exit(1);
+  }
+  reader.result = read(rfd, reader.buf, sizeof(reader.buf));
+  check_followed(&reader, "polled");
+  printf("poll woke %.1f ms after the append\n", (start - appender.done) * 1e3);
+
+  /* and so does a blocking read*/
+  reader.fd = rfd;
+  pthread_create(&thread, NULL, follow_reader, &reader);
+  follow_appender(&appender);
+  if (appender.result != sizeof(FOLLOW_RECORD)) {
+    perror("append");
+    exit(1);
+  }
+  pthread_join(thread, NULL);
+  check_followed(&reader, "blocking");
+  printf("blocking read woke %.1f ms after the append\n", (reader.done - appender.done) * 1e3);
+  alarm(0);
+
+  close(afd);
+  close(rfd);
+}
+
+/* Writes value to the heat map file name in debugfs*/
+static void set_heat(const char *name, const char *value) {
+  char path[128];
+  FILE *file;
+
+  snprintf(path, sizeof(path), HEAT_DIR "%s", name);
+  if ((file = fopen(path, "w")) == NULL) {
+    fprintf(stderr, "open of %s failed:  %s\n", path, strerror(errno));
+    exit(1);
+  }
+  fprintf(file, "%s\n", value);
+  fclose(file);
+}
+
+/* Checks one heat map count against what the run did to the page*/
+static void check_heat(const char *what, unsigned long page_no, unsigned int count, unsigned int expected) {
+  if (count != expected) {
+    fprintf(stderr, "heat map shows %u %s of page %lu, expected %u\n", count, what, page_no, expected);
+    exit(1);
+  }
+}
+
+static void bench_heatmap(void) {
+  size_t page_size = getpagesize();
+  unsigned int reads, writes, faults, idle;
+  volatile char *map;
+  unsigned long page_no;
+  char line[128], *buf;
+  int fd, found = 0, i;
+  FILE *heat;
+
+  buf = calloc(HEAT_PAGES, page_size);
+  truncate_device();
+  if ((fd = open(filename, O_RDWR)) < 0) {
+    fprintf(stderr, "open of %s failed:  %s\n", filename, strerror(errno));
+    exit(1);
+  }
+  if (my_write(fd, buf, HEAT_PAGES * page_size) < 0) {
+    perror("write()");
+    exit(1);
+  }
+
+  /* only what happens after the reset is counted*/
+  set_heat("heatmap_enabled", "1");
+  set_heat("heatmap", "0");
+  if (pwrite(fd, buf, HEAT_PAGES * page_size, 0) != (ssize_t)(HEAT_PAGES * page_size)) {
+    perror("pwrite()");
+    exit(1);
+  }
+  for (i = 0; i < 3; i++) {
+    if (pread(fd, buf, page_size, page_size) != (ssize_t)page_size) {
+      perror("pread()");
+      exit(1);
+    }
+  }
+  map = mmap(NULL, HEAT_PAGES * page_size, PROT_READ, MAP_SHARED, fd, 0);
+  if (map == MAP_FAILED) {
+    perror("mmap()");
+    exit(1);
+  }
+  (void)map[2 * page_size];
+
+  if ((heat = fopen(HEAT_DIR "heatmap", "r")) == NULL) {
+    fprintf(stderr, "open of %s failed:  %s\n", HEAT_DIR "heatmap", strerror(errno));
+    exit(1);
+  }
+  while (fgets(line, sizeof(line), heat)) {
+    if (sscanf(line, "%lu %u %u %u %u", &page_no, &reads, &writes, &faults, &idle) != 5)
+      continue;
+    if (page_no >= HEAT_PAGES)
+      continue;
+    check_heat("writes", page_no, writes, 1);
+    check_heat("reads", page_no, reads, page_no == 1 ? 3 : 0);
+    check_heat("faults", page_no, faults, page_no == 2 ? 1 : 0);
+    found++;
+  }
+  fclose(heat);
+  if (found != HEAT_PAGES) {
+    fprintf(stderr, "heat map lists %d of the %d pages\n", found, HEAT_PAGES);
+    exit(1);
+  }
+  printf("heat map counts match the accesses of all %d pages\n", HEAT_PAGES);
+
+  set_heat("heatmap_enabled", "0");
+  munmap((void *)map, HEAT_PAGES * page_size);
+  close(fd);
+  free(buf);
+}
+
+/* Checks page page_no of the region at base still holds the source's original words*/
+static void check_cow_page(int fd, off_t base, unsigned long page_no, const char *side) {
+  size_t page_size = getpagesize();
+  unsigned long long *buf = malloc(page_size);
+
+  if (pread(fd, buf, page_size, base + page_no * page_size) != (ssize_t)page_size ||
+      check_offsets(buf, page_no * page_size, page_size) >= 0) {
+    fprintf(stderr, "page %lu of the %s changed\n", page_no, side);
+    exit(1);
+  }
+  free(buf);
+}
+
+/* Overwrites page page_no of the region at base, through a mapping if mapped*/
+static void scribble_page(int fd, off_t base, unsigned long page_no, int mapped) {
+  size_t page_size = getpagesize();
+  char *buf, *map;
+
+  if (mapped) {
+    map = mmap(NULL, page_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, base + page_no * page_size);
+    if (map == MAP_FAILED) {
+      perror("mmap()");
+      exit(1);
+    }
+    memset(map, 0xff, page_size);
+    munmap(map, page_size);
+  } else {
+    buf = malloc(page_size);
+    memset(buf, 0xff, page_size);
+    if (pwrite(fd, buf, page_size, base + page_no * page_size) != (ssize_t)page_size) {
+      perror("pwrite()");
+      exit(1);
+    }
+    free(buf);
+  }
+}
+
+static void bench_cow(unsigned long pages) {
+  size_t page_size = getpagesize();
+  size_t len = pages * page_size;
+  struct asgn1_copy copy;
+  unsigned long long *buf;
+  unsigned long i;
+  int fd;
+
+  if (pages < 8) {
+    fprintf(stderr, "the clone needs at least 8 pages\n");
+    exit(1);
+  }
+  buf = malloc(len);
+  fill_offsets(buf, 0, len);
+  truncate_device();
+  if ((fd = open(filename, O_RDWR)) < 0) {
+    fprintf(stderr, "open of %s failed:  %s\n", filename, strerror(errno));
+    exit(1);
+  }
+  if (my_write(fd, buf, len) < 0) {
+    perror("write()");
+    exit(1);
+  }
+
+  /* page aligned on both sides, so the pages are shared*/
+  copy.src = 0;
+  copy.dst = len;
+  copy.len = len;
+  if (ioctl(fd, ASGN1_COPY_RANGE, &copy) < 0) {
+    perror("ioctl(ASGN1_COPY_RANGE)");
+    exit(1);
+  }
+  for (i = 0; i < pages; i++)
+    check_cow_page(fd, len, i, "clone");
+  printf("clone of %lu pages matches the source\n", pages);
+
+  /* writes to the source stay out of the clone*/
+  scribble_page(fd, 0, 1, 0);
+  scribble_page(fd, 0, 3, 1);
+  /* and writes to the clone stay out of the source*/
+  scribble_page(fd, len, 5, 0);
+  scribble_page(fd, len, 6, 1);
+
+  for (i = 0; i < pages; i++) {
+    if (i != 1 && i != 3)
+      check_cow_page(fd, 0, i, "source");
+    if (i != 5 && i != 6)
+      check_cow_page(fd, len, i, "clone");
+  }
+  if (pread(fd, buf, page_size, page_size) != (ssize_t)page_size || buf[0] != ~0ULL ||
+      pread(fd, buf, page_size, len + 6 * page_size) != (ssize_t)page_size || buf[0] != ~0ULL) {
+    fprintf(stderr, "a write to a shared page was lost\n");
+    exit(1);
+  }
+  printf("writes through write() and mmap broke sharing on their own side only\n");
+
+  close(fd);
+  free(buf);
+}
+
+static void stats_snapshot(volatile struct asgn1_stats *page, struct asgn1_stats *snap) {
+  __u32 seq;
+
+  do {
+    while ((seq = page->seq) & 1)
+      ;
+    __sync_synchronize();
+    memcpy(snap, (void *)page, sizeof(*snap));
+    __sync_synchronize();
+  } while (page->seq != seq);
+}
+
+static volatile struct asgn1_stats *map_stats(void) {
+  volatile struct asgn1_stats *page;
+  int fd;
+
+  if ((fd = open(ASGN1_STATS_NODE, O_RDONLY)) < 0) {
+    fprintf(stderr, "open of %s failed:  %s\n", ASGN1_STATS_NODE, strerror(errno));
+    exit(1);
+  }
+  page = mmap(NULL, sizeof(*page), PROT_READ, MAP_SHARED, fd, 0);
+  if (page == MAP_FAILED) {
+    fprintf(stderr, "mmap of the stats page failed:  %s\n", strerror(errno));
+    exit(1);
+  }
+  /* the mapping stays valid after the descriptor is closed*/
+  close(fd);
+  return page;
+}
+
+static void monitor_stats(void) {
+  volatile struct asgn1_stats *page;
+  struct asgn1_stats snap;
+
+  page = map_stats();
+
+  if (page->version != ASGN1_STATS_VERSION) {
+    fprintf(stderr, "unknown stats version %u\n", page->version);
+    exit(1);
+  }
+
+  for (;;) {
+    stats_snapshot(page, &snap);
+    printf("pages %llu size %llu procs %llu reads %llu/%lluB writes %llu/%lluB "
+           "mmaps %llu ioctls %llu alloc failures %llu cache hits %llu misses %llu "
+           "write-backs %llu evictions %llu\n",
+           (unsigned long long)snap.num_pages, (unsigned long long)snap.data_size,
+           (unsigned long long)snap.nprocs, (unsigned long long)snap.reads,
+           (unsigned long long)snap.read_bytes, (unsigned long long)snap.writes,
+           (unsigned long long)snap.write_bytes, (unsigned long long)snap.mmaps,
+           (unsigned long long)snap.ioctls, (unsigned long long)snap.alloc_failures,
+           (unsigned long long)snap.cache_hits, (unsigned long long)snap.cache_misses,
+           (unsigned long long)snap.writebacks, (unsigned long long)snap.evictions);
+    sleep(1);
+  }
+}
+
+/* Reads page page_no of fd and checks it holds the words of its offset, or their complement*/
+static void check_cache_page(int fd, unsigned long page_no, int flipped, const char *what) {
+  size_t page_size = getpagesize();
+  unsigned long long *buf = malloc(page_size);
+  size_t i;
+
+  if (pread(fd, buf, page_size, page_no * page_size) != (ssize_t)page_size) {
+    fprintf(stderr, "%s of page %lu was short\n", what, page_no);
+    exit(1);
+  }
+  if (flipped)
+    for (i = 0; i < page_size / sizeof(*buf); i++)
+      buf[i] = ~buf[i];
+  if (check_offsets(buf, page_no * page_size, page_size) >= 0) {
+    fprintf(stderr, "%s of page %lu miscompares\n", what, page_no);
+    exit(1);
+  }
+  free(buf);
+}
+
+/* Takes a snapshot of the statistics page once it has been refreshed*/
+static void cache_counts(volatile struct asgn1_stats *page, struct asgn1_stats *snap) {
+  usleep(200000);
+  stats_snapshot(page, snap);
+}
+
+/* Writes the first page of the device, fsyncs and checks it reached the backing file*/
+static void check_writeback(int fd, const char *backing, int flipped) {
+  size_t page_size = getpagesize();
+  unsigned long long *buf = malloc(page_size);
+  size_t i;
+  int bfd;
+
+  fill_offsets(buf, 0, page_size);
+  if (flipped)
+    for (i = 0; i < page_size / sizeof(*buf); i++)
+      buf[i] = ~buf[i];
+  if (pwrite(fd, buf, page_size, 0) != (ssize_t)page_size || fsync(fd) < 0) {
+    perror("write back");
+    exit(1);
+  }
+  if ((bfd = open(backing, O_RDONLY)) < 0) {
+    fprintf(stderr, "open of %s failed:  %s\n", backing, strerror(errno));
+    exit(1);
+  }
+  check_cache_page(bfd, 0, flipped, "backing file copy");
+  close(bfd);
+  free(buf);
+}
+
+static void bench_cache(const char *backing) {
+  size_t page_size = getpagesize();
+  size_t len = CACHE_TEST_PAGES * page_size;
+  unsigned long order[CACHE_TEST_PAGES], i, j, t;
+  struct asgn1_stats before, after;
+  volatile struct asgn1_stats *page;
+  unsigned long long *buf;
+  unsigned long old_pages = 16384;
+  FILE *param;
+  int fd, bfd;
+
+  /* the pages have to start out in the file only, so the module is loaded on a prepared file*/
+  buf = malloc(len);
+  if ((bfd = open(backing, O_RDONLY)) < 0 || pread(bfd, buf, len, 0) != (ssize_t)len ||
+      check_offsets(buf, 0, len) >= 0) {
+    if (bfd >= 0)
+      close(bfd);
+    fill_offsets(buf, 0, len);
+    if ((bfd = open(backing, O_WRONLY | O_CREAT | O_TRUNC, 0644)) < 0 || my_write(bfd, buf, len) < 0) {
+      fprintf(stderr, "writing %s failed:  %s\n", backing, strerror(errno));
+      exit(1);
+    }
+    close(bfd);
+    printf("prepared %s; load asgn1 with backing_file=%s and run this again\n", backing, backing);
+    return;
+  }
+  close(bfd);
+
+  if ((param = fopen(PARAM_DIR "cache_pages", "r")) != NULL) {
+    if (fscanf(param, "%lu", &old_pages) != 1)
+      old_pages = 16384;
+    fclose(param);
+  }
+  set_param("cache_pages", CACHE_PAGES);
+
+  if ((fd = open(filename, O_RDWR)) < 0) {
+    fprintf(stderr, "open of %s failed:  %s\n", filename, strerror(errno));
+    exit(1);
+  }
+  page = map_stats();
+
+  /* random order, so read-ahead never kicks in and most reads miss*/
+  for (i = 0; i < CACHE_TEST_PAGES; i++)
+    order[i] = i;
+  for (i = CACHE_TEST_PAGES - 1; i > 0; i--) {
+    j = random() % (i + 1);
+    t = order[i];
+    order[i] = order[j];
+    order[j] = t;
+  }
+  cache_counts(page, &before);
+  for (i = 0; i < CACHE_TEST_PAGES; i++)
+    check_cache_page(fd, order[i], 0, "random read");
+  cache_counts(page, &after);
+  printf("random reads:     %llu misses %llu hits\n",
+         (unsigned long long)(after.cache_misses - before.cache_misses),
+         (unsigned long long)(after.cache_hits - before.cache_hits));
+  if (after.cache_misses == before.cache_misses) {
+    fprintf(stderr, "random reads of %d pages with %d cached never missed\n",
+            CACHE_TEST_PAGES, CACHE_PAGES);
+    exit(1);
+  }
+
+  /* pausing between pages lets the read-ahead work load the window first*/
+  before = after;
+  for (i = 0; i < CACHE_TEST_PAGES; i++) {
+    check_cache_page(fd, i, 0, "sequential read");
+    usleep(CACHE_PAUSE_US);
+  }
+  cache_counts(page, &after);
+  printf("sequential reads: %llu misses %llu hits\n",
+         (unsigned long long)(after.cache_misses - before.cache_misses),
+         (unsigned long long)(after.cache_hits - before.cache_hits));
+  if (after.cache_hits - before.cache_hits <= after.cache_misses - before.cache_misses) {
+    fprintf(stderr, "read-ahead did not get ahead of a sequential reader\n");
+    exit(1);
+  }
+
+  /* write-back, leaving the file as it was for the next run*/
+  check_writeback(fd, backing, 1);
+  check_writeback(fd, backing, 0);
+  printf("write-back reached %s\n", backing);
+
+  set_param("cache_pages", old_pages);
+  munmap((void *)page, sizeof(*page));
+  close(fd);
+  free(buf);
+}
+
+int main(int argc, char **argv) {
+  long records = 1 << 20;
+  size_t record_size = 64;
+
+  if (argc < 2) {
+    fprintf(stderr, "usage: %s append|stats|large|stream|parallel|batch|scan|dirty|numa|ring|follow|heatmap|cow|cache [device] [options]\n", argv[0]);
+    exit(1);
+  }
+  if (argc > 2)
+    filename = argv[2];
+
+  if (strcmp(argv[1], "append") == 0) {
+    if (argc > 3)
+      records = atol(argv[3]);
+    if (argc > 4)
+      record_size = atol(argv[4]);
+    bench_append(records, record_size);
+  } else if (strcmp(argv[1], "stats") == 0) {
+    monitor_stats();
+  } else if (strcmp(argv[1], "large") == 0) {
+    bench_large((off_t)(argc > 3 ? atol(argv[3]) : 5120) << 20);
+  } else if (strcmp(argv[1], "stream") == 0) {
+    bench_stream((size_t)(argc > 3 ? atol(argv[3]) : 8192) << 10);
+  } else if (strcmp(argv[1], "parallel") == 0) {
+    bench_parallel((size_t)(argc > 3 ? atol(argv[3]) : 1024) << 20,
+                   argc > 4 ? atoi(argv[4]) : sysconf(_SC_NPROCESSORS_ONLN));
+  } else if (strcmp(argv[1], "batch") == 0) {
+    bench_batch(argc > 3 ? atol(argv[3]) : 100000, argc > 4 ? atol(argv[4]) : 64);
+  } else if (strcmp(argv[1], "scan") == 0) {
+    bench_scan((size_t)(argc > 3 ? atol(argv[3]) : 256) << 20);
+  } else if (strcmp(argv[1], "dirty") == 0) {
+    bench_dirty((size_t)(argc > 3 ? atol(argv[3]) : 256) << 20);
+  } else if (strcmp(argv[1], "numa") == 0) {
+    bench_numa((size_t)(argc > 3 ? atol(argv[3]) : 64) << 20, argc > 4 ? atoi(argv[4]) : 10);
+  } else if (strcmp(argv[1], "ring") == 0) {
+    bench_ring(argc > 3 ? atol(argv[3]) : 16);
+  } else if (strcmp(argv[1], "follow") == 0) {
+    bench_follow();
+  } else if (strcmp(argv[1], "heatmap") == 0) {
+    bench_heatmap();
+  } else if (strcmp(argv[1], "cow") == 0) {
+    bench_cow(argc > 3 ? atol(argv[3]) : 64);
+  } else if (strcmp(argv[1], "cache") == 0) {
+    bench_cache(argc > 3 ? argv[3] : "/tmp/asgn1.img");
+  } else {
+    fprintf(stderr, "unknown benchmark %s\n", argv[1]);
+    exit(1);
+  }
+  return 0;
+}
@@ -0,0 +1,117 @@
+/**
+ * File: asgn2.h
+ * Author: Joshua La Pine
+ *
+ * The user space interface of the asgn2 device: ioctl commands and the
+ * structures they exchange. Shared by the module and its test programs.
+ */
+
+#ifndef ASGN2_H
+#define ASGN2_H
+
+#include <linux/types.h>
+#include <linux/ioctl.h>
+
+#define MYIOC_TYPE 'k'
+
+/**
+ * One message returned by ASGN2_READ_BATCH: its bytes, without the NUL that
+ * ended it, are at offset in the batch buffer. ASGN2_MSG_TRUNC is set if
+ * the message did not fit in the buffer and only its first len bytes were
+ * returned. The rest of it is dropped.
+ */
+#define ASGN2_MSG_TRUNC 1
+
+struct asgn2_msg {
+  __u32 offset;
+  __u32 len;
+  __u32 flags;          /* ASGN2_MSG_TRUNC */
+  __u32 pad;
+};
+
+/**
+ * An ASGN2_READ_BATCH request, the device's recvmmsg: reads as many
+ * complete messages as fit in the buf_len bytes at buf, back to back, and
+ * describes them in the array of max_msgs struct asgn2_msg at msgs. The
+ * ioctl returns the number of messages read. It waits for a complete
+ * message if there is none. A first message larger than buf_len is
+ * returned truncated, so a batch always makes progress. A message that
+ * read() has already started is returned from where read() stopped.
+ * buf_len must not be 0 and max_msgs may be at most ASGN2_BATCH_MAX.
+ */
+#define ASGN2_BATCH_MAX 4096
+
+struct asgn2_batch {
+  __u64 buf;
+  __u64 msgs;
+  __u32 buf_len;
+  __u32 max_msgs;
+};
+
+/**
+ * The mmap ring, for reading without copies. Mapping the device shared at
+ * offset 0, from a descriptor opened O_RDWR, gives the control page below,
+ * then msg_pages pages of message descriptors, then data_pages pages of
+ * data. While the ring is mapped, ingest delivers into it instead of the
+ * queue read() uses. Its size is set by the mmap_pages module parameter
+ * when it is first mapped.
+ *
+ * The ring's consumer has the stream to itself. The first mmap fails with
+ * EBUSY unless the descriptor is the only one open and is not balanced,
+ * and while the ring is mapped open fails with EBUSY and read() and
+ * ASGN2_READ_BATCH fail with EBUSY, waking if they were waiting. Ingest
+ * moves between the queue and the ring only at the end of a message: the
+ * ring starts once the message the queue was in has ended, and after the
+ * last munmap the rest of the message the ring was in is dropped, so
+ * read() starts again at a whole message.
+ *
+ * All positions are free running 32-bit counts that wrap. Data position p
+ * is at byte p & (data_pages * page size - 1) of the data. Message i is in
+ * descriptor slot i & (msg_slots - 1), and the slot holds the data
+ * position of the NUL that ends the message. A message starts one byte
+ * past the end of the message before it. The first message starts at
+ * position 0.
+ *
+ * The kernel fills data and descriptors and then advances prod_pos and
+ * prod_msg with release semantics. The consumer reads these with acquire
+ * semantics. When it is done with messages it advances cons_pos and
+ * cons_msg with a release store, and no system call is needed. A consumer
+ * that finds cons_msg == prod_msg waits in poll(). When the ring is full,
+ * data waits in the interrupt ring and stalls is counted. Messages longer
+ * than the data area cannot be delivered.
+ */
+#define ASGN2_RING_VERSION 1
+
+struct asgn2_ring_ctl {
+  __u32 version;        /* ASGN2_RING_VERSION */
+  __u32 data_pages;
+  __u32 msg_pages;
+  __u32 msg_slots;
+  __u32 prod_pos;       /* written by the kernel */
+  __u32 prod_msg;
+  __u32 cons_pos;       /* written by the consumer */
+  __u32 cons_msg;
+  __u32 stalls;         /* times ingest found the ring full */
+};
+
+/**
+ * Delivery modes, set for an open file with ASGN2_SET_DELIVERY. By default
+ * every reader is given every message. Readers set to ASGN2_DELIVER_BALANCE
+ * share one cursor instead and each message goes to exactly one of them,
+ * for spreading the work over a pool of processes. A balanced read()
+ * returns one whole message and drops what did not fit in the buffer, as a
+ * datagram socket would, so there are no reads of 0 between messages. Each
+ * new message wakes one waiting reader. The group starts where its first
+ * member was, and a reader leaving it carries on from where the group is.
+ */
+#define ASGN2_DELIVER_BROADCAST 0
+#define ASGN2_DELIVER_BALANCE 1
+
+#define SET_NPROC_OP 1
+#define ASGN2_SET_NPROC _IOW(MYIOC_TYPE, SET_NPROC_OP, int)
+#define READ_BATCH_OP 2
+#define ASGN2_READ_BATCH _IOW(MYIOC_TYPE, READ_BATCH_OP, struct asgn2_batch)
+#define SET_DELIVERY_OP 3
+#define ASGN2_SET_DELIVERY _IOW(MYIOC_TYPE, SET_DELIVERY_OP, int)
+
+#endif
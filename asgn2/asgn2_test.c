@@ -0,0 +1,1231 @@
+/**
+ * File: asgn2_test.c
+ * Author: Joshua La Pine
+ *
+ * Stress test for the asgn2 interrupt ring, run against the software source:
+ *
+ *   sudo insmod ./asgn2.ko soft_rate=1000000 ring_size=65536
+ *   ./asgn2_test [batch|poll|mmap] [device] [seconds]
+ *
+ * The software source produces sessions holding consecutive decimal
+ * counters. The test reads sessions for the given time (10 s by default)
+ * and checks each one against the expected counter: a skipped counter is a
+ * lost session, while anything that goes backwards or is not a number is an
+ * ordering or tearing error. Losses are only expected when the driver also
+ * reports dropped bytes in /proc/asgn2. The ring to queue latency histogram
+ * of the ingest thread is printed afterwards, so runs with different
+ * ingest_prio and ingest_cpu settings can be compared. With batch the
+ * sessions are read with the ASGN2_READ_BATCH ioctl instead of read(), many
+ * per call, which is what high session rates need. With poll the device is
+ * opened O_NONBLOCK and the test waits in poll() whenever no complete
+ * session is queued, checking that readiness is never reported early. With
+ * mmap the sessions are taken in place from the mmap ring, whose size is
+ * the mmap_pages module parameter; "ring stalled" counts the times ingest
+ * found it full.
+ *
+ * Every reader of the device is given the whole stream, so several copies
+ * of the test started together should each see every session. A copy that
+ * falls more than lag_limit bytes behind loses sessions under the default
+ * lag_policy, or fails with "Broken pipe" once detached with lag_policy=1;
+ * the Reader lines of /proc/asgn2 show how far behind each one is.
+ *
+ *   ./asgn2_test readers [N] [device] [seconds]
+ *
+ * The readers test checks this itself. It opens N readers (4 by default)
+ * at the same point of the stream and has each read it in a process of its
+ * own for the given time, failing unless every one starts at the same
+ * session and loses none. It then sets lag_limit to LAG_TEST_LIMIT and
+ * stalls one reader past it while another keeps up: with lag_policy=0 the
+ * stalled reader has to lose sessions without a torn one and be counted
+ * in the overruns of /proc/asgn2, and with lag_policy=1 it has to be
+ * reported by poll() with POLLERR and fail reads with EPIPE. Both are run
+ * with read() and again with ASGN2_READ_BATCH, and a slow batch reader is
+ * also detached while reading, which must end in EPIPE after clean
+ * sessions only. The reader that keeps up must lose nothing either way. The test sets soft_rate,
+ * lag_limit and lag_policy through their module parameters and puts them
+ * back afterwards, so this mode needs root.
+ *
+ *   ./asgn2_test workers [N] [device] [seconds]
+ *
+ * The workers benchmark spreads the sessions over pools of 1, 2, 4 ... up
+ * to N worker processes (16 by default), each pool running for the given
+ * time (2 s by default). The workers use ASGN2_DELIVER_BALANCE, so each
+ * session goes to exactly one of them, and do a fixed amount of work per
+ * session. The sessions per second of each pool and how many each worker
+ * took are printed. Every session has to be taken exactly once: one seen
+ * by two workers fails the run, and so does one missed, between the first
+ * and last session of a pool or between one pool and the next, unless
+ * lag_limit is set and skipped it. Workers blocked in read() are stopped
+ * with a signal that interrupts the read, so stopping loses nothing. The
+ * source has to outpace a single worker, e.g. soft_rate=20000000, with
+ * lag_limit set to bound what queues up meanwhile, or left unset for a
+ * strict check. max_nprocs is set to N.
+ *
+ *   ./asgn2_test group [N] [device] [seconds]
+ *
+ * The group test runs N balanced workers (2 by default) for the given time
+ * with the source slowed to a few sessions a second, while worker 0 is
+ * signalled every SIGNAL_US and stops reading for a while after each
+ * interrupted read. Every session has to be taken exactly once and none
+ * may wait longer than DELIVERY_LIMIT while a worker is idle, which a
+ * wakeup lost with worker 0's signal would cause. It then stalls N
+ * balanced readers past LAG_TEST_LIMIT with lag_policy=1 and checks that
+ * the group is detached: each member gets POLLERR and EPIPE, and so does
+ * one leaving the group. Like readers, it sets soft_rate, lag_limit and
+ * lag_policy and puts them back afterwards, so it needs root.
+ *
+ *   ./asgn2_test backlog [MB] [device]
+ *
+ * The backlog benchmark lets the driver queue MB megabytes (100 by default)
+ * without reading, then drains the queue and compares the mean cost of a
+ * read with the whole backlog queued against the cost once it is nearly
+ * empty. Both ends of the queue are reached directly, so the two should be
+ * about the same. The source has to outpace the benchmark's wait, e.g.
+ * soft_rate=50000000, and is paused through its module parameter while the
+ * queue drains, so this mode needs root.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/time.h>
+#include <sys/ioctl.h>
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <signal.h>
+#include "asgn2.h"
+
+#define MAX_SESSION 64
+#define BATCH_BUF (256 * 1024)
+#define BACKLOG_SAMPLE 10000   /* reads timed at each end of the backlog */
+#define BACKLOG_STEP 1000      /* reads between checks while draining */
+#define PARAM_DIR "/sys/module/asgn2/parameters/"
+#define MAX_WORKERS 16
+#define WORK_ROUNDS 200        /* passes over each session, standing in for real work */
+#define SEEN_SLOTS (1 << 24)   /* sessions of a pool run remembered to catch one delivered twice or missed */
+#define MAX_READERS 16
+#define READERS_RATE 200000    /* soft_rate of the readers test, slow enough for read() to keep up */
+#define LAG_TEST_LIMIT 65536   /* lag_limit of the readers test */
+#define STALL_SECONDS 2.0      /* how long the lagging reader stops reading */
+#define SLOW_BATCH 64          /* sessions per call of the batch reader detached while reading */
+#define SLOW_BATCH_US 10000    /* its pause between calls, too long for it to keep up */
+#define GROUP_RATE 40          /* soft_rate of the group test, a few sessions a second */
+#define SIGNAL_US 100          /* interval between the signals to worker 0 */
+#define SIGNAL_PAUSE_US 50000  /* how long worker 0 stops reading after one */
+#define DELIVERY_LIMIT 0.03    /* longest a session may wait with a worker idle, in s */
+
+/* Session check results, shared by both ways of reading*/
+static unsigned long first, expected, sessions, lost, errors;
+
+static double now(void) {
+  struct timeval tv;
+
+  gettimeofday(&tv, NULL);
+  return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+/* Returns the Dropped counter from the proc entry, or -1 if it is not there*/
+static long proc_dropped(void) {
+  char line[128];
+  long dropped = -1;
+  FILE *f = fopen("/proc/asgn2", "r");
+
+  if (f == NULL)
+    return -1;
+  while (fgets(line, sizeof(line), f) != NULL)
+    sscanf(line, " Dropped = %ld", &dropped);
+  fclose(f);
+  return dropped;
+}
+
+/* Returns the Data Size field of the proc entry, or -1 if it is not there*/
+static long proc_data_size(void) {
+  char line[128];
+  long size = -1;
+  FILE *f = fopen("/proc/asgn2", "r");
+
+  if (f == NULL)
+    return -1;
+  while (fgets(line, sizeof(line), f) != NULL)
+    sscanf(line, " Data Size = %ld", &size);
+  fclose(f);
+  return size;
+}
+
+/* Prints the ingest latency histogram if the proc entry is there*/
+static void print_latency(void) {
+  char line[128];
+  FILE *f = fopen("/proc/asgn2_latency", "r");
+
+  if (f == NULL)
+    return;
+  while (fgets(line, sizeof(line), f) != NULL)
+    fputs(line, stdout);
+  fclose(f);
+}
+
+/* Returns the overruns of the readers listed in the proc entry, or -1 if none are*/
+static long proc_overruns(void) {
+  char line[128], *p;
+  long total = -1, n;
+  FILE *f = fopen("/proc/asgn2", "r");
+
+  if (f == NULL)
+    return -1;
+  while (fgets(line, sizeof(line), f) != NULL) {
+    p = strstr(line, "overruns = ");
+    if (p != NULL && sscanf(p, "overruns = %ld", &n) == 1)
+      total = (total < 0 ? 0 : total) + n;
+  }
+  fclose(f);
+  return total;
+}
+
+/* Reads a module parameter, or sets it if value is not negative, returning -1 on failure*/
+static long param(const char *name, long value) {
+  char path[128];
+  FILE *f;
+  long old = -1;
+
+  snprintf(path, sizeof(path), PARAM_DIR "%s", name);
+  if ((f = fopen(path, value < 0 ? "r" : "w")) == NULL)
+    return -1;
+  if (value < 0) {
+    if (fscanf(f, "%ld", &old) != 1)
+      old = -1;
+  } else if (fprintf(f, "%ld\n", value) > 0) {
+    old = value;
+  }
+  if (fclose(f) != 0)
+    old = -1;
+  return old;
+}
+
+/* Times count reads, returning the mean in ns, or -1 if a read failed*/
+static double time_reads(int fd, long count, long *bytes) {
+  char buf[MAX_SESSION];
+  double start = now();
+  ssize_t result;
+  long i;
+
+  for (i = 0; i < count; i++) {
+    result = read(fd, buf, sizeof(buf));
+    if (result < 0) {
+      perror("read()");
+      return -1;
+    }
+    *bytes += result;
+  }
+  return (now() - start) * 1e9 / count;
+}
+
+static int bench_backlog(long mb, char *filename) {
+  long target = mb << 20, size, bytes = 0, rate;
+  double full_ns, empty_ns, start, elapsed;
+  int fd;
+
+  if ((fd = open(filename, O_RDONLY)) < 0) {
+    fprintf(stderr, "open of %s failed:  %s\n", filename, strerror(errno));
+    return 1;
+  }
+
+  printf("waiting for a %ld MB backlog\n", mb);
+  start = now();
+  while ((size = proc_data_size()) < target) {
+    if (size < 0) {
+      fprintf(stderr, "/proc/asgn2 has no Data Size\n");
+      return 1;
+    }
+    if (now() - start > 600) {
+      fprintf(stderr, "backlog stuck at %ld bytes, raise soft_rate\n", size);
+      return 1;
+    }
+    usleep(100000);
+  }
+
+  /* with the source paused the queue only shrinks*/
+  if ((rate = param("soft_rate", -1)) <= 0 || param("soft_rate", 0) != 0) {
+    fprintf(stderr, "cannot pause the source through %s\n", PARAM_DIR "soft_rate");
+    return 1;
+  }
+
+  full_ns = time_reads(fd, BACKLOG_SAMPLE, &bytes);
+  if (full_ns < 0)
+    return 1;
+  printf("backlog %ld MB: %.0f ns per read\n", proc_data_size() >> 20, full_ns);
+
+  /* drains all but what the last sample can read, so it never blocks*/
+  start = now();
+  while ((size = proc_data_size()) > (BACKLOG_SAMPLE + BACKLOG_STEP) * MAX_SESSION) {
+    if (time_reads(fd, BACKLOG_STEP, &bytes) < 0)
+      return 1;
+  }
+  elapsed = now() - start;
+
+  empty_ns = time_reads(fd, BACKLOG_SAMPLE, &bytes);
+  if (empty_ns < 0)
+    return 1;
+  printf("backlog %ld KB: %.0f ns per read\n", proc_data_size() >> 10, empty_ns);
+  param("soft_rate", rate);
+  printf("drained %.1f MB in %.1f s (%.1f MB/s), full/empty read cost %.2f\n",
+         bytes / 1048576.0, elapsed, bytes / 1048576.0 / elapsed, full_ns / empty_ns);
+  print_latency();
+  close(fd);
+  return 0;
+}
+
+/* Checks one session against the expected counter*/
+static void check_session(const char *session, size_t len) {
+  char copy[MAX_SESSION + 1];
+  unsigned long value;
+  char *end;
+
+  memcpy(copy, session, len);
+  copy[len] = '\0';
+  value = strtoul(copy, &end, 10);
+  if (len == 0 || *end != '\0' || len == MAX_SESSION) {
+    if (errors++ < 10)
+      fprintf(stderr, "torn session \"%s\" after %lu\n", copy, expected - 1);
+  } else if (sessions > 0 && value < expected) {
+    if (errors++ < 10)
+      fprintf(stderr, "session %lu out of order, expected %lu\n", value, expected);
+  } else {
+    if (sessions > 0)
+      lost += value - expected;
+    else
+      first = value;
+    expected = value + 1;
+  }
+  sessions++;
+}
+
+/* Clears the session check results, for a stream read afresh*/
+static void reset_sessions(void) {
+  first = expected = sessions = lost = errors = 0;
+}
+
+/* Counters of a worker pool run, in memory shared with the workers*/
+struct pool {
+  volatile int stop;
+  useconds_t pause;                /* how long worker 0 stops reading after a signal */
+  unsigned long next;              /* session after the last one of the previous run, 0 before the first */
+  unsigned long delivered[MAX_WORKERS];
+  unsigned long twice[MAX_WORKERS];
+  unsigned long lowest[MAX_WORKERS];  /* first and last session each worker took */
+  unsigned long highest[MAX_WORKERS];
+  unsigned long interrupted[MAX_WORKERS]; /* reads a signal interrupted */
+  unsigned long sink[MAX_WORKERS];
+  unsigned int seen[SEEN_SLOTS];   /* session + 1, by session modulo SEEN_SLOTS */
+};
+
+/* Does nothing, so that a signal only interrupts a blocked read*/
+static void wake_worker(int sig) {
+  (void)sig;
+}
+
+/**
+ * One worker of the pool: joins the balanced group and takes one session
+ * per read() until told to stop, doing WORK_ROUNDS passes over each. A
+ * session already recorded in seen was delivered to two workers. SIGTERM
+ * and SIGUSR1 interrupt a blocked read, and worker 0 then stops reading
+ * for pool->pause, as a worker busy handling the signal would.
+ */
+static void run_worker(char *filename, int id, struct pool *pool) {
+  int mode = ASGN2_DELIVER_BALANCE;
+  char session[MAX_SESSION + 1];
+  unsigned long value, hash = 0;
+  unsigned int *slot;
+  struct sigaction sa;
+  sigset_t usr1;
+  ssize_t result;
+  int fd, i, j;
+
+  memset(&sa, 0, sizeof(sa));
+  sa.sa_handler = wake_worker;
+  sigaction(SIGTERM, &sa, NULL);
+  sigaction(SIGUSR1, &sa, NULL);
+  sigemptyset(&usr1);
+  sigaddset(&usr1, SIGUSR1);
+  if ((fd = open(filename, O_RDONLY)) < 0 || ioctl(fd, ASGN2_SET_DELIVERY, &mode) < 0) {
+    fprintf(stderr, "worker %d: %s\n", id, strerror(errno));
+    _exit(1);
+  }
+  while (!pool->stop) {
+    result = read(fd, session, MAX_SESSION);
+    if (result < 0) {
+      if (errno == EINTR) {
+        pool->interrupted[id]++;
+        if (id == 0 && pool->pause) {
+          sigprocmask(SIG_BLOCK, &usr1, NULL);
+          usleep(pool->pause);
+          sigprocmask(SIG_UNBLOCK, &usr1, NULL);
+        }
+        continue;
+      }
+      perror("read()");
+      _exit(1);
+    }
+    session[result] = '\0';
+    value = strtoul(session, NULL, 10);
+    for (i = 0; i < WORK_ROUNDS; i++)
+      for (j = 0; j < result; j++)
+        hash = hash * 31 + session[j];
+    slot = &pool->seen[value & (SEEN_SLOTS - 1)];
+    if (__atomic_exchange_n(slot, (unsigned int)value + 1, __ATOMIC_RELAXED) == (unsigned int)value + 1)
+      pool->twice[id]++;
+    if (value < pool->lowest[id])
+      pool->lowest[id] = value;
+    if (value > pool->highest[id])
+      pool->highest[id] = value;
+    pool->delivered[id]++;
+  }
+  pool->sink[id] = hash;
+  close(fd);
+  _exit(0);
+}
+
+/* Clears the pool's counters and forks n workers*/
+static void start_pool(char *filename, int n, struct pool *pool, pid_t *pids) {
+  int i;
+
+  pool->stop = 0;
+  memset(pool->delivered, 0, sizeof(pool->delivered));
+  memset(pool->twice, 0, sizeof(pool->twice));
+  memset(pool->lowest, 0xff, sizeof(pool->lowest));
+  memset(pool->highest, 0, sizeof(pool->highest));
+  memset(pool->interrupted, 0, sizeof(pool->interrupted));
+  memset(pool->seen, 0, sizeof(pool->seen));
+  for (i = 0; i < n; i++) {
+    if ((pids[i] = fork()) < 0) {
+      perror("fork()");
+      exit(1);
+    }
+    if (pids[i] == 0)
+      run_worker(filename, i, pool);
+  }
+}
+
+/**
+ * Stops the workers, signalling until each has exited so that one blocked
+ * in read leaves without taking a session, and returns how many failed.
+ */
+static int stop_pool(int n, struct pool *pool, pid_t *pids) {
+  int status, failed = 0, i;
+  pid_t result;
+
+  pool->stop = 1;
+  for (i = 0; i < n; i++) {
+    while ((result = waitpid(pids[i], &status, WNOHANG)) == 0) {
+      kill(pids[i], SIGTERM);
+      usleep(1000);
+    }
+    if (result < 0 || !WIFEXITED(status) || WEXITSTATUS(status) != 0)
+      failed++;
+  }
+  return failed;
+}
+
+/**
+ * Counts the sessions the pool should have taken but did not: those from
+ * its first to its last that no worker took, and any between the end of
+ * the previous run and its first. Sessions it took that the previous run
+ * had taken too are added to errors. Returns -1 if the run took too many
+ * sessions to tell.
+ */
+static long pool_missed(int n, struct pool *pool) {
+  unsigned long low = -1UL, high = 0, value;
+  long missed = 0;
+  int i;
+
+  for (i = 0; i < n; i++) {
+    if (pool->delivered[i] == 0)
+      continue;
+    if (pool->lowest[i] < low)
+      low = pool->lowest[i];
+    if (pool->highest[i] > high)
+      high = pool->highest[i];
+  }
+  if (low > high)
+    return 0;
+  if (high - low >= SEEN_SLOTS) {
+    pool->next = high + 1;
+    return -1;
+  }
+  for (value = low; value <= high; value++)
+    if (pool->seen[value & (SEEN_SLOTS - 1)] != (unsigned int)value + 1)
+      missed++;
+  if (pool->next && low > pool->next)
+    missed += low - pool->next;
+  else if (pool->next && low < pool->next)
+    errors += (high < pool->next ? high + 1 : pool->next) - low;
+  pool->next = high + 1;
+  return missed;
+}
+
+/**
+ * Runs n workers for the given time, returning the sessions they took per
+ * second. Sessions missed are added to *missed, or counted in *unchecked if
+ * there were too many to tell.
+ */
+static double run_pool(char *filename, int n, double seconds, struct pool *pool,
+                       unsigned long *missed, int *unchecked) {
+  pid_t pids[MAX_WORKERS];
+  unsigned long total = 0, least = -1UL, most = 0, twice = 0;
+  double start, elapsed;
+  long run_missed;
+  int i;
+
+  start = now();
+  start_pool(filename, n, pool, pids);
+  usleep(seconds * 1e6);
+  elapsed = now() - start;
+  errors += stop_pool(n, pool, pids);
+
+  for (i = 0; i < n; i++) {
+    total += pool->delivered[i];
+    twice += pool->twice[i];
+    if (pool->delivered[i] < least)
+      least = pool->delivered[i];
+    if (pool->delivered[i] > most)
+      most = pool->delivered[i];
+  }
+  run_missed = pool_missed(n, pool);
+  if (run_missed < 0)
+    (*unchecked)++;
+  else
+    *missed += run_missed;
+  printf("%7d %12.0f %12lu %12lu %6lu %7ld  ", n, total / elapsed, least, most, twice, run_missed);
+  for (i = 0; i < n; i++)
+    printf(" %lu", pool->delivered[i]);
+  printf("\n");
+  errors += twice;
+  return total / elapsed;
+}
+
+/**
+ * Benchmarks balanced delivery with 1, 2, 4 ... up to max workers, each a
+ * process of its own, printing the sessions per second taken by the pool
+ * and how they were spread over the workers. Every session has to be
+ * taken exactly once, except that with lag_limit set the ones it skips are
+ * only reported.
+ */
+static int bench_workers(int max, char *filename, double seconds) {
+  struct pool *pool;
+  double single = 0, rate = 0;
+  unsigned long missed = 0;
+  long limit = param("lag_limit", -1);
+  int fd, n, unchecked = 0;
+
+  if (max < 1 || max > MAX_WORKERS) {
+    fprintf(stderr, "between 1 and %d workers\n", MAX_WORKERS);
+    return 1;
+  }
+  /* lets every worker of the largest pool open the device at once*/
+  if ((fd = open(filename, O_RDONLY)) < 0 || ioctl(fd, ASGN2_SET_NPROC, &max) < 0) {
+    fprintf(stderr, "setting up %s failed:  %s\n", filename, strerror(errno));
+    return 1;
+  }
+  close(fd);
+  pool = mmap(NULL, sizeof(*pool), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+  if (pool == MAP_FAILED) {
+    perror("mmap()");
+    return 1;
+  }
+  pool->pause = 0;
+  pool->next = 0;
+
+  printf("%ld CPUs online, %d passes of work per session\n", sysconf(_SC_NPROCESSORS_ONLN), WORK_ROUNDS);
+  printf("workers   sessions/s   min/worker   max/worker  twice  missed   per worker\n");
+  for (n = 1; ; n = n * 2 < max ? n * 2 : max) {
+    rate = run_pool(filename, n, seconds, pool, &missed, &unchecked);
+    if (n == 1)
+      single = rate;
+    if (n == max)
+      break;
+  }
+  printf("%.1fx the single worker rate with %d workers, driver dropped %ld bytes\n",
+         single > 0 ? rate / single : 0, max, proc_dropped());
+  if (unchecked)
+    printf("%d runs took too many sessions to check for missed ones\n", unchecked);
+  munmap(pool, sizeof(*pool));
+
+  if (errors || (missed && limit <= 0)) {
+    fprintf(stderr, "FAILED: %lu sessions delivered twice or workers failed, %lu missed\n", errors, missed);
+    return 1;
+  }
+  if (missed)
+    printf("%lu sessions skipped by a lag_limit of %ld\n", missed, limit);
+  printf("PASSED\n");
+  return 0;
+}
+
+/**
+ * Reads sessions with read(), each ended by a read of 0. On a non-blocking
+ * descriptor it waits in poll() whenever a read says no session is ready.
+ * Once the time is up it stops at the end of a session, so reading can go
+ * on later from the start of the next one. Returns -1 with errno set if a
+ * read fails.
+ */
+static int read_sessions(int fd, double seconds, double *elapsed) {
+  char session[MAX_SESSION];
+  struct pollfd pfd = { .fd = fd, .events = POLLIN };
+  unsigned long polls = 0, spurious = 0;
+  int polled = 0;
+  size_t len = 0;
+  ssize_t result;
+  double start = now();
+
+  while (len > 0 || (*elapsed = now() - start) < seconds) {
+    result = read(fd, session + len, MAX_SESSION - len);
+    if (result < 0) {
+      if (errno == EINTR)
+        continue;
+      if (errno == EAGAIN) {
+        /* a read after a ready poll failing again means readiness was reported early*/
+        if (polled)
+          spurious++;
+        polled = poll(&pfd, 1, 100) > 0;
+        polls += polled;
+        continue;
+      }
+      return -1;
+    }
+    polled = 0;
+    if (result > 0) {
+      len += result;
+      if (len < MAX_SESSION)
+        continue;
+    }
+
+    /* a read of 0 ends the session*/
+    check_session(session, len);
+    len = 0;
+  }
+  if (polls)
+    printf("%lu polls reported ready, %lu of them spuriously\n", polls, spurious);
+  return 0;
+}
+
+/* Reads sessions with ASGN2_READ_BATCH, as many as fit in one buffer per call*/
+static void batch_sessions(int fd, double seconds, double *elapsed) {
+  static char buf[BATCH_BUF];
+  static struct asgn2_msg msgs[ASGN2_BATCH_MAX];
+  struct asgn2_batch batch;
+  unsigned long calls = 0;
+  double start = now();
+  int result, i;
+
+  batch.buf = (unsigned long)buf;
+  batch.msgs = (unsigned long)msgs;
+  batch.buf_len = sizeof(buf);
+  batch.max_msgs = ASGN2_BATCH_MAX;
+  while ((*elapsed = now() - start) < seconds) {
+    result = ioctl(fd, ASGN2_READ_BATCH, &batch);
+    if (result < 0) {
+      if (errno == EINTR)
+        continue;
+      perror("ioctl(ASGN2_READ_BATCH)");
+      exit(1);
+    }
+    for (i = 0; i < result; i++)
+      check_session(buf + msgs[i].offset,
+                    (msgs[i].flags & ASGN2_MSG_TRUNC) || msgs[i].len > MAX_SESSION ?
+                    MAX_SESSION : msgs[i].len);
+    calls++;
+  }
+  printf("%lu batch calls, %.1f sessions per call\n", calls, calls ? (double)sessions / calls : 0);
+}
+
+/**
+ * Reads sessions from the mmap ring: maps the control page to learn the
+ * layout, then the whole ring, and takes messages in place, advancing the
+ * consumer positions with plain release stores. poll() is only called when
+ * the ring is empty.
+ */
+static void mmap_sessions(int fd, double seconds, double *elapsed) {
+  long page = sysconf(_SC_PAGESIZE);
+  struct asgn2_ring_ctl *ctl;
+  unsigned int *msgs, size, pos = 0, cons_msg = 0, prod_msg, end, len, off, first;
+  char session[MAX_SESSION], *data;
+  struct pollfd pfd = { .fd = fd, .events = POLLIN };
+  unsigned long polls = 0;
+  size_t ring_len;
+  void *head, *base;
+  double start;
+
+  head = mmap(NULL, page, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  if (head == MAP_FAILED) {
+    perror("mmap()");
+    exit(1);
+  }
+  ctl = head;
+  if (ctl->version != ASGN2_RING_VERSION) {
+    fprintf(stderr, "ring version %u, expected %u\n", ctl->version, ASGN2_RING_VERSION);
+    exit(1);
+  }
+  ring_len = (1 + ctl->msg_pages + ctl->data_pages) * page;
+  base = mmap(NULL, ring_len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  if (base == MAP_FAILED) {
+    perror("mmap()");
+    exit(1);
+  }
+  munmap(head, page);
+  ctl = base;
+  msgs = (unsigned int *)((char *)base + page);
+  data = (char *)base + (1 + ctl->msg_pages) * page;
+  size = ctl->data_pages * page;
+  printf("mmap ring of %u KB with %u message slots\n", size >> 10, ctl->msg_slots);
+
+  start = now();
+  while ((*elapsed = now() - start) < seconds) {
+    prod_msg = __atomic_load_n(&ctl->prod_msg, __ATOMIC_ACQUIRE);
+    if (cons_msg == prod_msg) {
+      polls++;
+      poll(&pfd, 1, 100);
+      continue;
+    }
+    for (; cons_msg != prod_msg; cons_msg++) {
+      end = msgs[cons_msg & (ctl->msg_slots - 1)];
+      len = end - pos < MAX_SESSION ? end - pos : MAX_SESSION;
+      off = pos & (size - 1);
+      first = len < size - off ? len : size - off;
+      memcpy(session, data + off, first);
+      memcpy(session + first, data, len - first);
+      check_session(session, len);
+      pos = end + 1;
+    }
+    __atomic_store_n(&ctl->cons_pos, pos, __ATOMIC_RELEASE);
+    __atomic_store_n(&ctl->cons_msg, cons_msg, __ATOMIC_RELEASE);
+  }
+  printf("%lu polls on an empty ring, ring stalled %u times\n", polls, ctl->stalls);
+  munmap(base, ring_len);
+}
+
+/* What a reader of the readers test saw, in memory shared with the test*/
+struct reader_result {
+  unsigned long first, sessions, lost, errors;
+};
+
+/**
+ * Opens a reader and reads until no complete session is left, so that
+ * readers opened after it start at the same session. Returns the
+ * descriptor, blocking again, or -1 on failure.
+ */
+static int open_caught_up(char *filename) {
+  char buf[MAX_SESSION];
+  int fd;
+
+  if ((fd = open(filename, O_RDONLY | O_NONBLOCK)) < 0)
+    return -1;
+  while (read(fd, buf, sizeof(buf)) >= 0)
+    ;
+  if (errno != EAGAIN || fcntl(fd, F_SETFL, 0) < 0) {
+    close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+/* Forks a reader checking the stream on fd for the given time, leaving what it saw in result*/
+static pid_t fork_reader(int fd, double seconds, struct reader_result *result) {
+  double elapsed;
+  pid_t pid = fork();
+
+  if (pid != 0)
+    return pid;
+  reset_sessions();
+  if (read_sessions(fd, seconds, &elapsed) < 0) {
+    perror("read()");
+    errors++;
+  }
+  result->first = first;
+  result->sessions = sessions;
+  result->lost = lost;
+  result->errors = errors;
+  _exit(0);
+}
+
+/* Checks that a reader saw the stream from the session first on, none lost unless the driver dropped bytes*/
+static int check_reader(const char *name, struct reader_result *result, unsigned long first, long dropped) {
+  printf("%s: %lu sessions from %lu, %lu lost, %lu out of order or torn\n",
+         name, result->sessions, result->first, result->lost, result->errors);
+  if (result->errors || result->sessions == 0 || result->first != first || (result->lost && dropped == 0)) {
+    fprintf(stderr, "%s did not see the whole stream from session %lu\n", name, first);
+    return 1;
+  }
+  return 0;
+}
+
+/* Whether a read of fd, or an ASGN2_READ_BATCH if batch is set, fails with EPIPE*/
+static int read_fails_epipe(int fd, int batch) {
+  char buf[MAX_SESSION];
+  struct asgn2_msg msg;
+  struct asgn2_batch request = { (unsigned long)buf, (unsigned long)&msg, sizeof(buf), 1 };
+
+  errno = 0;
+  if (batch)
+    return ioctl(fd, ASGN2_READ_BATCH, &request) < 0 && errno == EPIPE;
+  return read(fd, buf, 1) < 0 && errno == EPIPE;
+}
+
+/**
+ * Reads sessions with small ASGN2_READ_BATCH calls, each into a freshly
+ * mapped buffer so that the copies fault, pausing SLOW_BATCH_US between
+ * calls so that the reader falls behind and lag_policy=1 detaches it, at
+ * times in the middle of a batch. Returns 0 once a call fails with EPIPE,
+ * or -1 on any other failure or if it is not detached within 10 s.
+ */
+static int batch_until_detached(int fd) {
+  struct asgn2_msg msgs[SLOW_BATCH];
+  struct asgn2_batch batch;
+  double start = now();
+  char *buf;
+  int result, i;
+
+  batch.msgs = (unsigned long)msgs;
+  batch.buf_len = SLOW_BATCH * MAX_SESSION;
+  batch.max_msgs = SLOW_BATCH;
+  while (now() - start < 10) {
+    buf = mmap(NULL, batch.buf_len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (buf == MAP_FAILED) {
+      perror("mmap()");
+      return -1;
+    }
+    batch.buf = (unsigned long)buf;
+    result = ioctl(fd, ASGN2_READ_BATCH, &batch);
+    for (i = 0; i < result; i++)
+      check_session(buf + msgs[i].offset,
+                    (msgs[i].flags & ASGN2_MSG_TRUNC) || msgs[i].len > MAX_SESSION ?
+                    MAX_SESSION : msgs[i].len);
+    munmap(buf, batch.buf_len);
+    if (result < 0 && errno == EPIPE)
+      return 0;
+    if (result < 0 && errno != EINTR) {
+      perror("ioctl(ASGN2_READ_BATCH)");
+      return -1;
+    }
+    usleep(SLOW_BATCH_US);
+  }
+  fprintf(stderr, "the slow batch reader was never detached\n");
+  return -1;
+}
+
+/**
+ * Has one reader stall past LAG_TEST_LIMIT under the given lag_policy while
+ * another keeps up, checking what the policy did to each. With batch set
+ * the stalled reader uses ASGN2_READ_BATCH instead of read(), and under
+ * lag_policy=1 a slow batch reader is then detached while it reads and has
+ * to get EPIPE after clean sessions only. Returns the number of failed
+ * checks.
+ */
+static int test_lag(char *filename, long policy, int batch, struct reader_result *result) {
+  struct pollfd pfd = { .events = POLLIN };
+  double elapsed;
+  long overruns;
+  int stalled, fast, failed = 0;
+  pid_t pid;
+
+  printf("lag_policy=%ld: stalling a %s reader for %.0f s past a lag_limit of %d bytes\n",
+         policy, batch ? "batch" : "read()", STALL_SECONDS, LAG_TEST_LIMIT);
+  if (param("lag_policy", policy) < 0 || (stalled = open_caught_up(filename)) < 0 ||
+      (fast = open(filename, O_RDONLY)) < 0) {
+    fprintf(stderr, "setting up the lagging readers failed:  %s\n", strerror(errno));
+    return 1;
+  }
+  if ((pid = fork_reader(fast, STALL_SECONDS + 1, result)) < 0) {
+    perror("fork()");
+    exit(1);
+  }
+  close(fast);
+
+  reset_sessions();
+  if (batch) {
+    batch_sessions(stalled, 0.5, &elapsed);
+  } else if (read_sessions(stalled, 0.5, &elapsed) < 0) {
+    perror("read()");
+    failed++;
+  }
+  usleep(STALL_SECONDS * 1e6);
+  pfd.fd = stalled;
+  if (policy == 0) {
+    /* moved on to a whole session past the limit*/
+    if (batch) {
+      batch_sessions(stalled, 0.5, &elapsed);
+    } else if (read_sessions(stalled, 0.5, &elapsed) < 0) {
+      perror("read()");
+      failed++;
+    }
+    overruns = proc_overruns();
+    printf("stalled reader: %lu sessions, %lu skipped, %lu out of order or torn, %ld overruns\n",
+           sessions, lost, errors, overruns);
+    if (lost == 0 || errors || overruns <= 0) {
+      fprintf(stderr, "the stalled reader was not moved on past the limit\n");
+      failed++;
+    }
+  } else {
+    poll(&pfd, 1, 0);
+    if (!(pfd.revents & POLLERR) || !read_fails_epipe(stalled, batch)) {
+      fprintf(stderr, "the stalled reader was not detached: poll gave %#x, read %s\n",
+              pfd.revents, strerror(errno));
+      failed++;
+    } else {
+      printf("stalled reader: detached, POLLERR and EPIPE\n");
+    }
+  }
+  close(stalled);
+
+  if (policy == 1 && batch) {
+    reset_sessions();
+    if ((stalled = open_caught_up(filename)) < 0) {
+      fprintf(stderr, "open of %s failed:  %s\n", filename, strerror(errno));
+      failed++;
+    } else {
+      if (batch_until_detached(stalled) < 0 || errors) {
+        fprintf(stderr, "the batch reader detached while reading saw %lu bad sessions\n", errors);
+        failed++;
+      } else {
+        printf("slow batch reader: detached after %lu clean sessions\n", sessions);
+      }
+      close(stalled);
+    }
+  }
+
+  waitpid(pid, NULL, 0);
+  failed += check_reader("reader keeping up", result, result->first, proc_dropped());
+  return failed;
+}
+
+/**
+ * The readers test: n readers opened at the same point each have to see
+ * the whole stream, and a reader lagging past lag_limit has to be dealt
+ * with by each lag_policy without holding up one that keeps up. The module
+ * parameters it changes are put back afterwards.
+ */
+static int test_readers(int n, char *filename, double seconds) {
+  struct reader_result *results;
+  pid_t pids[MAX_READERS];
+  int fds[MAX_READERS];
+  long rate, limit, policy, dropped;
+  int nprocs = n > 2 ? n : 2, failed = 0, i;
+  char name[32];
+
+  if (n < 1 || n > MAX_READERS) {
+    fprintf(stderr, "between 1 and %d readers\n", MAX_READERS);
+    return 1;
+  }
+  rate = param("soft_rate", -1);
+  limit = param("lag_limit", -1);
+  policy = param("lag_policy", -1);
+  if (rate < 0 || limit < 0 || policy < 0 || param("soft_rate", READERS_RATE) < 0 ||
+      param("lag_limit", 0) < 0 || param("lag_policy", 0) < 0) {
+    fprintf(stderr, "cannot set the module parameters under %s\n", PARAM_DIR);
+    return 1;
+  }
+  results = mmap(NULL, MAX_READERS * sizeof(*results), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+  if (results == MAP_FAILED) {
+    perror("mmap()");
+    return 1;
+  }
+
+  /* the first reader catches up, and the others open where it is*/
+  if ((fds[0] = open_caught_up(filename)) < 0 || ioctl(fds[0], ASGN2_SET_NPROC, &nprocs) < 0) {
+    fprintf(stderr, "setting up %s failed:  %s\n", filename, strerror(errno));
+    return 1;
+  }
+  for (i = 1; i < n; i++) {
+    if ((fds[i] = open(filename, O_RDONLY)) < 0) {
+      fprintf(stderr, "open of %s failed:  %s\n", filename, strerror(errno));
+      return 1;
+    }
+  }
+  printf("%d readers for %.0f s at %d bytes/s\n", n, seconds, READERS_RATE);
+  for (i = 0; i < n; i++) {
+    if ((pids[i] = fork_reader(fds[i], seconds, &results[i])) < 0) {
+      perror("fork()");
+      exit(1);
+    }
+  }
+  for (i = 0; i < n; i++) {
+    close(fds[i]);
+    waitpid(pids[i], NULL, 0);
+  }
+  dropped = proc_dropped();
+  for (i = 0; i < n; i++) {
+    snprintf(name, sizeof(name), "reader %d", i);
+    failed += check_reader(name, &results[i], results[0].first, dropped);
+  }
+
+  if (param("lag_limit", LAG_TEST_LIMIT) < 0) {
+    fprintf(stderr, "cannot set %s\n", PARAM_DIR "lag_limit");
+    failed++;
+  } else {
+    failed += test_lag(filename, 0, 0, &results[0]);
+    failed += test_lag(filename, 1, 0, &results[0]);
+    failed += test_lag(filename, 0, 1, &results[0]);
+    failed += test_lag(filename, 1, 1, &results[0]);
+  }
+
+  param("lag_policy", policy);
+  param("lag_limit", limit);
+  param("soft_rate", rate);
+  munmap(results, MAX_READERS * sizeof(*results));
+  if (failed) {
+    fprintf(stderr, "FAILED: %d checks\n", failed);
+    return 1;
+  }
+  printf("PASSED\n");
+  return 0;
+}
+
+/* Returns the complete messages queued for the slowest reader from the proc entry, or -1 if it is not there*/
+static long proc_messages(void) {
+  char line[128];
+  long messages = -1;
+  FILE *f = fopen("/proc/asgn2", "r");
+
+  if (f == NULL)
+    return -1;
+  while (fgets(line, sizeof(line), f) != NULL)
+    sscanf(line, " Messages = %ld", &messages);
+  fclose(f);
+  return messages;
+}
+
+/**
+ * Signals worker 0 of a pool of n every SIGNAL_US while sessions arrive
+ * slowly, so that it is now and then interrupted just after being woken
+ * for one, and then stops reading for SIGNAL_PAUSE_US. The session it was
+ * woken for has to be taken within DELIVERY_LIMIT by another worker, and
+ * every session exactly once. Catching a lost wakeup depends on the signal
+ * landing in that window, so longer runs are likelier to. Returns the
+ * number of failed checks.
+ */
+static int test_group_signals(char *filename, int n, double seconds, struct pool *pool) {
+  pid_t pids[MAX_WORKERS], signaller;
+  double start, queued = 0, longest = 0;
+  long messages, missed;
+  unsigned long taken = 0, twice = 0;
+  struct sigaction sa;
+  int failed = 0, i;
+
+  printf("%d balanced workers for %.0f s at %d bytes/s, worker 0 signalled every %d us\n",
+         n, seconds, GROUP_RATE, SIGNAL_US);
+  if (param("soft_rate", GROUP_RATE) < 0 || param("lag_limit", 0) < 0) {
+    fprintf(stderr, "cannot set the module parameters under %s\n", PARAM_DIR);
+    return 1;
+  }
+  pool->pause = SIGNAL_PAUSE_US;
+  pool->next = 0;
+  /* inherited by the workers, so a signal before one has set up cannot kill it*/
+  memset(&sa, 0, sizeof(sa));
+  sa.sa_handler = wake_worker;
+  sigaction(SIGUSR1, &sa, NULL);
+  start_pool(filename, n, pool, pids);
+  if ((signaller = fork()) < 0) {
+    perror("fork()");
+    exit(1);
+  }
+  if (signaller == 0) {
+    for (;;) {
+      kill(pids[0], SIGUSR1);
+      usleep(SIGNAL_US);
+    }
+  }
+
+  /* a session left queued while a worker waits is a wakeup lost with a signal*/
+  start = now();
+  while (now() - start < seconds) {
+    messages = proc_messages();
+    if (messages < 0) {
+      fprintf(stderr, "/proc/asgn2 has no Messages\n");
+      failed++;
+      break;
+    }
+    if (messages == 0)
+      queued = 0;
+    else if (queued == 0)
+      queued = now();
+    else if (now() - queued > longest)
+      longest = now() - queued;
+    usleep(10000);
+  }
+  param("soft_rate", 0);
+  usleep(2 * SIGNAL_PAUSE_US);
+  messages = proc_messages();
+  kill(signaller, SIGKILL);
+  waitpid(signaller, NULL, 0);
+  failed += stop_pool(n, pool, pids);
+
+  for (i = 0; i < n; i++) {
+    taken += pool->delivered[i];
+    twice += pool->twice[i];
+  }
+  missed = pool_missed(n, pool);
+  printf("%lu sessions taken, %lu twice, %ld missed, %ld left queued, worker 0 interrupted %lu times,"
+         " longest wait %.0f ms\n", taken, twice, missed, messages, pool->interrupted[0], longest * 1e3);
+  if (taken == 0 || twice || missed || errors) {
+    fprintf(stderr, "sessions were not taken exactly once\n");
+    failed++;
+  }
+  if (messages != 0 || longest > DELIVERY_LIMIT) {
+    fprintf(stderr, "a session waited with workers idle\n");
+    failed++;
+  }
+  if (pool->interrupted[0] == 0) {
+    fprintf(stderr, "worker 0 was never interrupted\n");
+    failed++;
+  }
+  return failed;
+}
+
+/**
+ * Has n balanced readers stop reading past LAG_TEST_LIMIT with
+ * lag_policy=1: the group has to be detached, every member reported by
+ * poll() with POLLERR and failing read() and ASGN2_READ_BATCH with EPIPE,
+ * and a member leaving the group has to stay detached. Returns the number
+ * of failed checks.
+ */
+static int test_group_detach(char *filename, int n) {
+  struct pollfd pfd = { .events = POLLIN };
+  int fds[MAX_WORKERS];
+  int mode = ASGN2_DELIVER_BALANCE, failed = 0, i;
+
+  printf("%d balanced readers stalled for %.0f s past a lag_limit of %d bytes with lag_policy=1\n",
+         n, STALL_SECONDS, LAG_TEST_LIMIT);
+  if (param("soft_rate", READERS_RATE) < 0 || param("lag_limit", LAG_TEST_LIMIT) < 0 ||
+      param("lag_policy", 1) < 0) {
+    fprintf(stderr, "cannot set the module parameters under %s\n", PARAM_DIR);
+    return 1;
+  }
+  for (i = 0; i < n; i++) {
+    if ((fds[i] = open(filename, O_RDONLY)) < 0 || ioctl(fds[i], ASGN2_SET_DELIVERY, &mode) < 0) {
+      fprintf(stderr, "setting up reader %d failed:  %s\n", i, strerror(errno));
+      return 1;
+    }
+  }
+  usleep(STALL_SECONDS * 1e6);
+
+  for (i = 0; i < n; i++) {
+    pfd.fd = fds[i];
+    pfd.revents = 0;
+    poll(&pfd, 1, 0);
+    if (!(pfd.revents & POLLERR) || !read_fails_epipe(fds[i], 0) || !read_fails_epipe(fds[i], 1)) {
+      fprintf(stderr, "reader %d was not detached: poll gave %#x, read %s\n", i, pfd.revents, strerror(errno));
+      failed++;
+    }
+  }
+  /* a reader leaving the group carries on from where the group is*/
+  mode = ASGN2_DELIVER_BROADCAST;
+  if (ioctl(fds[0], ASGN2_SET_DELIVERY, &mode) < 0 || !read_fails_epipe(fds[0], 0) ||
+      !read_fails_epipe(fds[0], 1)) {
+    fprintf(stderr, "a reader leaving the detached group was not detached: %s\n", strerror(errno));
+    failed++;
+  }
+  for (i = 0; i < n; i++)
+    close(fds[i]);
+  if (!failed)
+    printf("group detached, every member got POLLERR and EPIPE\n");
+  return failed;
+}
+
+/**
+ * The group test: balanced workers interrupted by signals, then a group
+ * lagging past lag_limit. The module parameters it changes are put back
+ * afterwards.
+ */
+static int test_group(int n, char *filename, double seconds) {
+  struct pool *pool;
+  long rate, limit, policy;
+  int fd, failed = 0;
+
+  if (n < 2 || n > MAX_WORKERS) {
+    fprintf(stderr, "between 2 and %d workers\n", MAX_WORKERS);
+    return 1;
+  }
+  rate = param("soft_rate", -1);
+  limit = param("lag_limit", -1);
+  policy = param("lag_policy", -1);
+  if (rate < 0 || limit < 0 || policy < 0 || param("lag_policy", 0) < 0) {
+    fprintf(stderr, "cannot set the module parameters under %s\n", PARAM_DIR);
+    return 1;
+  }
+  if ((fd = open(filename, O_RDONLY)) < 0 || ioctl(fd, ASGN2_SET_NPROC, &n) < 0) {
+    fprintf(stderr, "setting up %s failed:  %s\n", filename, strerror(errno));
+    return 1;
+  }
+  close(fd);
+  pool = mmap(NULL, sizeof(*pool), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+  if (pool == MAP_FAILED) {
+    perror("mmap()");
+    return 1;
+  }
+
+  failed += test_group_signals(filename, n, seconds, pool);
+  failed += test_group_detach(filename, n);
+
+  param("lag_policy", policy);
+  param("lag_limit", limit);
+  param("soft_rate", rate);
+  munmap(pool, sizeof(*pool));
+  if (failed) {
+    fprintf(stderr, "FAILED: %d checks\n", failed);
+    return 1;
+  }
+  printf("PASSED\n");
+  return 0;
+}
+
+int main(int argc, char **argv) {
+  int use_batch = argc > 1 && strcmp(argv[1], "batch") == 0;
+  int use_poll = argc > 1 && strcmp(argv[1], "poll") == 0;
+  int use_mmap = argc > 1 && strcmp(argv[1], "mmap") == 0;
+  int mode = use_batch || use_poll || use_mmap;
+  char *filename = argc > 1 + mode ? argv[1 + mode] : "/dev/asgn2";
+  double seconds = argc > 2 + mode ? atof(argv[2 + mode]) : 10;
+  double elapsed;
+  long dropped;
+  int fd;
+
+  if (argc > 1 && strcmp(argv[1], "backlog") == 0)
+    return bench_backlog(argc > 2 ? atol(argv[2]) : 100, argc > 3 ? argv[3] : "/dev/asgn2");
+  if (argc > 1 && strcmp(argv[1], "group") == 0)
+    return test_group(argc > 2 ? atoi(argv[2]) : 2, argc > 3 ? argv[3] : "/dev/asgn2",
+                      argc > 4 ? atof(argv[4]) : 10);
+  if (argc > 1 && strcmp(argv[1], "readers") == 0)
+    return test_readers(argc > 2 ? atoi(argv[2]) : 4, argc > 3 ? argv[3] : "/dev/asgn2",
+                        argc > 4 ? atof(argv[4]) : 10);
+  if (argc > 1 && strcmp(argv[1], "workers") == 0)
+    return bench_workers(argc > 2 ? atoi(argv[2]) : MAX_WORKERS, argc > 3 ? argv[3] : "/dev/asgn2",
+                         argc > 4 ? atof(argv[4]) : 2);
+
+  if ((fd = open(filename, (use_mmap ? O_RDWR : O_RDONLY) | (use_poll ? O_NONBLOCK : 0))) < 0) {
+    fprintf(stderr, "open of %s failed:  %s\n", filename, strerror(errno));
+    exit(1);
+  }
+
+  if (use_mmap)
+    mmap_sessions(fd, seconds, &elapsed);
+  else if (use_batch)
+    batch_sessions(fd, seconds, &elapsed);
+  else if (read_sessions(fd, seconds, &elapsed) < 0) {
+    perror("read()");
+    exit(1);
+  }
+
+  dropped = proc_dropped();
+  printf("%lu sessions in %.1f s (%.0f/s), %lu lost, %lu out of order or torn, driver dropped %ld bytes\n",
+         sessions, elapsed, sessions / elapsed, lost, errors, dropped);
+  print_latency();
+  close(fd);
+
+  if (errors || (lost && dropped == 0)) {
+    fprintf(stderr, "FAILED\n");
+    return 1;
+  }
+  printf("PASSED\n");
+  return 0;
+}
@@ -23,13 +23,20 @@
 #include <linux/proc_fs.h>
 #include <linux/device.h>
 #include <linux/interrupt.h>
-#include <linux/circ_buf.h>
 #include <linux/sched.h>
+#include <linux/hrtimer.h>
+#include <linux/ktime.h>
+#include <linux/log2.h>
+#include <linux/kthread.h>
+#include <linux/mutex.h>
+#include <linux/moduleparam.h>
+#include <linux/math64.h>
+#include <linux/poll.h>
+#include <linux/vmalloc.h>
 #include "gpio.h"
+#include "asgn2.h"
 
 #define MYDEV_NAME "asgn2"
-#define MYIOC_TYPE 'k'
-#define BUF_SIZE 1024
 MODULE_LICENSE("GPL");
 MODULE_AUTHOR("Joshua La Pine");
 MODULE_DESCRIPTION("COSC440 asgn2");
@@ -43,26 +50,126 @@ typedef struct page_node_rec {
   struct page *page;
 } page_node;
 
-/* Defines circular buffer*/
+/**
+ * The ring between the interrupt handler, its only producer, and the
+ * ingest thread, its only consumer. head and tail run freely and are masked into
+ * buf, whose size is a power of two, so tail - head is always the number of
+ * bytes held. Each side only writes its own index and publishes it with a
+ * release store after touching the bytes, and reads the other side's index
+ * with an acquire load, so no lock is needed.
+ */
 typedef struct circ_buffer_def{
-  u8 buf[BUF_SIZE];
-  int head;
-  int tail;
+  u8 *buf;
+  unsigned int size;     /* capacity in bytes, a power of two */
+  unsigned int head;     /* next byte the consumer takes */
+  unsigned int tail;     /* next byte the producer fills */
+  unsigned long dropped; /* bytes lost to a full ring, written by the producer only */
+  unsigned long kick_ns; /* clock when a byte last landed in the empty ring, 0 once taken */
+  int mid_message;       /* the last byte taken did not end a message, written by the consumer only */
 } circ_buffer_type;
 
-/* Keeps track of page queue information*/
+/* Acquire and release primitives for kernels that predate them*/
+#ifndef smp_store_release
+#define smp_store_release(p, v) do { smp_mb(); ACCESS_ONCE(*(p)) = (v); } while(0)
+#endif
+#ifndef smp_load_acquire
+#define smp_load_acquire(p) ({ typeof(*(p)) ___v = ACCESS_ONCE(*(p)); smp_mb(); ___v; })
+#endif
+
+/**
+ * The two ends of the page queue, as absolute byte positions in the stream.
+ * head is where the slowest reader is and tail where ingest writes next.
+ * Each page starts at a multiple of PAGE_SIZE, so the page holding a
+ * position is found in the data page index by the position's page number
+ * and the offset into it is the position modulo PAGE_SIZE. Any position in
+ * the queue is reached in O(1), however large the backlog and wherever each
+ * reader is in it.
+ */
 typedef struct page_queue_def{
-  int head_index;
-  int tail_index;
-  size_t head_offset;
-  size_t tail_offset;
-  //spinlock_t lock;
+  u64 head;             /* oldest byte still needed by a reader */
+  u64 tail;             /* next byte to write */
+  u64 msg_head;         /* oldest message still needed by a reader */
+  u64 msg_tail;         /* next message to be recorded */
 } page_queue_type;
 
+/* Offset of a stream position into its page*/
+#define QUEUE_OFFSET(pos) ((size_t)(pos) & ~PAGE_MASK)
+
+/**
+ * Message boundaries, recorded by ingest as it copies the ring into the
+ * page queue. Each message is described by the stream position of the NUL
+ * ending it, and the descriptors live in pages of their own that work like
+ * the data pages: message i is in slot i of page i / MSG_PER_PAGE of the
+ * message page index, and the pages come from and go back to the same
+ * free list. Reads find the end of the current message in O(1) however
+ * many messages a page holds.
+ */
+#define MSG_PER_PAGE (PAGE_SIZE / sizeof(u64))
+#define MSG_SLOT(i) ((size_t)(i) & (MSG_PER_PAGE - 1))
+#define MSG_PAGE(i) ((i) >> (PAGE_SHIFT - 3))
+
+/**
+ * The pages of the queue, numbered from the start of the stream, in a
+ * power of two array: page n is in slot n & (size - 1). The pages held are
+ * first to next - 1, and the array doubles when they would not fit.
+ */
+#define INDEX_START_SIZE 64
+
+typedef struct page_index_def{
+  page_node **slots;
+  unsigned long size;   /* slots, a power of two */
+  u64 first;            /* number of the oldest page held */
+  u64 next;             /* number of the page added next */
+} page_index;
+
+/**
+ * A reader's cursor, kept in file->private_data. Every reader is given the
+ * whole stream from the oldest data queued when it opened, and the queue
+ * keeps data until the slowest reader has passed it. A reader that falls
+ * more than lag_limit bytes behind is dealt with by lag_policy. Balanced
+ * readers share the device's group cursor, which is on the reader list in
+ * their place while the group has members.
+ */
+typedef struct asgn2_reader_rec {
+  struct list_head list;     /* on asgn2_device.readers */
+  struct mutex lock;         /* serialises the reads of one file */
+  u64 pos;                   /* next byte to read */
+  u64 msg;                   /* message holding pos */
+  unsigned long delivered;   /* messages read to their end */
+  unsigned long overruns;    /* times lag_policy acted on it */
+  int detached;              /* cut off by lag_policy, reads fail with -EPIPE */
+  int balanced;              /* reads from the group cursor instead of pos and msg */
+} asgn2_reader;
+
+#define LAG_SKIP 0
+#define LAG_DETACH 1
+
+/**
+ * A copy from the queue to user space, made without the device lock. While
+ * it is on the device's copies list no data page at or after from is
+ * recycled, so the copy stays valid even if lag_policy moves its reader on
+ * or the group it was claimed for moves past it. The pages are looked up
+ * under the lock up to COPY_PAGES at a time.
+ */
+#define COPY_PAGES 16
+
+typedef struct asgn2_copy_rec {
+  struct list_head list;     /* on asgn2_device.copies */
+  u64 from;                  /* first byte copied, kept from recycling */
+  u64 first;                 /* number of the page in pages[0] */
+  unsigned int npages;       /* pages looked up */
+  page_node *pages[COPY_PAGES];
+} asgn2_copy;
+
 typedef struct asgn2_dev_t {
   dev_t dev;            /* the device */
   struct cdev *cdev;   
-  struct list_head mem_list; /*pointer to the head of the page list*/ 
+  page_index data_index;   /* data pages of the queue */
+  page_index msg_index;    /* pages of message descriptors */
+  struct list_head readers; /* cursors of the open files */
+  struct list_head copies;  /* copies to user space in progress */
+  asgn2_reader group;      /* cursor shared by the balanced readers */
+  int group_members;       /* balanced readers */
   int num_pages;        /* number of memory pages this module currently holds */
   size_t data_size;     /* total data size in this module */
   atomic_t nprocs;      /* number of processes accessing this device */ 
@@ -70,17 +177,18 @@ typedef struct asgn2_dev_t {
   struct kmem_cache *cache;      /* cache memory */
   struct class *class;     /* the udev class */
   struct device *device;   /* the udev device node */
+  struct mutex lock;       /* protects the page queue, shared by ingest and readers */
+  struct list_head free_list; /* consumed pages kept for reuse by ingest */
+  int free_pages;          /* pages on free_list */
+  int free_low;            /* fewest pages on free_list since the last trim */
+  unsigned long next_trim; /* jiffies at which idle free pages are next released */
+  unsigned long alloc_failures; /* times ingest could not get a page or index slot */
 } asgn2_dev;
 
-/*Variables for session separation and waiting*/
-atomic_t null_flag;
-atomic_t wait_flag;
-int null_location = -1;
-
-/* Declaration for tasklet and wait queue*/
-void bottom_half(unsigned long t_arg);
-DECLARE_TASKLET(producer, bottom_half, 0);
+/* Declaration for the ingest thread and wait queues*/
+struct task_struct *ingest_task;
 DECLARE_WAIT_QUEUE_HEAD(data_wq);
+DECLARE_WAIT_QUEUE_HEAD(group_wq); /* balanced readers, waiting exclusively*/
 DECLARE_WAIT_QUEUE_HEAD(process_wq);
 
 /* Declaration for various required structs*/
@@ -88,72 +196,522 @@ circ_buffer_type circ_buffer;
 page_queue_type page_queue;
 asgn2_dev asgn2_device;
 struct proc_dir_entry *asgn2_proc;        /*Proc entry*/
+struct proc_dir_entry *latency_proc;      /*Proc entry of the latency histogram*/
 
 int asgn2_major = 0;                      /* major number of module */  
 int asgn2_minor = 0;                      /* minor number of module */
 int asgn2_dev_count = 1;                  /* number of devices */
 
+static unsigned int ring_size = 4096;
+module_param(ring_size, uint, 0444);
+MODULE_PARM_DESC(ring_size, "capacity of the interrupt ring in bytes, rounded up to a power of two");
+
+/* The software source stands in for the GPIO dummy port, for testing on any machine*/
+static unsigned int soft_rate = 0;
+module_param(soft_rate, uint, 0644);
+MODULE_PARM_DESC(soft_rate, "bytes per second generated by the software source instead of the GPIO port (0 at load uses the port, 0 later pauses the source)");
+static int soft_started;                  /* whether the software source was chosen at load */
+
+#define SOFT_TICK_NS 100000
+struct hrtimer soft_timer;                /* drives the software source */
+
+static int ingest_cpu = -1;
+static int ingest_prio = 50;
+
+static unsigned int pool_pages = 64;
+module_param(pool_pages, uint, 0644);
+MODULE_PARM_DESC(pool_pages, "pages preallocated for the page queue and never released while loaded");
+
+#define POOL_TRIM_INTERVAL HZ
+
+static unsigned int max_readers = 8;
+module_param(max_readers, uint, 0444);
+MODULE_PARM_DESC(max_readers, "readers allowed at load, changed later with ASGN2_SET_NPROC");
+
+static unsigned long lag_limit = 0;
+module_param(lag_limit, ulong, 0644);
+MODULE_PARM_DESC(lag_limit, "bytes a reader may fall behind before lag_policy applies (0 for no limit)");
+
+static unsigned int lag_policy = LAG_SKIP;
+module_param(lag_policy, uint, 0644);
+MODULE_PARM_DESC(lag_policy, "what happens to a reader past lag_limit: 0 moves it on to the first message within the limit, 1 detaches it");
+
+static unsigned int mmap_pages = 256;
+module_param(mmap_pages, uint, 0644);
+MODULE_PARM_DESC(mmap_pages, "data pages of the mmap ring, rounded up to a power of two, read when it is first mapped");
+
+/**
+ * The mmap ring, laid out as in asgn2.h in one vmalloc_user area. It exists
+ * while it is mapped. It has its own lock, taken by mmap and munmap with
+ * mmap_sem held, so ingest never waits on a task that is mapping. It is
+ * taken before the device lock. Ingest keeps its own copy of the producer
+ * positions and never trusts the ones in the shared control page. Ingest
+ * only moves between the queue and the ring at the end of a message, so
+ * each of them holds whole messages.
+ */
+struct asgn2_mmap_ring {
+  struct mutex lock;
+  void *base;
+  size_t len;                /* bytes mapped: control page, descriptors and data */
+  struct asgn2_ring_ctl *ctl;
+  u32 *msgs;
+  u8 *data;
+  u32 size;                  /* data bytes, a power of two */
+  u32 slots;                 /* descriptor slots, a power of two */
+  u32 prod_pos;
+  u32 prod_msg;
+  int maps;                  /* mappings alive */
+  int active;                /* ingest delivers into the ring rather than the queue */
+  int resync;                /* unmapped mid-message, so ingest drops up to the next NUL */
+  unsigned long resync_dropped; /* bytes dropped for it */
+} mring;
+
+/**
+ * Ring to queue latency: the time from a byte landing in the empty ring to
+ * the ingest thread taking it. Bucket i counts latencies below 2^i us, from
+ * 2^(i-1) us on. Only the ingest thread updates it.
+ */
+#define LATENCY_BUCKETS 24
+
+struct latency_hist {
+  unsigned long buckets[LATENCY_BUCKETS];
+  unsigned long samples;
+  unsigned long max_ns;
+  u64 total_ns;
+} latency;
+
+/**
+ * Applies ingest_cpu and ingest_prio to the ingest thread: SCHED_FIFO at
+ * ingest_prio, or SCHED_NORMAL if it is 0, bound to ingest_cpu, or to any
+ * cpu if it is -1.
+ */
+static int asgn2_ingest_tune(void){
+  struct sched_param param = { .sched_priority = ingest_prio };
+  int result;
+
+  if(!ingest_task)
+    return 0;
+  result = sched_setscheduler(ingest_task, ingest_prio ? SCHED_FIFO : SCHED_NORMAL, &param);
+  if(result)
+    return result;
+  return set_cpus_allowed_ptr(ingest_task, ingest_cpu >= 0 ? cpumask_of(ingest_cpu) : cpu_possible_mask);
+}
+
+/* Sets ingest_cpu or ingest_prio, retuning the running thread*/
+static int asgn2_set_ingest_param(const char *val, const struct kernel_param *kp){
+  int old = *(int *)kp->arg;
+  int result = param_set_int(val, kp);
+
+  if(result)
+    return result;
+  if(ingest_cpu < -1 || (ingest_cpu >= 0 && (ingest_cpu >= nr_cpu_ids || !cpu_online(ingest_cpu))) ||
+     ingest_prio < 0 || ingest_prio >= MAX_USER_RT_PRIO)
+    result = -EINVAL;
+  else
+    result = asgn2_ingest_tune();
+  if(result)
+    *(int *)kp->arg = old;
+  return result;
+}
+
+static struct kernel_param_ops ingest_param_ops = {
+  .set = asgn2_set_ingest_param,
+  .get = param_get_int
+};
+
+module_param_cb(ingest_cpu, &ingest_param_ops, &ingest_cpu, 0644);
+MODULE_PARM_DESC(ingest_cpu, "cpu the ingest thread runs on (-1 for any)");
+module_param_cb(ingest_prio, &ingest_param_ops, &ingest_prio, 0644);
+MODULE_PARM_DESC(ingest_prio, "SCHED_FIFO priority of the ingest thread (0 for SCHED_NORMAL)");
+
 /**
  * This function frees all memory pages held by the module.
  */
 void free_memory_pages(void) {
   page_node *curr, *temp;
+  u64 n;
 
-  /* loops through the page list and frees each page*/
-  list_for_each_entry_safe(curr, temp, &asgn2_device.mem_list, list){
-    if(curr->page != NULL){
-      __free_page(curr->page);
-    }
+  /* frees the pages held by both indexes and the indexes themselves*/
+  for(n = asgn2_device.data_index.first; n < asgn2_device.data_index.next; n++){
+    curr = asgn2_device.data_index.slots[n & (asgn2_device.data_index.size - 1)];
+    __free_page(curr->page);
+    kfree(curr);
+  }
+  for(n = asgn2_device.msg_index.first; n < asgn2_device.msg_index.next; n++){
+    curr = asgn2_device.msg_index.slots[n & (asgn2_device.msg_index.size - 1)];
+    __free_page(curr->page);
+    kfree(curr);
+  }
+  kfree(asgn2_device.data_index.slots);
+  kfree(asgn2_device.msg_index.slots);
+  memset(&asgn2_device.data_index, 0, sizeof(page_index));
+  memset(&asgn2_device.msg_index, 0, sizeof(page_index));
+
+  list_for_each_entry_safe(curr, temp, &asgn2_device.free_list, list){
+    __free_page(curr->page);
     list_del(&curr->list);
     kfree(curr);
-    printk(KERN_INFO "Freed memory\n");
   }
 
   /* resets data size and num pages to initial values*/
   asgn2_device.data_size = 0;
   asgn2_device.num_pages = 0;
+  asgn2_device.free_pages = 0;
+  asgn2_device.free_low = 0;
   
 }
 
 
 /**
- * This function opens the device, will sleep if already opened by another process.
- * Will return -EACCES when not opened when not opened in read only mode.
+ * Consumed pages are not freed but kept on free_list, and ingest takes its
+ * pages from there before it allocates, so a stream that is keeping up
+ * recycles the same pages without touching the allocator. The list only
+ * grows when every page is in use. Pages that stayed unused for a whole
+ * POOL_TRIM_INTERVAL are released by the ingest thread while it is idle,
+ * down to the pool_pages kept for bursts. All of this is under the device
+ * lock.
+ */
+static page_node *asgn2_alloc_page(void){
+  page_node *curr;
+
+  curr = kmalloc(sizeof(page_node), GFP_KERNEL);
+  if(!curr)
+    return NULL;
+  curr->page = alloc_page(GFP_KERNEL);
+  if(!curr->page){
+    kfree(curr);
+    return NULL;
+  }
+  return curr;
+}
+
+/* Takes a page from the free list, allocating only when it is empty*/
+static page_node *asgn2_get_page(void){
+  page_node *curr;
+
+  if(list_empty(&asgn2_device.free_list))
+    return asgn2_alloc_page();
+
+  curr = list_first_entry(&asgn2_device.free_list, page_node, list);
+  list_del(&curr->list);
+  if(--asgn2_device.free_pages < asgn2_device.free_low)
+    asgn2_device.free_low = asgn2_device.free_pages;
+  return curr;
+}
+
+/* Returns a consumed page to the free list, most recently used first so it is still cache hot*/
+static void asgn2_put_page(page_node *curr){
+  list_add(&curr->list, &asgn2_device.free_list);
+  asgn2_device.free_pages++;
+}
+
+/* Preallocates pool_pages pages onto the free list*/
+static int asgn2_fill_pool(void){
+  page_node *curr;
+
+  while(asgn2_device.free_pages < (int)pool_pages){
+    curr = asgn2_alloc_page();
+    if(!curr)
+      return -ENOMEM;
+    list_add(&curr->list, &asgn2_device.free_list);
+    asgn2_device.free_pages++;
+  }
+  asgn2_device.free_low = asgn2_device.free_pages;
+  return 0;
+}
+
+/* Releases the free pages that went unused since the last trim, keeping pool_pages*/
+static void asgn2_trim_pool(void){
+  page_node *curr;
+  int excess;
+
+  mutex_lock(&asgn2_device.lock);
+  excess = min(asgn2_device.free_low, asgn2_device.free_pages - (int)pool_pages);
+  while(excess-- > 0){
+    curr = list_entry(asgn2_device.free_list.prev, page_node, list);
+    list_del(&curr->list);
+    __free_page(curr->page);
+    kfree(curr);
+    asgn2_device.free_pages--;
+  }
+  asgn2_device.free_low = asgn2_device.free_pages;
+  mutex_unlock(&asgn2_device.lock);
+}
+
+
+/* Allocates the slots of an empty page index*/
+static int index_init(page_index *index){
+  index->slots = kmalloc(INDEX_START_SIZE * sizeof(page_node *), GFP_KERNEL);
+  if(!index->slots)
+    return -ENOMEM;
+  index->size = INDEX_START_SIZE;
+  index->first = 0;
+  index->next = 0;
+  return 0;
+}
+
+/* Returns page n of an index, which must be held*/
+static inline page_node *index_page(page_index *index, u64 n){
+  return index->slots[n & (index->size - 1)];
+}
+
+/* Adds a page as the next one of an index, doubling its slots if they are full*/
+static int index_add(page_index *index, page_node *curr){
+  page_node **slots;
+  u64 n;
+
+  if(index->next - index->first == index->size){
+    slots = kmalloc(2 * index->size * sizeof(page_node *), GFP_KERNEL);
+    if(!slots)
+      return -ENOMEM;
+    for(n = index->first; n < index->next; n++)
+      slots[n & (2 * index->size - 1)] = index_page(index, n);
+    kfree(index->slots);
+    index->slots = slots;
+    index->size *= 2;
+  }
+  index->slots[index->next & (index->size - 1)] = curr;
+  index->next++;
+  return 0;
+}
+
+/* Recycles the pages of an index numbered below n*/
+static void index_release(page_index *index, u64 n){
+  while(index->first < n && index->first < index->next){
+    asgn2_put_page(index_page(index, index->first));
+    index->first++;
+  }
+}
+
+/* Recycles the data pages wholly before the head that no copy in progress still reads*/
+static void asgn2_release_pages(void){
+  asgn2_copy *copy;
+  u64 keep = page_queue.head;
+
+  list_for_each_entry(copy, &asgn2_device.copies, list)
+    keep = min(keep, copy->from);
+  index_release(&asgn2_device.data_index, keep >> PAGE_SHIFT);
+  asgn2_device.num_pages = asgn2_device.data_index.next - asgn2_device.data_index.first;
+}
+
+/**
+ * Moves the head of the queue on to head and msg_head, recycling the data
+ * and descriptor pages wholly before them. Called with the device lock held.
+ */
+static void asgn2_set_head(u64 head, u64 msg_head){
+  page_queue.head = head;
+  page_queue.msg_head = msg_head;
+  index_release(&asgn2_device.msg_index, MSG_PAGE(msg_head));
+  asgn2_release_pages();
+  asgn2_device.data_size = page_queue.tail - head;
+}
+
+/**
+ * Moves the head of the queue up to the slowest attached reader. With no
+ * reader attached the data is kept for the next one to open.
+ */
+static void asgn2_update_head(void){
+  asgn2_reader *reader;
+  u64 head = page_queue.tail, msg_head = page_queue.msg_tail;
+  int attached = 0;
+
+  list_for_each_entry(reader, &asgn2_device.readers, list){
+    if(reader->detached || reader->balanced)
+      continue;
+    attached = 1;
+    head = min(head, reader->pos);
+    msg_head = min(msg_head, reader->msg);
+  }
+  if(attached)
+    asgn2_set_head(head, msg_head);
+}
+
+/* Takes one of the max_nprocs places, returning whether there was one*/
+static int asgn2_take_place(void){
+  int nprocs;
+
+  do {
+    nprocs = atomic_read(&asgn2_device.nprocs);
+    if(nprocs >= atomic_read(&asgn2_device.max_nprocs))
+      return 0;
+  } while(atomic_cmpxchg(&asgn2_device.nprocs, nprocs, nprocs + 1) != nprocs);
+  return 1;
+}
+
+/* The cursor a reader reads from: its own, or the group's when it is balanced*/
+static inline asgn2_reader *asgn2_cursor(asgn2_reader *reader){
+  return reader->balanced ? &asgn2_device.group : reader;
+}
+
+/**
+ * Moves a reader into the balanced group or back out of it. The first
+ * member puts the group cursor where it was, and a reader leaving takes
+ * the group's position as its own, so the head never moves back. A
+ * detached reader cannot join. Called with the device lock held.
+ */
+static int asgn2_set_balanced(asgn2_reader *reader, int balanced){
+  asgn2_reader *group = &asgn2_device.group;
+
+  if(reader->balanced == balanced)
+    return 0;
+  if(balanced){
+    if(reader->detached)
+      return -EPIPE;
+    if(asgn2_device.group_members++ == 0){
+      group->pos = reader->pos;
+      group->msg = reader->msg;
+      group->overruns = 0;
+      group->detached = 0;
+      list_add_tail(&group->list, &asgn2_device.readers);
+    }
+  } else {
+    reader->pos = group->pos;
+    reader->msg = group->msg;
+    reader->detached = group->detached;
+    if(--asgn2_device.group_members == 0)
+      list_del(&group->list);
+  }
+  reader->balanced = balanced;
+  asgn2_update_head();
+  return 0;
+}
+
+/**
+ * This function opens the device as a new reader, starting at the oldest
+ * data queued. It will sleep while max_nprocs readers have it open,
+ * or return -EAGAIN instead with O_NONBLOCK.
+ * Will return -EACCES when opened write only, and -EBUSY while the mmap
+ * ring is mapped, as the ring's consumer has the stream to itself. O_RDWR
+ * is allowed so that the mmap ring's control page can be mapped writable.
  */
 int asgn2_open(struct inode *inode, struct file *filp) {
+  asgn2_reader *reader;
+  int result = 0;
+
+  /*Returns -EACCES when device opened write only*/
+  if((filp->f_flags & O_ACCMODE) == O_WRONLY){
+    return -EACCES;
+  }
 
   /*Prevents number of processes from exceeding the max*/
-  if(atomic_read(&asgn2_device.nprocs) >= atomic_read(&asgn2_device.max_nprocs))
+  if(!asgn2_take_place()){
+    if(filp->f_flags & O_NONBLOCK)
+      return -EAGAIN;
     printk(KERN_INFO "Exceeded max number of processes, going to sleep\n");
-    wait_event_interruptible(process_wq, atomic_read(&asgn2_device.nprocs) == 0);
-
-  atomic_inc(&asgn2_device.nprocs);
+    if(wait_event_interruptible(process_wq, asgn2_take_place()))
+      return -ERESTARTSYS;
+  }
 
-  /*Returns -EACCES when device not opened in read only mode*/
-  if((filp->f_flags & O_ACCMODE) != O_RDONLY){
-    return -EACCES;
+  reader = kzalloc(sizeof(asgn2_reader), GFP_KERNEL);
+  if(!reader){
+    result = -ENOMEM;
+    goto fail;
   }
+  mutex_init(&reader->lock);
+  /* the ring lock keeps the reader from appearing while mmap checks it is alone*/
+  mutex_lock(&mring.lock);
+  if(mring.maps){
+    mutex_unlock(&mring.lock);
+    kfree(reader);
+    result = -EBUSY;
+    goto fail;
+  }
+  mutex_lock(&asgn2_device.lock);
+  reader->pos = page_queue.head;
+  reader->msg = page_queue.msg_head;
+  list_add_tail(&reader->list, &asgn2_device.readers);
+  mutex_unlock(&asgn2_device.lock);
+  mutex_unlock(&mring.lock);
+  filp->private_data = reader;
 
   return 0; /* success */
+
+ fail:
+  atomic_dec(&asgn2_device.nprocs);
+  wake_up_interruptible(&process_wq);
+  return result;
 }
 
 
 /**
- * This function resets null_flag and decrements the number of processes when called.
+ * This function drops the file's reader, letting the queue move on past
+ * it, and decrements the number of processes when called.
  * Will wake up any sleeping processes that previously tried to open device
  */
 int asgn2_release (struct inode *inode, struct file *filp) {
+  asgn2_reader *reader = filp->private_data;
+
+  mutex_lock(&asgn2_device.lock);
+  asgn2_set_balanced(reader, 0);
+  list_del(&reader->list);
+  asgn2_update_head();
+  mutex_unlock(&asgn2_device.lock);
+  kfree(reader);
 
   /*Decrements number of processes*/
-  atomic_set(&null_flag, 0);
   atomic_dec(&asgn2_device.nprocs);
   wake_up_interruptible(&process_wq);
   return 0;
 }
 
+/**
+ * Adds a byte to the ring, or counts it as dropped if the ring is full.
+ * Called by the producer only. Returns whether the byte was added.
+ */
+static inline int circ_buffer_put(u8 byte){
+  unsigned int tail = circ_buffer.tail;
+  unsigned int head = smp_load_acquire(&circ_buffer.head);
+
+  if(tail - head >= circ_buffer.size){
+    circ_buffer.dropped++;
+    return 0;
+  }
+  /* the clock is read only when the ring goes from empty to not empty*/
+  if(tail == head)
+    ACCESS_ONCE(circ_buffer.kick_ns) = (unsigned long)ktime_to_ns(ktime_get()) | 1;
+  circ_buffer.buf[tail & (circ_buffer.size - 1)] = byte;
+  smp_store_release(&circ_buffer.tail, tail + 1);
+  return 1;
+}
+
+/* Copies len bytes held in the ring from head on into dst, wrapping at its end*/
+static void circ_buffer_copy(void *dst, unsigned int head, size_t len){
+  unsigned int off = head & (circ_buffer.size - 1);
+  size_t first = min_t(size_t, len, circ_buffer.size - off);
+
+  memcpy(dst, circ_buffer.buf + off, first);
+  memcpy(dst + first, circ_buffer.buf, len - first);
+}
+
+/* Bytes of the count held from head on up to and including the next NUL, or count if there is none*/
+static unsigned int circ_buffer_to_nul(unsigned int head, unsigned int count){
+  unsigned int off = head & (circ_buffer.size - 1);
+  unsigned int first = min(count, circ_buffer.size - off);
+  u8 *p;
+
+  p = memchr(circ_buffer.buf + off, '\0', first);
+  if(p)
+    return p - (circ_buffer.buf + off) + 1;
+  p = memchr(circ_buffer.buf, '\0', count - first);
+  if(p)
+    return first + (p - circ_buffer.buf) + 1;
+  return count;
+}
+
+/**
+ * Gives the bytes before head back to the producer, noting whether the last
+ * of them ended a message. Called by the consumer only.
+ */
+static inline void circ_buffer_release(unsigned int head){
+  if(head != circ_buffer.head)
+    circ_buffer.mid_message = circ_buffer.buf[(head - 1) & (circ_buffer.size - 1)] != '\0';
+  /* the copied bytes may only be reused once head is published*/
+  smp_store_release(&circ_buffer.head, head);
+}
+
 /**
  * Interrupt handler that reads half bytes from gpio and assembles them into full bytes.
- * When a full byte is assembled it is copied into a circular buffer and a tasklet is scheduled
+ * When a full byte is assembled it is added to the ring and the ingest thread is woken.
  */
 irqreturn_t dummyport_interrupt(int irq, void*dev_id){
   
@@ -165,247 +723,833 @@ irqreturn_t dummyport_interrupt(int irq, void*dev_id){
     sig_flag = 0;
   } else {
     half_byte = half_byte | read_half_byte();
-    //printk(KERN_INFO "read least sig\n");
     sig_flag = 1;
-    //add to circular buffer
-    
-    if(CIRC_SPACE(circ_buffer.tail, circ_buffer.head, BUF_SIZE) > 0){
-      circ_buffer.buf[circ_buffer.tail] = half_byte;
-      circ_buffer.tail = (circ_buffer.tail + 1) % BUF_SIZE;
-      tasklet_schedule(&producer);
-    } else if((char)half_byte == '\0'){ //if its a null terminator then write it
-      circ_buffer.buf[circ_buffer.tail] = half_byte;
-      
-    } else {
-      printk(KERN_INFO "BUFFER FULL, Head = %d, Tail = %d\n", circ_buffer.head, circ_buffer.tail);
-    }
-    
+    if(circ_buffer_put(half_byte))
+      wake_up_process(ingest_task);
   }
-    
-  
-  
 
   return IRQ_HANDLED;
 }
 
-
 /**
- * Tasklet code. Copies the contents of the circular buffer into the page queue.
+ * The software source, run from an hrtimer every SOFT_TICK_NS. It produces
+ * soft_rate bytes per second through the same ring as the interrupt handler,
+ * as a stream of sessions each holding the decimal value of a counter, so a
+ * reader can check that no session is lost, torn or reordered.
  */
-void bottom_half(unsigned long t_arg){
+static enum hrtimer_restart soft_source(struct hrtimer *timer){
+  static char msg[24];
+  static int msg_len, msg_pos;
+  static unsigned long seq, credit;
+  unsigned long n;
+
+  credit += ACCESS_ONCE(soft_rate);
+  n = credit / (NSEC_PER_SEC / SOFT_TICK_NS);
+  credit %= NSEC_PER_SEC / SOFT_TICK_NS;
+
+  while(n--){
+    if(msg_pos == msg_len){
+      /* the terminating NUL is part of the session*/
+      msg_len = snprintf(msg, sizeof(msg), "%lu", seq++) + 1;
+      msg_pos = 0;
+    }
+    circ_buffer_put(msg[msg_pos++]);
+  }
+  wake_up_process(ingest_task);
 
-  int count;
- 
-  size_t size_written = 0;  /* size written to virtual disk in this function */
-  size_t begin_offset = 0;   /* the offset from the beginning of a page to start writing */
-  int begin_page_no = page_queue.tail_index; /* the first page this function should start writing to */
- 
-  int curr_offset = page_queue.tail_offset;
-  int curr_page_no = 0;     /* the current page number */
- 
-  size_t size_to_copy;      /* keeps track of how much data is left to copy for a given page*/
-  page_node *curr;        /*pointer to a page node for use with list for each entry loop*/
+  hrtimer_forward_now(timer, ns_to_ktime(SOFT_TICK_NS));
+  return HRTIMER_RESTART;
+}
 
-  /* Lock page queue before any page allocation or writing*/
-  //spin_lock(&page_queue.lock);
-  count = CIRC_CNT(circ_buffer.tail, circ_buffer.head, BUF_SIZE);
-  
-  /* Allocates as many pages as necessary to store count bytes*/
-  while(asgn2_device.num_pages * PAGE_SIZE < asgn2_device.data_size + count){
-    curr = kmalloc(sizeof(page_node), GFP_KERNEL);
-    if(curr){
-      curr->page = alloc_page(GFP_KERNEL);
-    } else {
-      printk(KERN_WARNING "page_node allocation failed\n");
-      return;
+
+/* Records a message ending with the NUL at stream position end*/
+static int asgn2_push_message(u64 end){
+  page_node *curr;
+
+  if(MSG_SLOT(page_queue.msg_tail) == 0){
+    curr = asgn2_get_page();
+    if(!curr)
+      return -ENOMEM;
+    if(index_add(&asgn2_device.msg_index, curr)){
+      asgn2_put_page(curr);
+      return -ENOMEM;
     }
-    if(curr->page == NULL){
-      printk(KERN_WARNING "Page allocation failed\n");
-      return;
+  } else {
+    curr = index_page(&asgn2_device.msg_index, MSG_PAGE(page_queue.msg_tail));
+  }
+  ((u64 *)page_address(curr->page))[MSG_SLOT(page_queue.msg_tail)] = end;
+  page_queue.msg_tail++;
+  return 0;
+}
+
+/* Returns the stream position of the NUL ending message msg, which must be recorded*/
+static inline u64 asgn2_message_end(u64 msg){
+  page_node *curr = index_page(&asgn2_device.msg_index, MSG_PAGE(msg));
+
+  return ((u64 *)page_address(curr->page))[MSG_SLOT(msg)];
+}
+
+/**
+ * Records the messages ending in the len bytes just copied to data, which
+ * start at stream position pos. Returns how many of the bytes were indexed,
+ * which is short of len only if a descriptor page could not be had: the
+ * bytes from the unrecorded NUL on are then left for the next run.
+ */
+static size_t asgn2_index_messages(const u8 *data, size_t len, u64 pos){
+  const u8 *p = data, *end = data + len;
+
+  while((p = memchr(p, '\0', end - p)) != NULL){
+    if(asgn2_push_message(pos + (p - data)))
+      return p - data;
+    p++;
+  }
+  return len;
+}
+
+/**
+ * Moves a cursor on to the first message that starts at limit or later,
+ * found by a binary search of the descriptors. If no recorded message
+ * does, the cursor is put at limit, inside the message still being
+ * received.
+ */
+static void asgn2_skip_to(u64 *pos, u64 *msg, u64 limit){
+  u64 low = *msg, high = page_queue.msg_tail, mid;
+
+  /* finds the first message ending at limit - 1 or later*/
+  while(low < high){
+    mid = low + ((high - low) >> 1);
+    if(asgn2_message_end(mid) + 1 >= limit)
+      high = mid;
+    else
+      low = mid + 1;
+  }
+  if(low < page_queue.msg_tail){
+    *pos = asgn2_message_end(low) + 1;
+    *msg = low + 1;
+  } else {
+    *pos = limit;
+    *msg = low;
+  }
+}
+
+/**
+ * Applies lag_policy to the readers more than lag_limit bytes behind the
+ * tail, and with no reader attached bounds the data kept the same way.
+ * Called by ingest with the device lock held.
+ */
+static void asgn2_enforce_lag(void){
+  asgn2_reader *reader;
+  u64 limit, head, msg_head;
+  int attached = 0;
+
+  if(!lag_limit || page_queue.tail - page_queue.head <= lag_limit)
+    return;
+  limit = page_queue.tail - lag_limit;
+
+  list_for_each_entry(reader, &asgn2_device.readers, list){
+    if(reader->detached || reader->balanced)
+      continue;
+    if(reader->pos < limit){
+      reader->overruns++;
+      if(lag_policy == LAG_DETACH){
+        reader->detached = 1;
+        continue;
+      }
+      asgn2_skip_to(&reader->pos, &reader->msg, limit);
     }
-    list_add_tail(&(curr->list), &asgn2_device.mem_list);
-    asgn2_device.num_pages++;
+    attached = 1;
   }
- 
-  /* Loops through each page in the list and writes the appropriate amount to each one*/
-  list_for_each_entry(curr, &asgn2_device.mem_list, list){
-    if(curr_page_no >= begin_page_no && count > 0){
-      begin_offset = curr_offset % PAGE_SIZE;
-      size_to_copy = min((int)count,(int)( PAGE_SIZE - begin_offset));
-    
-      memcpy(page_address(curr->page) + begin_offset, circ_buffer.buf + circ_buffer.head, size_to_copy);
-      circ_buffer.head = (circ_buffer.head + size_to_copy) % BUF_SIZE;
- 
-      size_written += size_to_copy;
-      count -= size_to_copy;
-      curr_offset += size_to_copy; /* updates curr_offset to correctly calculate begin_offset*/
-      size_to_copy = 0;
-      begin_offset = curr_offset % PAGE_SIZE;
-      // printk(KERN_INFO "offset = %d, count = %d\n", begin_offset, count);
+
+  if(attached){
+    asgn2_update_head();
+  } else {
+    head = page_queue.head;
+    msg_head = page_queue.msg_head;
+    asgn2_skip_to(&head, &msg_head, limit);
+    asgn2_set_head(head, msg_head);
+  }
+}
+
+/**
+ * Allocates the mmap ring, mmap_pages data pages with a descriptor slot for
+ * every 16 bytes of data. Called with the ring lock held.
+ */
+static int asgn2_ring_create(void){
+  u32 data_pages = roundup_pow_of_two(max(mmap_pages, 1U));
+  u32 slots = data_pages * (PAGE_SIZE / 16);
+  u32 msg_pages = DIV_ROUND_UP(slots * sizeof(u32), PAGE_SIZE);
+
+  mring.len = (1 + msg_pages + data_pages) * PAGE_SIZE;
+  mring.base = vmalloc_user(mring.len);
+  if(!mring.base){
+    printk(KERN_WARNING "mmap ring allocation of %zu bytes failed\n", mring.len);
+    return -ENOMEM;
+  }
+  mring.ctl = mring.base;
+  mring.msgs = mring.base + PAGE_SIZE;
+  mring.data = mring.base + (1 + msg_pages) * PAGE_SIZE;
+  mring.size = data_pages * PAGE_SIZE;
+  mring.slots = slots;
+  mring.prod_pos = 0;
+  mring.prod_msg = 0;
+
+  mring.ctl->version = ASGN2_RING_VERSION;
+  mring.ctl->data_pages = data_pages;
+  mring.ctl->msg_pages = msg_pages;
+  mring.ctl->msg_slots = slots;
+  return 0;
+}
+
+/**
+ * Frees the mmap ring once nothing maps it. If ingest was in the middle of
+ * a message its start is gone with the ring, so the rest is dropped rather
+ * than queued as a message of its own. Called with the ring lock held.
+ */
+static void asgn2_ring_destroy(void){
+  vfree(mring.base);
+  mring.base = NULL;
+  mring.ctl = NULL;
+  if(mring.active && circ_buffer.mid_message)
+    mring.resync = 1;
+  mring.active = 0;
+}
+
+/**
+ * Copies the contents of the circular buffer into the mmap ring, recording
+ * the messages that end on the way, as far as the consumer has left room in
+ * both the data and the descriptors. What does not fit waits in the circular
+ * buffer. Called from ingest with the ring lock held. Returns whether the
+ * ring was too full to take everything.
+ */
+static int asgn2_ring_ingest(void){
+  unsigned int head = circ_buffer.head; /* only the consumer moves head */
+  unsigned int count = smp_load_acquire(&circ_buffer.tail) - head;
+  u32 cons_pos = smp_load_acquire(&mring.ctl->cons_pos);
+  u32 cons_msg = smp_load_acquire(&mring.ctl->cons_msg);
+  u32 used = mring.prod_pos - cons_pos;
+  size_t offset, size;
+  u8 *chunk, *p;
+  int full = 0;             /* no room for all of the data */
+  int no_slot = 0;          /* no descriptor slot for a message end */
+
+  /* a consumer position that makes no sense leaves no room rather than letting data be overwritten*/
+  if(used > mring.size)
+    used = mring.size;
+  if(count > mring.size - used){
+    count = mring.size - used;
+    full = 1;
+  }
+
+  while(count > 0){
+    offset = mring.prod_pos & (mring.size - 1);
+    size = min_t(size_t, count, mring.size - offset);
+    chunk = mring.data + offset;
+    circ_buffer_copy(chunk, head, size);
+
+    for(p = chunk; (p = memchr(p, '\0', chunk + size - p)) != NULL; p++){
+      if(mring.prod_msg - cons_msg >= mring.slots){
+        /* the NUL and what follows wait for a free descriptor*/
+        size = p - chunk;
+        no_slot = 1;
+        break;
+      }
+      mring.msgs[mring.prod_msg & (mring.slots - 1)] = mring.prod_pos + (p - chunk);
+      mring.prod_msg++;
     }
-    curr_page_no++;
-    
+    head += size;
+    count -= size;
+    mring.prod_pos += size;
+    if(no_slot)
+      break;
   }
 
-  asgn2_device.data_size += size_written;
+  circ_buffer_release(head);
+  /* data and descriptors are visible before the positions that cover them*/
+  smp_store_release(&mring.ctl->prod_pos, mring.prod_pos);
+  smp_store_release(&mring.ctl->prod_msg, mring.prod_msg);
+  if(full || no_slot)
+    mring.ctl->stalls++;
+  return full || no_slot;
+}
 
-  /* increments page tail if offset is 0*/
-  if(begin_offset == 0){
-  page_queue.tail_index++;
+/**
+ * Copies the contents of the circular buffer into the page queue. Runs in
+ * the ingest thread, so it may sleep in allocations and on the queue lock.
+ * Writing starts in the last page of the queue and a page is added whenever
+ * the tail reaches a page boundary. The message boundaries in each copied
+ * chunk are recorded on the way, with memchr rather than a byte loop. If no
+ * page, index slot or descriptor can be had the rest stays in the ring and
+ * the failure is counted in alloc_failures. While the mmap ring is mapped
+ * the data goes there instead, from the end of the message the queue is
+ * in. Returns whether data was left in the ring, for lack of memory or
+ * because the mmap ring was too full.
+ */
+static int bottom_half(void){
+
+  unsigned int count;
+  unsigned int head = circ_buffer.head; /* only the consumer moves head */
+  size_t begin_offset;      /* the offset into the tail page to start writing */
+  size_t size_to_copy;      /* how much is copied into the tail page this round */
+  size_t indexed;           /* how much of it had its message boundaries recorded */
+  page_node *curr;          /* the tail page */
+  u64 msg_tail = page_queue.msg_tail; /* only ingest moves msg_tail */
+  int wake;                 /* balanced readers to wake */
+  int stalled = 0;          /* memory ran out with data left in the ring */
+  int full;
+  unsigned int skip;
+
+  mutex_lock(&mring.lock);
+  count = smp_load_acquire(&circ_buffer.tail) - head;
+  if(mring.resync){
+    skip = circ_buffer_to_nul(head, count);
+    head += skip;
+    count -= skip;
+    mring.resync_dropped += skip;
+    circ_buffer_release(head);
+    mring.resync = circ_buffer.mid_message;
+    if(mring.resync){
+      mutex_unlock(&mring.lock);
+      return 0;
+    }
+  }
+  if(mring.maps && (mring.active || !circ_buffer.mid_message)){
+    mring.active = 1;
+    full = asgn2_ring_ingest();
+    mutex_unlock(&mring.lock);
+    wake_up_interruptible(&data_wq);
+    return full;
   }
+  /* the queue gets the rest of its message before the ring takes over*/
+  if(mring.maps)
+    count = circ_buffer_to_nul(head, count);
+  mutex_unlock(&mring.lock);
 
-  /*Sets the tail offset to the last offset calculated in the copying loop above*/
-  page_queue.tail_offset = begin_offset;
+  /* Lock page queue before any page allocation or writing*/
+  mutex_lock(&asgn2_device.lock);
 
+  while(count > 0){
+    begin_offset = QUEUE_OFFSET(page_queue.tail);
+    if(begin_offset == 0){
+      curr = asgn2_get_page();
+      if(!curr){
+        stalled = 1;
+        break;
+      }
+      if(index_add(&asgn2_device.data_index, curr)){
+        asgn2_put_page(curr);
+        stalled = 1;
+        break;
+      }
+      asgn2_device.num_pages++;
+    } else {
+      curr = index_page(&asgn2_device.data_index, page_queue.tail >> PAGE_SHIFT);
+    }
 
-  //spin_unlock(&page_queue.lock);
+    size_to_copy = min_t(size_t, count, PAGE_SIZE - begin_offset);
+    circ_buffer_copy(page_address(curr->page) + begin_offset, head, size_to_copy);
+    indexed = asgn2_index_messages(page_address(curr->page) + begin_offset, size_to_copy,
+                                   page_queue.tail);
+    head += indexed;
+    count -= indexed;
+    page_queue.tail += indexed;
+    if(indexed < size_to_copy){
+      stalled = 1;
+      /* a page left empty would break the tail page being the last one*/
+      if(indexed == 0 && begin_offset == 0){
+        asgn2_device.data_index.next--;
+        asgn2_put_page(curr);
+        asgn2_device.num_pages--;
+      }
+      break;
+    }
+  }
+
+  circ_buffer_release(head);
+  asgn2_device.data_size = page_queue.tail - page_queue.head;
+  asgn2_enforce_lag();
+  if(stalled)
+    asgn2_device.alloc_failures++;
+
+  /* one balanced reader per new message, or all of them once the group is detached*/
+  wake = asgn2_device.group_members;
+  if(!asgn2_device.group.detached)
+    wake = min_t(u64, wake, page_queue.msg_tail - msg_tail);
+  mutex_unlock(&asgn2_device.lock);
   
   //wake up read
-  atomic_set(&wait_flag, 0);
   wake_up_interruptible(&data_wq);
-     
+  if(wake)
+    wake_up_interruptible_nr(&group_wq, wake);
+  return stalled;
 }
 
 
+/* Records one ring to queue latency*/
+static void latency_record(unsigned long ns){
+  unsigned long us = ns / NSEC_PER_USEC;
+
+  latency.buckets[min_t(int, us ? fls_long(us) : 0, LATENCY_BUCKETS - 1)]++;
+  latency.samples++;
+  latency.total_ns += ns;
+  if(ns > latency.max_ns)
+    latency.max_ns = ns;
+}
+
 /**
- * This function reads contents of the page queue and writes to the user 
+ * The ingest thread. It sleeps while the ring is empty and is woken by the
+ * producer, then moves everything in the ring into the page queue. Its
+ * priority and cpu are set by ingest_prio and ingest_cpu.
  */
-ssize_t asgn2_read(struct file *filp, char __user *buf, size_t count,
-                   loff_t *f_pos) {
-  size_t size_read = 0;     /* size read from page queue in this function */
-  size_t begin_offset = 0;      /* the offset from the beginning of a page to start reading */
-  int begin_page_no;  /* the first page which contains the requested data */
-  int curr_page_no = 0;     /* the current page number */
-  size_t curr_size_read;    /* size read from the page queue in this round */
-  size_t size_to_be_read;   /* size to be read in the current round in 
-                               while loop */
-  size_t size_to_copy;      /* keeps track of size of data to copy for each page*/
-  size_t actual_size;       /* variable to track total data that hasn't yet been read*/
-  page_node *curr;          /* pointer to a page node for use with list for each entry loop*/
-  page_node *temp;          /* Used for safe page freeing*/
-  
-  int freed = 0; /* The number of freed pages, used to recalculate head and tail indices*/
+static int asgn2_ingest_thread(void *data){
+  unsigned long kicked;
+
+  while(!kthread_should_stop()){
+    set_current_state(TASK_INTERRUPTIBLE);
+    if(smp_load_acquire(&circ_buffer.tail) == circ_buffer.head){
+      /* idle time is used to give back pages the stream no longer needs*/
+      if(time_after_eq(jiffies, asgn2_device.next_trim)){
+        __set_current_state(TASK_RUNNING);
+        asgn2_trim_pool();
+        asgn2_device.next_trim = jiffies + POOL_TRIM_INTERVAL;
+        continue;
+      }
+      schedule_timeout(asgn2_device.next_trim - jiffies);
+      continue;
+    }
+    __set_current_state(TASK_RUNNING);
+
+    kicked = xchg(&circ_buffer.kick_ns, 0);
+    if(kicked)
+      latency_record((unsigned long)ktime_to_ns(ktime_get()) - kicked);
+    /* the mmap consumer frees room and memory comes back without telling anyone, so a stall is retried a tick later*/
+    if(bottom_half())
+      schedule_timeout_interruptible(1);
+  }
+  __set_current_state(TASK_RUNNING);
+  return 0;
+}
 
-  /*If the head offset is pointing at a null terminator then increment head and return 0*/
-  if((int)page_queue.head_offset == null_location){
-    null_location = -1;
-    page_queue.head_offset++;
-    printk(KERN_INFO "returned due to null\n");
-    return 0;
+
+/* Looks up the data pages from page n on for a copy. Called with the device lock held*/
+static void asgn2_copy_map(asgn2_copy *copy, u64 n){
+  unsigned int i;
+
+  copy->first = n;
+  copy->npages = min_t(u64, COPY_PAGES, asgn2_device.data_index.next - n);
+  for(i = 0; i < copy->npages; i++)
+    copy->pages[i] = index_page(&asgn2_device.data_index, n + i);
+}
+
+/* Starts a copy of the queue from stream position from. Called with the device lock held*/
+static void asgn2_copy_begin(asgn2_copy *copy, u64 from){
+  copy->from = from;
+  list_add(&copy->list, &asgn2_device.copies);
+  asgn2_copy_map(copy, from >> PAGE_SHIFT);
+}
+
+/* Ends a copy, recycling the pages only it kept. Called with the device lock held*/
+static void asgn2_copy_end(asgn2_copy *copy){
+  list_del(&copy->list);
+  asgn2_release_pages();
+}
+
+/**
+ * Copies the len bytes at stream position pos, which are queued and not
+ * before the copy's from, to buf. Called without the device lock, which is
+ * only taken to look up more pages. Returns how many bytes were copied,
+ * which is short of len only on a fault.
+ */
+static size_t asgn2_copy_out(asgn2_copy *copy, u64 pos, char __user *buf, size_t len){
+  size_t size_read = 0;     /* size copied so far */
+  size_t begin_offset;      /* the offset into the current page to start reading */
+  size_t size_to_copy;      /* size of data to copy from the current page this round */
+  size_t not_copied;        /* bytes copy_to_user could not copy */
+  page_node *curr;          /* the page holding pos */
+  u64 n;
+
+  while(size_read < len){
+    n = pos >> PAGE_SHIFT;
+    if(n - copy->first >= copy->npages){
+      mutex_lock(&asgn2_device.lock);
+      asgn2_copy_map(copy, n);
+      mutex_unlock(&asgn2_device.lock);
+    }
+    curr = copy->pages[n - copy->first];
+    begin_offset = QUEUE_OFFSET(pos);
+    size_to_copy = min_t(size_t, len - size_read, PAGE_SIZE - begin_offset);
+
+    not_copied = copy_to_user(buf + size_read, page_address(curr->page) + begin_offset,
+                              size_to_copy);
+    size_to_copy -= not_copied;
+    size_read += size_to_copy;
+    pos += size_to_copy;
+    if(not_copied)
+      break;
   }
-  
-  /*If the head and tail index are equal and the head and tail offset are equal then the page queue is considered empty*/
-  if(page_queue.head_index == page_queue.tail_index && page_queue.head_offset == page_queue.tail_offset){
-    atomic_set(&wait_flag, 1);
+  return size_read;
+}
+
+/* Whether a reader has a complete message to read, checked without the lock to wait on*/
+static inline int asgn2_messages_ready(asgn2_reader *reader){
+  return ACCESS_ONCE(reader->msg) != ACCESS_ONCE(page_queue.msg_tail) || ACCESS_ONCE(reader->detached);
+}
+
+/* Whether a reader has any data to read, checked without the lock to wait on*/
+static inline int asgn2_data_ready(asgn2_reader *reader){
+  return ACCESS_ONCE(reader->pos) != ACCESS_ONCE(page_queue.tail) || ACCESS_ONCE(reader->detached);
+}
+
+/**
+ * Waits until there is something for a reader to read and returns 0 with
+ * the device lock held, or an error without it. A balanced reader needs a
+ * complete message and waits for one on group_wq, exclusively so that a
+ * new message wakes only one of the group, and one interrupted by a
+ * signal passes its wakeup on. Other readers wait on data_wq, for any data
+ * past their cursor unless whole is set. While the mmap ring is mapped
+ * nothing reaches the queue, so it fails with -EBUSY.
+ */
+static int asgn2_wait_ready(struct file *filp, asgn2_reader *reader, int whole){
+  asgn2_reader *cursor;
+  int balanced;
+
+  for(;;){
+    mutex_lock(&asgn2_device.lock);
+    cursor = asgn2_cursor(reader);
+    if(cursor->detached){
+      mutex_unlock(&asgn2_device.lock);
+      return -EPIPE;
+    }
+    if(ACCESS_ONCE(mring.maps)){
+      mutex_unlock(&asgn2_device.lock);
+      return -EBUSY;
+    }
+    /* the unlocked checks can be fooled by a torn 64-bit read, so they are made again*/
+    balanced = reader->balanced;
+    if(cursor->msg != page_queue.msg_tail ||
+       (!whole && !balanced && cursor->pos != page_queue.tail))
+      return 0;
+    mutex_unlock(&asgn2_device.lock);
+
+    if(filp->f_flags & O_NONBLOCK)
+      return -EAGAIN;
+    if(balanced){
+      if(wait_event_interruptible_exclusive(group_wq, asgn2_messages_ready(&asgn2_device.group))){
+        /* the wakeup may have been meant for this reader, so another is woken in its place*/
+        if(asgn2_messages_ready(&asgn2_device.group))
+          wake_up_interruptible(&group_wq);
+        return -ERESTARTSYS;
+      }
+    } else if(whole){
+      if(wait_event_interruptible(data_wq, asgn2_messages_ready(reader) || ACCESS_ONCE(mring.maps)))
+        return -ERESTARTSYS;
+    } else {
+      if(wait_event_interruptible(data_wq, asgn2_data_ready(reader) || ACCESS_ONCE(mring.maps)))
+        return -ERESTARTSYS;
+    }
   }
+}
 
-  /* Puts read to sleep until wait_flag == 0 and the wake up signal is sent*/
-  if(atomic_read(&wait_flag) == 1)
-  printk(KERN_INFO "waiting for data\n");
-  wait_event_interruptible(data_wq, atomic_read(&wait_flag) == 0);
+/**
+ * This function reads contents of the page queue from the file's reader
+ * position and writes to the user.
+ * A read stops at the NUL ending a session and the next read returns 0, so
+ * each session is read as one or more reads followed by an end of file.
+ * Where the session ends is known from the message descriptors recorded at
+ * ingest, so the data is not scanned again here. With O_NONBLOCK a read
+ * returns -EAGAIN unless a complete session is queued, as poll reports.
+ * A balanced reader instead takes one whole session from the group per
+ * read, dropping what did not fit. A reader detached by lag_policy gets
+ * -EPIPE. The device lock is only held to find what to read and to move
+ * the cursor on; the copy itself runs without it, so a reader faulting on
+ * its buffer never holds up ingest.
+ */
+ssize_t asgn2_read(struct file *filp, char __user *buf, size_t count,
+                   loff_t *f_pos) {
+  asgn2_reader *reader = filp->private_data;
+  asgn2_reader *cursor;
+  asgn2_copy copy;
+  size_t size_read;         /* size read from page queue in this function */
+  size_t actual_size;       /* data to read in this call*/
+  u64 start;                /* stream position the read starts at */
+  u64 limit;                /* end of the current session, or of the data if it is incomplete */
+  ssize_t result;
+
+  if(mutex_lock_interruptible(&reader->lock))
+    return -ERESTARTSYS;
+  result = asgn2_wait_ready(filp, reader, filp->f_flags & O_NONBLOCK);
+  if(result)
+    goto out;
+  cursor = asgn2_cursor(reader);
+
+  limit = page_queue.tail;
+  if(cursor->msg != page_queue.msg_tail){
+    limit = asgn2_message_end(cursor->msg);
+
+    /*If the reader is at the NUL ending the session then skip it and return 0*/
+    if(cursor->pos == limit && !reader->balanced){
+      cursor->pos++;
+      cursor->msg++;
+      reader->delivered++;
+      asgn2_update_head();
+      mutex_unlock(&asgn2_device.lock);
+      goto out;
+    }
+  }
 
-  //spin_lock(&page_queue.lock);
-  begin_page_no = page_queue.head_index;
+  start = cursor->pos;
+  actual_size = min_t(u64, count, limit - start); /*Calculates the actual size of data to be read*/
+  if(reader->balanced){
+    /* the session is this reader's even on a fault, so no other gets a piece of it*/
+    cursor->pos = limit + 1;
+    cursor->msg++;
+  }
+  asgn2_copy_begin(&copy, start);
+  asgn2_update_head();
+  mutex_unlock(&asgn2_device.lock);
+
+  size_read = asgn2_copy_out(&copy, start, buf, actual_size);
+
+  mutex_lock(&asgn2_device.lock);
+  if(reader->balanced){
+    if(size_read == actual_size)
+      reader->delivered++;
+  } else if(cursor->pos == start){
+    /* unless lag_policy has moved the reader on past it meanwhile*/
+    cursor->pos += size_read;
+  }
+  asgn2_copy_end(&copy);
+  asgn2_update_head();
+  mutex_unlock(&asgn2_device.lock);
+
+  result = size_read;
+  if(size_read < actual_size && (size_read == 0 || reader->balanced))
+    result = -EFAULT;
+ out:
+  mutex_unlock(&reader->lock);
+  return result;
+}
 
-  /* If a null terminator has been found then return*/
-  if(atomic_read(&null_flag) == 1) return 0;
+/* Messages a batch claims under the lock for each unlocked copy*/
+#define BATCH_CHUNK 16
 
-  actual_size = min(count, asgn2_device.data_size - page_queue.head_offset); /*Calculates the acutal size of data to be read*/
-  
-  /* loops through page list and reads the appropriate amount from each page*/
-  list_for_each_entry_safe(curr, temp, &asgn2_device.mem_list, list){
-
-    if(curr_page_no >= begin_page_no){
-
-      size_t min; 
-      struct page *curr_page;
-      unsigned long pointer;
-      size_t byte_count;
-
-      begin_offset = page_queue.head_offset;
-      min =  min((int)actual_size,(int)(PAGE_SIZE - begin_offset));
-      size_to_copy = min;
-      curr_page = page_address(curr->page);
-
-      pointer = (unsigned long)curr_page + begin_offset;
-      
-      /*Searches the page for a null terminator from page head offset until the end or
-        until the number of bytes to be read is reached. Then calculates the number of bytes to copy
-        and sets a flag to say that a null terminator has been found*/
-      for(byte_count = 0; byte_count + pointer < min + pointer; byte_count++){
-        
-        if(*((u8*)(pointer+byte_count)) == '\0'){
-
-          int temp = PAGE_SIZE - (byte_count + begin_offset);
-          printk(KERN_INFO "Found a null at page position %d\n", begin_offset+byte_count);
-          size_to_copy = ((PAGE_SIZE - begin_offset) - temp);
-          atomic_set(&null_flag, 1);
+/**
+ * Reads a batch of messages for ASGN2_READ_BATCH. Each message is copied
+ * straight from the queue pages to the user buffer, its end coming from the
+ * descriptors recorded at ingest. The lock is taken once for every
+ * BATCH_CHUNK messages, to find them and then to move the cursor past the
+ * ones copied, and not held while copying. A fault leaves the message it
+ * hit and those after it to be read again, except by a balanced reader,
+ * whose group has already moved on past the messages it claimed. A batch
+ * stops early if lag_policy detaches the reader while it copies. With
+ * O_NONBLOCK it returns -EAGAIN instead of waiting.
+ */
+static long asgn2_read_batch(struct file *filp, unsigned long arg){
+  asgn2_reader *reader = filp->private_data;
+  asgn2_reader *cursor;
+  struct asgn2_batch batch;
+  struct asgn2_msg plan[BATCH_CHUNK]; /* the messages claimed for this copy */
+  u64 ends[BATCH_CHUNK];    /* positions of the NULs ending them */
+  struct asgn2_msg __user *msgs;
+  char __user *buf;
+  asgn2_copy copy;
+  size_t used = 0;          /* bytes of buf filled */
+  size_t planned;           /* bytes of buf the claimed messages fill */
+  size_t len;               /* length of the current message */
+  u64 from, pos;
+  long nmsgs = 0;
+  int n, i;
+
+  if(copy_from_user(&batch, (void __user *)arg, sizeof(batch)))
+    return -EFAULT;
+  if(batch.buf_len == 0 || batch.max_msgs == 0 || batch.max_msgs > ASGN2_BATCH_MAX)
+    return -EINVAL;
+  buf = (char __user *)(unsigned long)batch.buf;
+  msgs = (struct asgn2_msg __user *)(unsigned long)batch.msgs;
+
+  if(mutex_lock_interruptible(&reader->lock))
+    return -ERESTARTSYS;
+  nmsgs = asgn2_wait_ready(filp, reader, 1);
+  if(nmsgs)
+    goto out;
+  cursor = asgn2_cursor(reader);
+
+  while(nmsgs < batch.max_msgs && cursor->msg != page_queue.msg_tail){
+    /* finds the next messages that fit*/
+    from = pos = cursor->pos;
+    planned = used;
+    for(n = 0; n < BATCH_CHUNK && nmsgs + n < batch.max_msgs && cursor->msg + n != page_queue.msg_tail; n++){
+      ends[n] = asgn2_message_end(cursor->msg + n);
+      len = ends[n] - pos;
+      plan[n].offset = planned;
+      plan[n].flags = 0;
+      plan[n].pad = 0;
+      if(len > batch.buf_len - planned){
+        if(nmsgs + n > 0)
           break;
-        }
+        plan[n].flags = ASGN2_MSG_TRUNC;
       }
-
-      while(size_to_copy > 0){
-        size_to_be_read = copy_to_user(buf + size_read, page_address(curr->page) + begin_offset,
-                                       size_to_copy);
-        curr_size_read = size_to_copy - size_to_be_read;
-        size_to_copy= size_to_be_read;
-        actual_size -= curr_size_read;
-        size_read += curr_size_read;
-   
-        page_queue.head_offset = (page_queue.head_offset + curr_size_read) % PAGE_SIZE;
-        begin_offset = page_queue.head_offset;
-      }
-      
+      plan[n].len = min_t(size_t, len, batch.buf_len - planned);
+      planned += plan[n].len;
+      /* passes what did not fit along with the NUL*/
+      pos = ends[n] + 1;
+    }
+    if(n == 0)
+      break;
+    if(reader->balanced){
+      cursor->pos = pos;
+      cursor->msg += n;
+    }
+    asgn2_copy_begin(&copy, from);
+    asgn2_update_head();
+    mutex_unlock(&asgn2_device.lock);
+
+    pos = from;
+    for(i = 0; i < n; i++){
+      if(asgn2_copy_out(&copy, pos, buf + plan[i].offset, plan[i].len) < plan[i].len ||
+         copy_to_user(msgs + nmsgs + i, &plan[i], sizeof(plan[i])))
+        break;
+      pos = ends[i] + 1;
     }
 
-    /*If at the start of a page then free the previous page*/
-    if(begin_offset == 0){
-      page_queue.head_index++;
-      //free previous page
-      __free_page(curr->page);
-      list_del(&curr->list);
-      kfree(curr);
-      freed++;
-      curr_page_no++;
-      asgn2_device.num_pages--;
-      }
-    
-    if(atomic_read(&null_flag) == 1) break;
+    mutex_lock(&asgn2_device.lock);
+    /* unless lag_policy has moved the reader on past them meanwhile*/
+    if(!reader->balanced && cursor->pos == from){
+      cursor->pos = pos;
+      cursor->msg += i;
+    }
+    asgn2_copy_end(&copy);
+    reader->delivered += i;
+    nmsgs += i;
+    if(i < n){
+      if(nmsgs == 0)
+        nmsgs = -EFAULT;
+      break;
+    }
+    /* a detached cursor is left behind the head, where the pages may already be recycled*/
+    if(cursor->detached){
+      if(nmsgs == 0)
+        nmsgs = -EPIPE;
+      break;
+    }
+    used = planned;
   }
-  
-  /*Recalculate page queue head and tail indices*/
-  page_queue.head_index -= freed;
-  page_queue.tail_index -= freed;
+  asgn2_update_head();
+  mutex_unlock(&asgn2_device.lock);
+ out:
+  mutex_unlock(&reader->lock);
+  return nmsgs;
+}
 
-  /*If a null flag has been set then set the null_location global*/
-  if(atomic_read(&null_flag) == 1){
-    null_location = page_queue.head_offset;
+/**
+ * Reports the device readable once a complete message is queued past the
+ * file's reader, so readers can wait in poll/select/epoll alongside sockets
+ * instead of blocking in read. The check takes no lock, so on 32-bit hosts
+ * a torn read of the message counters can give a spurious POLLIN, which a
+ * non-blocking read answers with -EAGAIN. A reader detached by lag_policy
+ * gets POLLERR. Balanced readers all wait on the group, so every one of
+ * them polling is woken by a new message and all but one read -EAGAIN;
+ * blocking in read or ASGN2_READ_BATCH wakes just one. While the mmap ring
+ * is mapped, readable only means it holds messages the consumer has not
+ * taken.
+ */
+static unsigned int asgn2_poll(struct file *filp, poll_table *wait){
+  asgn2_reader *reader = filp->private_data;
+  asgn2_reader *cursor = asgn2_cursor(reader);
+  unsigned int mask = 0;
+
+  poll_wait(filp, reader->balanced ? &group_wq : &data_wq, wait);
+  mutex_lock(&mring.lock);
+  if(mring.maps){
+    if(mring.prod_msg != smp_load_acquire(&mring.ctl->cons_msg))
+      mask |= POLLIN | POLLRDNORM;
+    mutex_unlock(&mring.lock);
+    return mask;
   }
+  mutex_unlock(&mring.lock);
 
-  //spin_unlock(&page_queue.lock);
-  
-  asgn2_device.data_size -= freed * PAGE_SIZE;
-  
-  return size_read;
+  if(ACCESS_ONCE(cursor->detached))
+    mask |= POLLERR;
+  else if(asgn2_messages_ready(cursor))
+    mask |= POLLIN | POLLRDNORM;
+  return mask;
+}
+
+static void asgn2_ring_vm_open(struct vm_area_struct *vma){
+  mutex_lock(&mring.lock);
+  mring.maps++;
+  mutex_unlock(&mring.lock);
 }
 
-#define SET_NPROC_OP 1
-#define TEM_SET_NPROC _IOW(MYIOC_TYPE, SET_NPROC_OP, int) 
+/* Frees the ring with its last mapping, after which ingest goes back to the page queue*/
+static void asgn2_ring_vm_close(struct vm_area_struct *vma){
+  mutex_lock(&mring.lock);
+  if(--mring.maps == 0)
+    asgn2_ring_destroy();
+  mutex_unlock(&mring.lock);
+}
+
+static struct vm_operations_struct asgn2_ring_vm_ops = {
+  .open = asgn2_ring_vm_open,
+  .close = asgn2_ring_vm_close
+};
 
 /**
- * The ioctl function, which is used to set the maximum allowed number of concurrent processes.
+ * Maps the mmap ring, creating it for the first mapping. The mapping has to
+ * be shared and start at offset 0, and it may cover less than the ring, e.g.
+ * only the control page to learn the layout first. The first mapping fails
+ * with -EBUSY unless the file is the only one open and is not balanced, as
+ * read() gets nothing while the ring is mapped. Reads already waiting are
+ * woken to fail with -EBUSY.
+ */
+static int asgn2_mmap(struct file *filp, struct vm_area_struct *vma){
+  asgn2_reader *reader = filp->private_data;
+  int result = 0;
+
+  if(vma->vm_pgoff != 0 || !(vma->vm_flags & VM_SHARED))
+    return -EINVAL;
+
+  mutex_lock(&mring.lock);
+  if(!mring.maps){
+    mutex_lock(&asgn2_device.lock);
+    if(!list_is_singular(&asgn2_device.readers) || reader->balanced)
+      result = -EBUSY;
+    mutex_unlock(&asgn2_device.lock);
+  }
+  if(!result && !mring.base)
+    result = asgn2_ring_create();
+  if(!result && vma->vm_end - vma->vm_start > mring.len)
+    result = -EINVAL;
+  if(!result)
+    result = remap_vmalloc_range(vma, mring.base, 0);
+  if(!result){
+    vma->vm_ops = &asgn2_ring_vm_ops;
+    mring.maps++;
+  } else if(mring.base && !mring.maps){
+    asgn2_ring_destroy();
+  }
+  mutex_unlock(&mring.lock);
+  if(!result)
+    wake_up_interruptible(&data_wq);
+  return result;
+}
+
+/**
+ * The ioctl function, which is used to set the maximum allowed number of concurrent processes
+ * and to read batches of messages.
  */
 long asgn2_ioctl (struct file *filp, unsigned cmd, unsigned long arg) {
+  asgn2_reader *reader = filp->private_data;
   int nr = _IOC_NR(cmd);
   int new_nprocs;
+  int mode;
   int result;
 
   
   /* checks that the command is for this device*/
   if(_IOC_TYPE(cmd) != MYIOC_TYPE) return -EINVAL;
 
-  /* checks that the given command is the only one that exists*/
-  if(nr == SET_NPROC_OP){
+  switch(nr){
+  case SET_NPROC_OP:
     if(!access_ok(VERIFY_READ, arg, sizeof(cmd))){ /* verifies that access is allowed*/
       return -EFAULT;
     } else {
@@ -425,6 +1569,24 @@ long asgn2_ioctl (struct file *filp, unsigned cmd, unsigned long arg) {
       printk(KERN_INFO "max_nprocs now = %d\n", new_nprocs);
       return 0;
     }
+
+  case READ_BATCH_OP:
+    return asgn2_read_batch(filp, arg);
+
+  case SET_DELIVERY_OP:
+    if(get_user(mode, (int __user *)arg))
+      return -EFAULT;
+    if(mode != ASGN2_DELIVER_BROADCAST && mode != ASGN2_DELIVER_BALANCE)
+      return -EINVAL;
+
+    /* not while one of the file's reads is using its cursor*/
+    if(mutex_lock_interruptible(&reader->lock))
+      return -ERESTARTSYS;
+    mutex_lock(&asgn2_device.lock);
+    result = asgn2_set_balanced(reader, mode == ASGN2_DELIVER_BALANCE);
+    mutex_unlock(&asgn2_device.lock);
+    mutex_unlock(&reader->lock);
+    return result;
   }
   
   return -ENOTTY;
@@ -434,20 +1596,73 @@ long asgn2_ioctl (struct file *filp, unsigned cmd, unsigned long arg) {
 /**
  * Displays information about current status of the module,
  * which helps debugging. Outputs num_pages, max_nprocs, data_size,
- * and num_procs.
+ * and num_procs, then a line for each reader and for the balanced group.
  */
 int asgn2_read_procmem(char *buf, char **start, off_t offset, int count,
                        int *eof, void *data) {
+  asgn2_reader *reader;
+  int len, i = 0;
+
+  *eof = 1;
+  len = snprintf(buf, count, "Num Pages = %d\nData Size = %zu\n Num Procs = %d\n Max Procs = %d\n"
+                  " Ring Size = %u\n Ring Bytes = %u\n Dropped = %lu\n Free Pages = %d\n Messages = %llu\n"
+                  " Alloc Failures = %lu\n Resync Dropped = %lu\n",
+                  asgn2_device.num_pages, asgn2_device.data_size, atomic_read(&asgn2_device.nprocs), atomic_read(&asgn2_device.max_nprocs),
+                  circ_buffer.size, ACCESS_ONCE(circ_buffer.tail) - ACCESS_ONCE(circ_buffer.head),
+                  ACCESS_ONCE(circ_buffer.dropped), ACCESS_ONCE(asgn2_device.free_pages),
+                  (unsigned long long)(ACCESS_ONCE(page_queue.msg_tail) - ACCESS_ONCE(page_queue.msg_head)),
+                  ACCESS_ONCE(asgn2_device.alloc_failures), ACCESS_ONCE(mring.resync_dropped));
+
+  /* one line per reader: how far behind it is, what it has read and what lag_policy did to it*/
+  mutex_lock(&asgn2_device.lock);
+  list_for_each_entry(reader, &asgn2_device.readers, list){
+    if(len >= count)
+      break;
+    if(reader == &asgn2_device.group)
+      len += snprintf(buf + len, count - len, " Group: lag = %llu members = %d overruns = %lu%s\n",
+                      (unsigned long long)(page_queue.tail - reader->pos), asgn2_device.group_members,
+                      reader->overruns, reader->detached ? " detached" : "");
+    else if(reader->balanced)
+      len += snprintf(buf + len, count - len, " Reader %d: balanced delivered = %lu\n",
+                      i++, reader->delivered);
+    else
+      len += snprintf(buf + len, count - len, " Reader %d: lag = %llu delivered = %lu overruns = %lu%s\n",
+                      i++, (unsigned long long)(page_queue.tail - reader->pos), reader->delivered,
+                      reader->overruns, reader->detached ? " detached" : "");
+  }
+  mutex_unlock(&asgn2_device.lock);
+  return min(len, count);
+}
+
+/**
+ * Shows the ring to queue latency histogram, for tuning ingest_prio and
+ * ingest_cpu. Writing anything to the entry clears it.
+ */
+int asgn2_read_latency(char *buf, char **start, off_t offset, int count,
+                       int *eof, void *data) {
+  int len, i;
 
   *eof = 1;
-  return snprintf(buf, count, "Num Pages = %d\nData Size = %d\n Num Procs = %d\n Max Procs = %d\n",
-                  asgn2_device.num_pages, asgn2_device.data_size, atomic_read(&asgn2_device.nprocs), atomic_read(&asgn2_device.max_nprocs));
+  len = snprintf(buf, count, "samples %lu\nmean_ns %llu\nmax_ns %lu\nus count\n", latency.samples,
+                 latency.samples ? div64_u64(latency.total_ns, latency.samples) : 0, latency.max_ns);
+  for(i = 0; i < LATENCY_BUCKETS && len < count; i++){
+    if(latency.buckets[i])
+      len += snprintf(buf + len, count - len, "<%lu %lu\n", 1UL << i, latency.buckets[i]);
+  }
+  return min(len, count);
+}
 
+int asgn2_write_latency(struct file *file, const char __user *buf, unsigned long count,
+                        void *data) {
+  memset(&latency, 0, sizeof(latency));
+  return count;
 }
 
 struct file_operations asgn2_fops = {
   .owner = THIS_MODULE,
   .read = asgn2_read,
+  .poll = asgn2_poll,
+  .mmap = asgn2_mmap,
   .unlocked_ioctl = asgn2_ioctl,
   .open = asgn2_open,
   .release = asgn2_release
@@ -463,10 +1678,50 @@ int __init asgn2_init_module(void){
   /* initialise device struct values*/
   printk(KERN_INFO "asgn_2_init: I am alive\n");
   atomic_set(&asgn2_device.nprocs, 0);
-  atomic_set(&asgn2_device.max_nprocs, 1);
+  atomic_set(&asgn2_device.max_nprocs, max(max_readers, 1U));
   asgn2_device.num_pages = 0;
   asgn2_device.data_size = 0;
 
+  /*Allocates the ring, whose size has to be a power of two for masking*/
+  circ_buffer.size = roundup_pow_of_two(max(ring_size, 2U));
+  circ_buffer.buf = kmalloc(circ_buffer.size, GFP_KERNEL);
+  if(!circ_buffer.buf){
+    printk(KERN_WARNING "ring allocation of %u bytes failed\n", circ_buffer.size);
+    return -ENOMEM;
+  }
+
+  /*Fills the page pool so the first bursts do not hit the allocator*/
+  mutex_init(&asgn2_device.lock);
+  mutex_init(&mring.lock);
+  INIT_LIST_HEAD(&asgn2_device.readers);
+  INIT_LIST_HEAD(&asgn2_device.copies);
+  asgn2_device.group_members = 0;
+  INIT_LIST_HEAD(&asgn2_device.free_list);
+  asgn2_device.free_pages = 0;
+  asgn2_device.next_trim = jiffies + POOL_TRIM_INTERVAL;
+  if(index_init(&asgn2_device.data_index) || index_init(&asgn2_device.msg_index) ||
+     asgn2_fill_pool()){
+    printk(KERN_WARNING "could not allocate the page indexes and %u pool pages\n", pool_pages);
+    free_memory_pages();
+    kfree(circ_buffer.buf);
+    return -ENOMEM;
+  }
+
+  /*Creates the ingest thread, which sleeps until the source starts*/
+  ingest_task = kthread_create(asgn2_ingest_thread, NULL, "asgn2_ingest");
+  if(IS_ERR(ingest_task)){
+    printk(KERN_WARNING "ingest thread creation failed\n");
+    result = PTR_ERR(ingest_task);
+    ingest_task = NULL;
+    free_memory_pages();
+    kfree(circ_buffer.buf);
+    return result;
+  }
+  result = asgn2_ingest_tune();
+  if(result)
+    printk(KERN_WARNING "could not apply ingest_prio or ingest_cpu: %d\n", result);
+  wake_up_process(ingest_task);
+
   /* dynamically allocates a major and minor number to the device*/
   asgn2_device.dev = MKDEV(asgn2_major, asgn2_minor);
   result = alloc_chrdev_region(&asgn2_device.dev, asgn2_minor, asgn2_dev_count, MYDEV_NAME);
@@ -487,8 +1742,6 @@ int __init asgn2_init_module(void){
     goto fail_device;
   }
   printk(KERN_INFO "asgn_2_init: still alive after character device initialisation\n");
-  INIT_LIST_HEAD(&asgn2_device.mem_list);
-  printk(KERN_INFO "asgn_2_init: still alive after init list head\n");
 
   /* creates a proc entry and adds the read method to it*/
   asgn2_proc = create_proc_entry(MYDEV_NAME, 0, NULL);
@@ -501,23 +1754,24 @@ int __init asgn2_init_module(void){
 
   asgn2_proc->read_proc = asgn2_read_procmem;
 
-  /*Init gpio*/
-  gpio_dummy_init();
-   
+  latency_proc = create_proc_entry(MYDEV_NAME "_latency", 0644, NULL);
+  if(latency_proc){
+    latency_proc->read_proc = asgn2_read_latency;
+    latency_proc->write_proc = asgn2_write_latency;
+  } else {
+    printk(KERN_WARNING "Failed to initialise /proc/%s_latency\n", MYDEV_NAME);
+  }
+
   /*Initialise circular buffer*/
   circ_buffer.head = 0;
   circ_buffer.tail = 0;
+  circ_buffer.dropped = 0;
   
   /*Initialise page queue struct*/
-  page_queue.head_index = 0;
-  page_queue.tail_index = 0;
-  page_queue.head_offset = 0;
-  page_queue.tail_offset = 0;
-  //spin_lock_init(&page_queue.lock);
-  
-  /*Init wait and null flag*/
-  atomic_set(&null_flag, 0);
-  atomic_set(&wait_flag, 1);
+  page_queue.head = 0;
+  page_queue.tail = 0;
+  page_queue.msg_head = 0;
+  page_queue.msg_tail = 0;
   
   asgn2_device.class = class_create(THIS_MODULE, MYDEV_NAME);
   if (IS_ERR(asgn2_device.class)) {
@@ -532,6 +1786,17 @@ int __init asgn2_init_module(void){
     goto fail_device;
   }
   
+  /*Starts the data source once everything it feeds is ready*/
+  soft_started = soft_rate != 0;
+  if(soft_started){
+    hrtimer_init(&soft_timer, CLOCK_MONOTONIC, HRTIMER_MODE_REL);
+    soft_timer.function = soft_source;
+    hrtimer_start(&soft_timer, ns_to_ktime(SOFT_TICK_NS), HRTIMER_MODE_REL);
+    printk(KERN_INFO "software source at %u bytes/s\n", soft_rate);
+  } else {
+    gpio_dummy_init();
+  }
+
   printk(KERN_WARNING "set up udev entry\n");
   printk(KERN_WARNING "Hello world from %s\n", MYDEV_NAME);
   return 0;
@@ -543,6 +1808,8 @@ int __init asgn2_init_module(void){
   switch(failstep){
 
   case 0:
+    if(latency_proc)
+      remove_proc_entry(MYDEV_NAME "_latency", NULL);
     remove_proc_entry(MYDEV_NAME, NULL);
     cdev_del(asgn2_device.cdev);
     unregister_chrdev_region(asgn2_device.dev, asgn2_dev_count);
@@ -555,6 +1822,9 @@ int __init asgn2_init_module(void){
     unregister_chrdev_region(asgn2_device.dev, asgn2_dev_count);
     break;
   }
+  kthread_stop(ingest_task);
+  free_memory_pages();
+  kfree(circ_buffer.buf);
   
   return result;
 }
@@ -564,6 +1834,13 @@ int __init asgn2_init_module(void){
  * Finalise the module. Deallocates everything in the correct order.
  */
 void __exit asgn2_exit_module(void){
+  /*Stops the data source before anything it feeds goes away*/
+  if(soft_started)
+    hrtimer_cancel(&soft_timer);
+  else
+    gpio_dummy_exit();
+  kthread_stop(ingest_task);
+
   device_destroy(asgn2_device.class, asgn2_device.dev);
   class_destroy(asgn2_device.class);
   printk(KERN_WARNING "cleaned up udev entry\n");
@@ -572,8 +1849,10 @@ void __exit asgn2_exit_module(void){
   printk(KERN_INFO"successfully freed pages\n");
   if(asgn2_proc)
   remove_proc_entry(MYDEV_NAME, NULL);
+  if(latency_proc)
+    remove_proc_entry(MYDEV_NAME "_latency", NULL);
 
-  gpio_dummy_exit();
+  kfree(circ_buffer.buf);
   cdev_del(asgn2_device.cdev);
   printk(KERN_INFO"successfully deleted device\n");
   unregister_chrdev_region(asgn2_device.dev, asgn2_dev_count);